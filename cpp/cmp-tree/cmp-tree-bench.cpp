@@ -0,0 +1,650 @@
+/* C++ includes */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* C includes */
+#include <getopt.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "cmp-tree.hpp"
+#include "cmp-tree-internal.hpp"
+#include "dir-entries.hpp"
+#include "file-info.hpp"
+#include "path-table.hpp"
+#include "prefetcher.hpp"
+#include "thread-pool.hpp"
+#include "tree-walk.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* The synthetic directory trees: this many top level directories, each
+ * with this many subdirectories of this many files */
+#define BENCH_TREE_DIRS 16
+#define BENCH_TREE_SUBDIRS 4
+#define BENCH_TREE_FILES 64
+/* The files of the trees are between these many bytes long */
+#define BENCH_TREE_MIN_FILE_SIZE 1024
+#define BENCH_TREE_MAX_FILE_SIZE 4096
+/* The number of names in the directory listing that is sorted */
+#define BENCH_SORT_NAMES (64 * 1024)
+/* How long each benchmark is run for, in milliseconds, by default */
+#define BENCH_TARGET_MS_DEFAULT 200
+/* The most times any operation is run in one measurement */
+#define BENCH_MAX_ITERS 1000000
+/* The most times an operation is run while its system calls are counted,
+ * since tracing slows every system call down a great deal */
+#define BENCH_MAX_TRACED_ITERS 16
+
+
+/* The body of a benchmark. It sets up whatever its operation needs, calls
+ * 'mark' once it is ready, performs the operation 'iters' times and calls
+ * 'mark' again, so that only the operations themselves are measured. Every
+ * thread it starts must have exited by the time it returns */
+typedef std::function<void(size_t iters, const std::function<void()> &mark)> \
+	BenchBody;
+
+typedef struct benchmark {
+	std::string name;
+	/* The number of bytes each operation reads (or sorts), or 0 if a rate
+	 * means nothing for the operation */
+	uint64_t bytes_per_op;
+	BenchBody body;
+}Benchmark;
+
+typedef struct bench_result {
+	size_t iters;
+	double ns_per_op;
+	/* The number of system calls per operation, or -1 if they couldn't be
+	 * counted */
+	double syscalls_per_op;
+}BenchResult;
+
+
+/** Returns the current time on the steady clock in nanoseconds.
+ *
+ * \return the time in nanoseconds.
+ */
+static int64_t now_ns() {
+	/* {{{ */
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( \
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	/* }}} */
+}
+
+
+/** Returns the next number from a xorshift generator, so that the corpora
+ * are the same on every run.
+ *
+ * \param '*state' the state of the generator. It must not be 0.
+ * \return a pseudo-random number.
+ */
+static uint64_t next_random(uint64_t *state) {
+	/* {{{ */
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+	/* }}} */
+}
+
+
+/** Writes 'size' pseudo-random bytes generated from 'seed' to the file at
+ * '&path', so that two files written with the same seed are identical.
+ *
+ * \param '&path' the file path of the file to create.
+ * \param 'size' the number of bytes to write.
+ * \param 'seed' the seed of the content. It must not be 0.
+ * \return 0 on success, -1 on failure.
+ */
+static int write_file(const fs::path &path, size_t size, uint64_t seed) {
+	/* {{{ */
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	std::vector<uint64_t> buf(64 * 1024 / sizeof(uint64_t));
+
+	size_t written = 0;
+	while (out && written < size) {
+		for (size_t i = 0; i < buf.size(); i++) {
+			buf[i] = next_random(&seed);
+		}
+		size_t len = std::min(size - written, buf.size() * sizeof(uint64_t));
+		out.write((const char *) buf.data(), (std::streamsize) len);
+		written += len;
+	}
+	out.close();
+
+	return out ? 0 : -1;
+	/* }}} */
+}
+
+
+/** Creates two identical synthetic directory trees, '&corpus' / "first" and
+ * '&corpus' / "second", of small files spread over two levels of
+ * directories.
+ *
+ * \param '&corpus' the directory to create the trees in.
+ * \return 0 on success, -1 on failure.
+ */
+static int write_trees(const fs::path &corpus) {
+	/* {{{ */
+	const char *tree_names[] = { "first", "second" };
+
+	for (const char *tree_name : tree_names) {
+		uint64_t state = 0x9e3779b97f4a7c15;
+		for (int d = 0; d < BENCH_TREE_DIRS; d++) {
+			for (int s = 0; s < BENCH_TREE_SUBDIRS; s++) {
+				char name[64];
+				snprintf(name, sizeof(name), "dir-%02d/sub-%d", d, s);
+				fs::path dir_path = corpus / tree_name / name;
+				std::error_code ec;
+				fs::create_directories(dir_path, ec);
+				if (ec) {
+					return -1;
+				}
+
+				for (int f = 0; f < BENCH_TREE_FILES; f++) {
+					snprintf(name, sizeof(name), "file-%03d.dat", f);
+					size_t size = BENCH_TREE_MIN_FILE_SIZE \
+						+ next_random(&state) % (BENCH_TREE_MAX_FILE_SIZE \
+						- BENCH_TREE_MIN_FILE_SIZE + 1);
+					if (write_file(dir_path / name, size, \
+						next_random(&state) | 1) != 0) {
+						return -1;
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Returns a directory listing of 'n' made up names in no particular
+ * order. Half of them share long prefixes (like the files a camera or a
+ * build writes) and the rest are random, so that the sort sees both.
+ *
+ * \param 'n' the number of names.
+ * \return the entries of the listing.
+ */
+static std::vector<DirEntry> made_up_entries(size_t n) {
+	/* {{{ */
+	std::vector<DirEntry> entries(n);
+	uint64_t state = 0x2545f4914f6cdd1d;
+
+	for (size_t i = 0; i < n; i++) {
+		char name[64];
+		uint64_t r = next_random(&state);
+		if (i % 2 == 0) {
+			snprintf(name, sizeof(name), "IMG_%06u.jpg", \
+				(unsigned) (r % 1000000));
+		} else {
+			snprintf(name, sizeof(name), "%016llx", (unsigned long long) r);
+		}
+		entries[i].name = name;
+		entries[i].type = DT_REG;
+	}
+
+	return entries;
+	/* }}} */
+}
+
+
+/** Runs '&bench' with 'iters' operations and returns how long the
+ * operations took.
+ *
+ * \param '&bench' the benchmark to run.
+ * \param 'iters' the number of operations.
+ * \return the time the operations took, in nanoseconds.
+ */
+static int64_t time_benchmark(Benchmark &bench, size_t iters) {
+	/* {{{ */
+	int64_t marks[2] = { 0, 0 };
+	int num_marks = 0;
+	bench.body(iters, [&] {
+		if (num_marks < 2) {
+			marks[num_marks++] = now_ns();
+		}
+	});
+
+	return marks[1] - marks[0];
+	/* }}} */
+}
+
+
+/** Runs '&bench' with 'iters' operations in a child process traced with
+ * ptrace(), and counts the system calls the child and every thread it
+ * starts make between the two marks. Each mark is a SIGUSR1 the child
+ * sends itself, which the tracer sees (and swallows) before the child does.
+ *
+ * \param '&bench' the benchmark to run.
+ * \param 'iters' the number of operations.
+ * \return the number of system calls, or -1 if the child couldn't be
+ *     traced.
+ */
+static long count_syscalls(Benchmark &bench, size_t iters) {
+	/* {{{ */
+	std::cout.flush();
+	pid_t child = fork();
+	if (child == -1) {
+		return -1;
+	}
+
+	if (child == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) {
+			_exit(1);
+		}
+		raise(SIGSTOP);
+		bench.body(iters, [] { raise(SIGUSR1); });
+		_exit(0);
+	}
+
+	int status;
+	if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status)) {
+		return -1;
+	}
+	ptrace(PTRACE_SETOPTIONS, child, NULL, (void *) (long) \
+		(PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL));
+	ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+	bool counting = false;
+	bool traced = true;
+	long count = 0;
+	/* Whether each thread is stopped at the entry to a system call rather
+	 * than the exit */
+	std::unordered_map<pid_t, bool> in_syscall;
+	pid_t tid;
+	while ((tid = waitpid(-1, &status, __WALL)) != -1) {
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			if (tid == child && WIFEXITED(status) \
+				&& WEXITSTATUS(status) != 0) {
+				traced = false;
+			}
+			in_syscall.erase(tid);
+			continue;
+		}
+
+		long sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+			bool &inside = in_syscall[tid];
+			if (!inside && counting) {
+				count++;
+			}
+			inside = !inside;
+		} else if ((status >> 16) != 0) {
+			/* A new thread is being started, which is traced too */
+		} else if (WSTOPSIG(status) == SIGUSR1) {
+			counting = !counting;
+		} else if (WSTOPSIG(status) != SIGSTOP) {
+			/* New threads start out stopped by a SIGSTOP, which is swallowed.
+			 * Every other signal is passed on */
+			sig = WSTOPSIG(status);
+		}
+		ptrace(PTRACE_SYSCALL, tid, NULL, (void *) sig);
+	}
+
+	return traced ? count : -1;
+	/* }}} */
+}
+
+
+/** Measures '&bench', running its operation as many times as fit in about
+ * 'target_ms' milliseconds.
+ *
+ * \param '&bench' the benchmark to run.
+ * \param 'target_ms' roughly how long the operations should take.
+ * \param 'marker_syscalls' the number of system calls the marks themselves
+ *     make, which are not counted against the operations.
+ * \return the result of the benchmark.
+ */
+static BenchResult run_benchmark(Benchmark &bench, uint64_t target_ms, \
+	long marker_syscalls) {
+	/* {{{ */
+	BenchResult ret;
+
+	/* Run the operation once to warm the page cache (and anything set up on
+	 * first use) up, once more to find out roughly how long it takes, then
+	 * enough times to fill the target */
+	time_benchmark(bench, 1);
+	int64_t once = std::max(time_benchmark(bench, 1), (int64_t) 1);
+	ret.iters = (size_t) std::clamp((int64_t) (target_ms * 1000000) / once, \
+		(int64_t) 1, (int64_t) BENCH_MAX_ITERS);
+	ret.ns_per_op = (double) time_benchmark(bench, ret.iters) / ret.iters;
+
+	size_t traced_iters = std::min(ret.iters, (size_t) BENCH_MAX_TRACED_ITERS);
+	long syscalls = count_syscalls(bench, traced_iters);
+	if (syscalls == -1) {
+		ret.syscalls_per_op = -1;
+	} else {
+		ret.syscalls_per_op = (double) std::max(syscalls - marker_syscalls, \
+			0L) / traced_iters;
+	}
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Prints the result of a benchmark as one row of the results table.
+ *
+ * \param '&bench' the benchmark that was run.
+ * \param '&result' the result of the benchmark.
+ */
+static void print_result(Benchmark &bench, BenchResult &result) {
+	/* {{{ */
+	char rate[32] = { "-" };
+	if (bench.bytes_per_op != 0) {
+		snprintf(rate, sizeof(rate), "%.1f", \
+			bench.bytes_per_op / result.ns_per_op * 1e9 / (1024 * 1024));
+	}
+	char syscalls[32] = { "-" };
+	if (result.syscalls_per_op >= 0) {
+		snprintf(syscalls, sizeof(syscalls), "%.1f", result.syscalls_per_op);
+	}
+
+	printf("%-32s %9zu %14.1f %11s %12s\n", bench.name.c_str(), result.iters, \
+		result.ns_per_op, rate, syscalls);
+	fflush(stdout);
+	/* }}} */
+}
+
+
+/** Creates the benchmarks, which run against the corpus in '&corpus'.
+ *
+ * \param '&corpus' the directory the corpus was written to.
+ * \param 'num_jobs' the number of workers of the thread pools the
+ *     benchmarks that walk trees use.
+ * \param '&file_sizes' the sizes of the pairs of files compared by the
+ *     compare_files() benchmarks.
+ * \return the benchmarks, in the order they are run.
+ */
+static std::vector<Benchmark> make_benchmarks(const fs::path &corpus, \
+	size_t num_jobs, const std::vector<size_t> &file_sizes) {
+	/* {{{ */
+	std::vector<Benchmark> ret;
+	fs::path first_root = corpus / "first";
+	fs::path second_root = corpus / "second";
+
+	/* One walk of a whole tree, through relative_files_in_tree() */
+	ret.push_back({ "walk", 0, [=](size_t iters, \
+		const std::function<void()> &mark) {
+		fs::path root = first_root;
+		ThreadPool pool(num_jobs);
+		mark();
+		for (size_t i = 0; i < iters; i++) {
+			TreeWalk walk(root, false);
+			DirListing listing;
+			files_in_tree(pool, root, walk, listing);
+			pool.wait_idle();
+		}
+		mark();
+	} });
+
+	/* One sort of a big directory listing, as the walk sorts each
+	 * directory */
+	std::vector<DirEntry> sort_entries = made_up_entries(BENCH_SORT_NAMES);
+	uint64_t sort_bytes = 0;
+	for (DirEntry &e : sort_entries) {
+		sort_bytes += e.name.size();
+	}
+	ret.push_back({ "sort/" + std::to_string(BENCH_SORT_NAMES) + "-names", \
+		sort_bytes, [=](size_t iters, const std::function<void()> &mark) {
+		std::vector<DirEntry> entries = sort_entries;
+		mark();
+		for (size_t i = 0; i < iters; i++) {
+			std::vector<size_t> order = sorted_entry_order(entries);
+		}
+		mark();
+	} });
+
+	/* One merge of the listings of both trees into a sorted union without
+	 * duplicates */
+	ret.push_back({ "merge-listings", 0, [=](size_t iters, \
+		const std::function<void()> &mark) {
+		fs::path first = first_root;
+		fs::path second = second_root;
+		DirListing first_listing;
+		DirListing second_listing;
+		{
+			ThreadPool pool(num_jobs);
+			TreeWalk first_walk(first, false);
+			TreeWalk second_walk(second, false);
+			files_in_tree(pool, first, first_walk, first_listing);
+			files_in_tree(pool, second, second_walk, second_listing);
+			pool.wait_idle();
+		}
+		mark();
+		for (size_t i = 0; i < iters; i++) {
+			PathTable paths;
+			merge_listings(paths, PATH_ID_ROOT, &first_listing, \
+				&second_listing);
+		}
+		mark();
+	} });
+
+	/* One comparison of a pair of the small files of the trees, taking
+	 * each pair in turn. Both files of an average pair are read */
+	uint64_t tree_file_bytes = BENCH_TREE_MIN_FILE_SIZE \
+		+ BENCH_TREE_MAX_FILE_SIZE;
+	ret.push_back({ "compare-path", tree_file_bytes, [=](size_t iters, \
+		const std::function<void()> &mark) {
+		fs::path first = first_root;
+		fs::path second = second_root;
+		PathTable paths;
+		{
+			ThreadPool pool(num_jobs);
+			sorted_union_of_trees(first, second, pool, false, paths);
+		}
+		std::vector<PathId> files;
+		for (PathId id = PATH_ID_ROOT + 1; id < paths.size(); id++) {
+			if (paths.node(id).first_hint == DT_REG) {
+				files.push_back(id);
+			}
+		}
+		CompareOptions opts = { BACKEND_AUTO, MMAP_THRESHOLD_DEFAULT, \
+			NULL, false, false, false, NULL, false, 0, \
+			PREFETCH_BUDGET_DEFAULT, false, NULL, NULL };
+
+		mark();
+		for (size_t i = 0; i < iters; i++) {
+			const PathNode &node = paths.node(files[i % files.size()]);
+			fs::path rel = paths.path(files[i % files.size()]);
+			fs::path first_path = first / rel;
+			fs::path second_path = second / rel;
+			compare_path(first_path, second_path, node.first_hint, \
+				node.second_hint, opts);
+		}
+		mark();
+	} });
+
+	/* One comparison of a pair of identical files (so every byte is read)
+	 * with each backend */
+	struct {
+		const char *name;
+		enum CompareBackend backend;
+	} backends[] = {
+		{ "stream", BACKEND_STREAM },
+		{ "mmap", BACKEND_MMAP },
+		{ "uring", BACKEND_URING },
+	};
+	for (size_t size : file_sizes) {
+		fs::path first_file = corpus / ("a-" + std::to_string(size));
+		fs::path second_file = corpus / ("b-" + std::to_string(size));
+		for (auto &b : backends) {
+			enum CompareBackend backend = b.backend;
+			ret.push_back({ std::string("compare-files/") + b.name + "/" \
+				+ std::to_string(size), 2 * size, [=](size_t iters, \
+				const std::function<void()> &mark) {
+				fs::path first = first_file;
+				fs::path second = second_file;
+				CompareOptions opts = { backend, MMAP_THRESHOLD_DEFAULT, \
+					NULL, false, false, false, NULL, false, 0, \
+					PREFETCH_BUDGET_DEFAULT, false, NULL, NULL };
+				mark();
+				for (size_t i = 0; i < iters; i++) {
+					FileInfo first_info = { true, fs::file_type::regular, \
+						false, {} };
+					FileInfo second_info = first_info;
+					PartialFileComparison cmp;
+					compare_files(first, second, first_info, second_info, \
+						opts, &cmp);
+				}
+				mark();
+			} });
+		}
+	}
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Prints the usage of the program.
+ *
+ * \param '*prog' the name the program was run as.
+ */
+static void print_usage(const char *prog) {
+	/* {{{ */
+	std::cout << "Usage: " << prog << " [-j N] [-t MS] [-d DIR] [FILTER]...\n" \
+		"Runs the microbenchmarks whose names contain any of the FILTERs (or\n" \
+		"all of them), against corpora written to a temporary directory in\n" \
+		"DIR (by default $TMPDIR or /tmp) that is removed afterwards.\n\n" \
+		"  -j N   the number of workers of the walks' thread pools\n" \
+		"  -t MS  roughly how long to run each benchmark for\n" \
+		"  -d DIR where to write the corpora\n";
+	/* }}} */
+}
+
+
+int main(int argc, char **argv) {
+	size_t num_jobs = default_num_jobs();
+	uint64_t target_ms = BENCH_TARGET_MS_DEFAULT;
+	const char *tmp_dir = getenv("TMPDIR");
+	if (tmp_dir == NULL || tmp_dir[0] == '\0') {
+		tmp_dir = "/tmp";
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:hj:t:")) != -1) {
+		switch (opt) {
+			case 'd': tmp_dir = optarg; break;
+			case 'j':
+				num_jobs = strtoul(optarg, NULL, 10);
+				if (num_jobs == 0) {
+					std::cout << "Number of jobs must be a positive integer, " \
+						"received \"" << optarg << "\". Exiting...\n";
+					return -1;
+				}
+				break;
+			case 't':
+				target_ms = strtoull(optarg, NULL, 10);
+				if (target_ms == 0) {
+					std::cout << "Target time must be a positive number of " \
+						"milliseconds, received \"" << optarg << "\". " \
+						"Exiting...\n";
+					return -1;
+				}
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return -1;
+		}
+	}
+	std::vector<std::string> filters(argv + optind, argv + argc);
+
+	std::string corpus_template = \
+		(fs::path(tmp_dir) / "cmp-tree-bench.XXXXXX").string();
+	if (mkdtemp(corpus_template.data()) == NULL) {
+		std::cout << "Could not create a directory for the corpora in \"" \
+			<< tmp_dir << "\". Exiting...\n";
+		return -1;
+	}
+	fs::path corpus = corpus_template;
+
+	std::vector<size_t> file_sizes = \
+		{ 4 * 1024, 1024 * 1024, 32 * 1024 * 1024 };
+	int ret = 0;
+	if (write_trees(corpus) != 0) {
+		ret = -1;
+	}
+	for (size_t size : file_sizes) {
+		if (ret != 0) {
+			break;
+		}
+		if (write_file(corpus / ("a-" + std::to_string(size)), size, 1) != 0 \
+			|| write_file(corpus / ("b-" + std::to_string(size)), size, 1) \
+			!= 0) {
+			ret = -1;
+		}
+	}
+	if (ret != 0) {
+		std::cout << "Could not write the corpora to \"" << corpus.string() \
+			<< "\". Exiting...\n";
+		std::error_code ec;
+		fs::remove_all(corpus, ec);
+		return -1;
+	}
+
+	/* The marks make a few system calls of their own, which are taken off
+	 * every count */
+	Benchmark empty = { "", 0, [](size_t iters, \
+		const std::function<void()> &mark) {
+		mark();
+		mark();
+	} };
+	long marker_syscalls = std::max(count_syscalls(empty, 0), 0L);
+
+	printf("Corpus: 2 trees of %d files of %d-%d bytes in %d directories, " \
+		"%d names to sort\n", \
+		BENCH_TREE_DIRS * BENCH_TREE_SUBDIRS * BENCH_TREE_FILES, \
+		BENCH_TREE_MIN_FILE_SIZE, BENCH_TREE_MAX_FILE_SIZE, \
+		BENCH_TREE_DIRS * (BENCH_TREE_SUBDIRS + 1), BENCH_SORT_NAMES);
+	printf("Walks use %zu worker(s). Files are read from a warm page " \
+		"cache.\n\n", num_jobs);
+	printf("%-32s %9s %14s %11s %12s\n", "benchmark", "iters", "ns/op", \
+		"MiB/s", "syscalls/op");
+
+	std::vector<Benchmark> benchmarks = \
+		make_benchmarks(corpus, num_jobs, file_sizes);
+	for (Benchmark &bench : benchmarks) {
+		bool wanted = filters.empty();
+		for (std::string &f : filters) {
+			if (bench.name.find(f) != std::string::npos) {
+				wanted = true;
+			}
+		}
+		if (!wanted) {
+			continue;
+		}
+
+		BenchResult result = run_benchmark(bench, target_ms, marker_syscalls);
+		print_result(bench, result);
+	}
+
+	std::error_code ec;
+	fs::remove_all(corpus, ec);
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef CMP_TREE_INTERNAL_HPP
+#define CMP_TREE_INTERNAL_HPP
+
+/* C++ includes */
+#include <cstddef>
+#include <filesystem>
+#include <vector>
+
+/* Local includes */
+#include "cmp-tree.hpp"
+#include "dir-entries.hpp"
+#include "file-info.hpp"
+#include "path-table.hpp"
+#include "thread-pool.hpp"
+#include "tree-walk.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* The parts of cmp-tree.cpp that the microbenchmarks (cmp-tree-bench.cpp)
+ * measure on their own */
+std::vector<size_t> sorted_entry_order(std::vector<DirEntry> &entries);
+void files_in_tree(ThreadPool &pool, fs::path &root, TreeWalk &walk, \
+	DirListing &listing);
+void merge_listings(PathTable &paths, PathId parent, DirListing *first, \
+	DirListing *second);
+void sorted_union_of_trees(fs::path &first_root, fs::path &second_root, \
+	ThreadPool &pool, bool follow_symlinks, PathTable &paths);
+int compare_files(fs::path &first_path, fs::path &second_path, \
+	FileInfo &first_info, FileInfo &second_info, CompareOptions &opts, \
+	PartialFileComparison *cmp);
+PartialFileComparison compare_path(fs::path &first_path, \
+	fs::path &second_path, unsigned char first_hint, \
+	unsigned char second_hint, CompareOptions &opts);
+
+#endif
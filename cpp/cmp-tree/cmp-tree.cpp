@@ -1,14 +1,21 @@
 /* C++ includes */
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <mutex>
 #include <vector>
 
 /* C includes */
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <sys/stat.h>
@@ -18,6 +25,23 @@
 
 /* Local includes */
 #include "cmp-tree.hpp"
+#include "cmp-tree-internal.hpp"
+#include "compare-backends.hpp"
+#include "content-hash.hpp"
+#include "dir-entries.hpp"
+#include "disk-order.hpp"
+#include "file-info.hpp"
+#include "hash-cache.hpp"
+#include "io-scheduler.hpp"
+#include "manifest.hpp"
+#include "merkle-index.hpp"
+#include "name-sort.hpp"
+#include "path-table.hpp"
+#include "prefetcher.hpp"
+#include "read-throttle.hpp"
+#include "reorder-buffer.hpp"
+#include "thread-pool.hpp"
+#include "tree-walk.hpp"
 
 namespace fs = std::filesystem;
 
@@ -35,141 +59,583 @@ char CYAN[] = { "\x1B[36m" };
 char WHITE[] = { "\x1B[37m" };
 
 
-/** Returns an unsorted vector list of relative file paths for all files (in the broad
- * sense of the word, including links and directories, as well as hidden files)
- * in a directory tree rooted at the directory pointed to by the path
- * '&root' / '&extension'. The file paths included in the list will all
- * begin with '&extension', but not '&root'.
+/** Reads the entries of the directory pointed to by '&dir_path' into
+ * '&entries' and records, for each entry, whether a walk of the directory
+ * tree should descend into it (see TreeWalk::descend_into()).
  *
+ * \param '&dir_path' the file path to the directory to be read.
+ * \param '&entries' the list the directory entries will be appended to.
+ * \param '&descend' a list that will be extended in parallel with
+ *     '&entries', where each element is true if the corresponding entry
+ *     should be walked into.
+ * \param '&walk' the walk of the tree the directory is in.
+ * \return 0 if the directory was opened and read, -1 otherwise.
+ */
+int list_directory(fs::path &dir_path, std::vector<DirEntry> &entries, \
+	std::vector<bool> &descend, TreeWalk &walk) {
+	/* {{{ */
+
+	int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1) {
+		return -1;
+	}
+
+	size_t first_new = entries.size();
+	int ret = read_dir_entries(dir_fd, entries);
+
+	for (size_t i = first_new; i < entries.size(); i++) {
+		descend.push_back(walk.descend_into(dir_path, dir_fd, entries[i].name, \
+			entries[i].type));
+	}
+	close(dir_fd);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Returns the order the entries of a directory listing should be visited in
+ * so that they are sorted by name. The names are radix sorted on their raw
+ * bytes, which gives the same order as comparing them as std::strings.
+ *
+ * \param '&entries' the directory listing to be sorted.
+ * \return a list of indices into '&entries', ordered so that the names of
+ *     the entries they refer to are in ascending order.
+ */
+std::vector<size_t> sorted_entry_order(std::vector<DirEntry> &entries) {
+	/* {{{ */
+	std::vector<size_t> ret(entries.size());
+	for (size_t i = 0; i < ret.size(); i++) {
+		ret[i] = i;
+	}
+
+	std::vector<size_t> scratch(ret.size());
+	radix_sort_entries(entries, ret.data(), ret.size(), 0, scratch.data());
+
+	return ret;
+	/* }}} */
+}
+
+
+void relative_files_in_tree(ThreadPool &pool, fs::path &root, \
+	TreeWalk &walk, fs::path &extension, DirListing *listing);
+
+
+/** Fills in '*listing' from the entries of the directory
+ * '&root' / '&extension', in the order given by '&order', and submits a
+ * task to '&pool' to walk each entry that is to be descended into.
+ *
+ * \param '&pool' the thread pool subdirectories will be walked on.
+ * \param '&root' the file path to the root of the directory tree. It must
+ *     outlive the walk.
+ * \param '&walk' the walk of the tree. It must outlive the walk.
+ * \param '&extension' the path of the directory, relative to '&root'.
+ * \param '*listing' the listing to fill in. It must outlive the walk.
+ * \param '&entries' the entries of the directory.
+ * \param '&descend' whether each entry should be walked into.
+ * \param '&order' the indices of the entries, sorted by name.
+ */
+void fill_listing(ThreadPool &pool, fs::path &root, TreeWalk &walk, \
+	fs::path &extension, DirListing *listing, std::vector<DirEntry> &entries, \
+	std::vector<bool> &descend, std::vector<size_t> &order) {
+	/* {{{ */
+	listing->name_starts.reserve(order.size() + 1);
+	listing->types.reserve(order.size());
+	listing->subdirs.reserve(order.size());
+	for (size_t i: order) {
+		listing->name_starts.push_back((uint32_t) listing->names.size());
+		listing->names += entries[i].name;
+		listing->types.push_back(entries[i].type);
+		listing->subdirs.emplace_back();
+
+		/* If the current element is a directory, walk it as a separate
+		 * task. Symlinks have to wait until the walk can tell whether they
+		 * are the first link to their directory */
+		if (descend[i] && entries[i].type == DT_LNK) {
+			listing->dir_links.push_back((uint32_t) listing->types.size() - 1);
+		} else if (descend[i]) {
+			listing->subdirs.back() = std::make_unique<DirListing>();
+			DirListing *sub = listing->subdirs.back().get();
+			fs::path file_rp = extension / entries[i].name;
+			pool.submit([&pool, &root, &walk, file_rp, sub]() mutable {
+				relative_files_in_tree(pool, root, walk, file_rp, sub);
+			});
+		}
+	}
+	listing->name_starts.push_back((uint32_t) listing->names.size());
+	/* }}} */
+}
+
+
+/* The state of a directory whose entries are being sorted by several tasks
+ * at once (see sort_listing_in_parallel()) */
+typedef struct pending_listing {
+	std::vector<DirEntry> entries;
+	std::vector<bool> descend;
+	std::vector<size_t> order;
+	std::vector<size_t> scratch;
+	fs::path extension;
+	TreeWalk *walk;
+	DirListing *listing;
+	/* The number of tasks (plus the task that split the entries up) that
+	 * have yet to finish sorting their share of the entries */
+	std::atomic<size_t> remaining;
+}PendingListing;
+
+
+/** Marks one share of a pending directory's entries as sorted. Whichever
+ * task sorts the last share fills in the directory's listing.
+ *
+ * \param '&pool' the thread pool the tree is being walked on.
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&pending' the directory whose entries are being sorted.
+ */
+void finish_pending_listing(ThreadPool &pool, fs::path &root, \
+	std::shared_ptr<PendingListing> &pending) {
+	/* {{{ */
+	if (pending->remaining.fetch_sub(1) == 1) {
+		fill_listing(pool, root, *pending->walk, pending->extension, \
+			pending->listing, pending->entries, pending->descend, \
+			pending->order);
+	}
+	/* }}} */
+}
+
+
+/** Sorts the entries of a very large directory with several tasks and then
+ * fills in its listing. The entries are split into buckets by the first
+ * byte of their names, and each bucket is radix sorted by a task of its
+ * own, so a single huge directory doesn't leave every other worker idle.
+ *
+ * \param '&pool' the thread pool the tree is being walked on.
+ * \param '&root' the file path to the root of the directory tree. It must
+ *     outlive the walk.
+ * \param '&walk' the walk of the tree. It must outlive the walk.
+ * \param '&extension' the path of the directory, relative to '&root'.
+ * \param '*listing' the listing to fill in. It must outlive the walk.
+ * \param '&entries' the entries of the directory, which are moved from.
+ * \param '&descend' whether each entry should be walked into, which is
+ *     moved from.
+ */
+void sort_listing_in_parallel(ThreadPool &pool, fs::path &root, \
+	TreeWalk &walk, fs::path &extension, DirListing *listing, \
+	std::vector<DirEntry> &entries, std::vector<bool> &descend) {
+	/* {{{ */
+	std::shared_ptr<PendingListing> pending = \
+		std::make_shared<PendingListing>();
+	size_t n = entries.size();
+
+	pending->entries = std::move(entries);
+	pending->descend = std::move(descend);
+	pending->order.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		pending->order[i] = i;
+	}
+	pending->scratch.resize(n);
+	pending->extension = extension;
+	pending->walk = &walk;
+	pending->listing = listing;
+
+	size_t bucket_starts[NAME_SORT_NUM_BUCKETS + 1];
+	radix_partition_entries(pending->entries, pending->order.data(), n, 0, \
+		pending->scratch.data(), bucket_starts);
+
+	/* Hold on to one share ourselves until every task has been submitted, so
+	 * that the listing can't be filled in while we're still submitting */
+	pending->remaining.store(1);
+	for (size_t b = 1; b < NAME_SORT_NUM_BUCKETS; b++) {
+		size_t start = bucket_starts[b];
+		size_t len = bucket_starts[b + 1] - start;
+		if (len < 2) {
+			continue;
+		}
+
+		pending->remaining.fetch_add(1);
+		pool.submit([&pool, &root, pending, start, len]() mutable {
+			radix_sort_entries(pending->entries, pending->order.data() + start, \
+				len, 1, pending->scratch.data() + start);
+			finish_pending_listing(pool, root, pending);
+		});
+	}
+	finish_pending_listing(pool, root, pending);
+	/* }}} */
+}
+
+
+/** Lists the directory '&root' / '&extension' into '*listing' and walks
+ * every subdirectory of it, so that once the walk is done '*listing' holds
+ * every file (in the broad sense of the word, including links and
+ * directories, as well as hidden files) in the directory tree rooted there.
+ *
+ * Only the directory '&root' / '&extension' itself is read by this call, and
+ * it is read with read_dir_entries() so that the type of each entry comes
+ * from the directory listing rather than from a stat() of its full path.
+ * The entries are sorted here, so every directory is sorted by the worker
+ * that read it (or, for very large directories, by several workers), and
+ * their names are packed into a single string rather than
+ * a path each. Every subdirectory found is submitted to '&pool' as a task of
+ * its own, so the whole tree has only been listed once the pool is idle.
+ *
+ * \param '&pool' the thread pool subdirectories will be walked on.
  * \param '&root' the beginning of the file path to the directory for which we wish
  *     to get a list of all the files in the directory tree. It will be combined
- *     with '&extension' to produce the complete path.
+ *     with '&extension' to produce the complete path. It must outlive the walk.
+ * \param '&walk' the walk of the tree, which decides which entries are
+ *     walked into. It must outlive the walk.
  * \param '&extension' the end of the file path to the directory for which we wish
  *     to get a list of all the files in the directory tree. It will be combined
  *     with '&root' to produce the complete path.
- * \return an unsorted vector list of the relative file paths for all the files
- *     in the directory tree rooted at '&root' / '&extension'. The file paths
- *     included in the list will omit '&root' from their path, but include
- *     '&extension'.
+ * \param '*listing' the listing to fill in. It must outlive the walk.
  */
-std::vector<fs::path> relative_files_in_tree( \
-	fs::path &root, fs::path &extension) {
+void relative_files_in_tree(ThreadPool &pool, fs::path &root, \
+	TreeWalk &walk, fs::path &extension, DirListing *listing) {
 	/* {{{ */
 
-	std::vector<fs::path> ret;
 	fs::path dir_path = root / extension;
 
-	DIR *dir;
-	/* If we are able to open the directory successfully */
-	if ((dir = opendir(dir_path.c_str())) != NULL) {
-		struct dirent *dir_entry;
-		while ((dir_entry = readdir(dir)) != NULL) {
-			fs::path file_name(dir_entry->d_name);
-			/* Only includes files that are not the special "." and ".."
-			 * entries */
-			if (0 != file_name.compare(".") && 0 != file_name.compare("..")) {
-				fs::path file_fp = dir_path / file_name;
-				fs::path file_rp = extension / file_name;
-				ret.push_back(file_rp);
-
-				/* If the current element is a directory... */
-				if (fs::is_directory(file_fp)) {
-					/* Recurse and append the sub directory relative file
-					 * paths */
-					std::vector<fs::path> sub_dir_files = \
-						relative_files_in_tree(root, file_rp);
-					ret.insert(ret.end(), sub_dir_files.begin(), sub_dir_files.end());
-				}
+	std::vector<DirEntry> entries;
+	std::vector<bool> descend;
+	listing->complete = \
+		(list_directory(dir_path, entries, descend, walk) == 0);
+	/* If we are NOT able to read the directory successfully */
+	if (!listing->complete) {
+		walk.report_unreadable(dir_path);
+	}
+
+	if (entries.size() >= NAME_SORT_PARALLEL_THRESHOLD && pool.size() > 1) {
+		sort_listing_in_parallel(pool, root, walk, extension, listing, \
+			entries, descend);
+		return;
+	}
+
+	std::vector<size_t> order = sorted_entry_order(entries);
+	fill_listing(pool, root, walk, extension, listing, entries, descend, \
+		order);
+	/* }}} */
+}
+
+
+/** Starts walking the directory tree rooted at the directory pointed to by
+ * '&root' on '&pool', filling in '&listing' with every file (in the broad
+ * sense of the word, including links and directories, as well as hidden
+ * files) in the tree. Once the pool is idle, all of the tree has been walked
+ * but for the symlinks to directories (if symlinks are followed), which
+ * walk_linked_directories() walks afterwards.
+ *
+ * \param '&pool' the thread pool the directory tree will be walked on.
+ * \param '&root' the file path to the directory for which we wish to get
+ *     a list of all the files in the directory tree. It must outlive the walk.
+ * \param '&walk' the walk of the tree. It must outlive the walk.
+ * \param '&listing' the listing of the root directory. It must outlive the
+ *     walk.
+ */
+void files_in_tree(ThreadPool &pool, fs::path &root, TreeWalk &walk, \
+	DirListing &listing) {
+	/* {{{ */
+	DirListing *root_listing = &listing;
+	pool.submit([&pool, &root, &walk, root_listing] {
+		fs::path extension = "";
+		relative_files_in_tree(pool, root, walk, extension, root_listing);
+	});
+	/* }}} */
+}
+
+
+/** Walks the symlinks to directories that a walk of the tree rooted at
+ * '&root' put off (see fill_listing()) once the rest of the walk is done.
+ * The links are claimed (see TreeWalk::claim_link()) in sorted path order,
+ * depth first, so that of several links to the same directory it is always
+ * the first in that order that gets walked into, however the workers
+ * happened to interleave. Each link that is walked is walked on '&pool',
+ * and the links within it are then claimed in turn. It must be called from
+ * a thread that isn't one of the pool's workers, once the pool is idle.
+ *
+ * \param '&pool' the thread pool the links will be walked on.
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&walk' the walk of the tree.
+ * \param '&extension' the path of the directory, relative to '&root'.
+ * \param '&listing' the listing of the directory.
+ */
+void walk_linked_directories(ThreadPool &pool, fs::path &root, \
+	TreeWalk &walk, fs::path &extension, DirListing &listing) {
+	/* {{{ */
+	if (!walk.follows_symlinks()) {
+		return;
+	}
+
+	size_t next_link = 0;
+	for (size_t i = 0; i < listing.types.size(); i++) {
+		bool is_link = (next_link < listing.dir_links.size() \
+			&& listing.dir_links[next_link] == i);
+		if (!is_link && listing.subdirs[i] == nullptr) {
+			continue;
+		}
+
+		fs::path file_rp = extension / std::string_view(listing.names).substr( \
+			listing.name_starts[i], \
+			listing.name_starts[i + 1] - listing.name_starts[i]);
+		if (is_link) {
+			next_link++;
+			if (!walk.claim_link(root / file_rp)) {
+				continue;
 			}
+			listing.subdirs[i] = std::make_unique<DirListing>();
+			DirListing *sub = listing.subdirs[i].get();
+			pool.submit([&pool, &root, &walk, file_rp, sub]() mutable {
+				relative_files_in_tree(pool, root, walk, file_rp, sub);
+			});
+			pool.wait_idle();
 		}
-		closedir(dir);
-	/* If we are NOT able to open the directory successfully */
-	} else {
-		std::cout << "Was not able to open the directory\n";
+		walk_linked_directories(pool, root, walk, file_rp, *listing.subdirs[i]);
 	}
+	/* }}} */
+}
 
-	return ret;
+
+/** Returns the STATX_* fields that comparing regular files with '&opts'
+ * needs, so that nothing else is asked for.
+ *
+ * \param '&opts' the options that decide how regular files are compared.
+ * \return a mask of STATX_* flags.
+ */
+unsigned int file_info_mask(CompareOptions &opts) {
+	/* {{{ */
+	/* The device and inode numbers find paths that lead to the same file, and
+	 * files of different sizes can't match */
+	unsigned int mask = STATX_INO | STATX_SIZE;
+
+	if (opts.quick) {
+		mask |= STATX_MODE | STATX_MTIME;
+	}
+	/* The hash cache is keyed by both times */
+	if (opts.cache != NULL) {
+		mask |= STATX_MTIME | STATX_CTIME;
+	}
+
+	return mask;
 	/* }}} */
 }
 
 
-/** Returns an unsorted vector list of file paths for all the files (in the broad
- * sense of the word, including links and directories, as well as hidden
- * files) in a directory tree rooted at the directory pointed to by '&root'.
+/** Takes two paths to regular files of the same size and returns 0 if the
+ * files are byte-for-byte identical, and -1 if they are not, reading them
+ * with the hash cache or backend '&opts' asks for. Files on a rotational
+ * device are always read in large chunks (see compare_files_chunked())
+ * rather than with the backend, since the backends read both files at
+ * once, which makes the disk seek back and forth between them. Huge files
+ * on other devices are compared with compare_files_parallel(). In
+ * cache-neutral mode, every file is read with
+ * compare_files_cache_neutral().
  *
- * \param '&dir_path' the file path to the directory for which we wish to get
- *     a list of all the files in the directory tree.
- * \return an unsorted vector list of the relative file paths for all the files
- *     in the directory tree rooted at '&root'.
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param '&first_info' what is known about the first file. It must have
+ *     been stat'd.
+ * \param '&second_info' what is known about the second file. It must have
+ *     been stat'd.
+ * \param '&opts' the options that decide how the files are read.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if they are read and a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
  */
-std::vector<fs::path> files_in_tree(fs::path &root) {
+int compare_file_contents(fs::path &first_path, fs::path &second_path, \
+	FileInfo &first_info, FileInfo &second_info, CompareOptions &opts, \
+	off_t *mismatch_offset) {
 	/* {{{ */
-	fs::path extension = "";
-	return relative_files_in_tree(root, extension);
+	struct stat &first_file_info = first_info.st;
+	struct stat &second_file_info = second_info.st;
+
+	/* In cache-neutral mode, hashes that are already cached still save
+	 * reading identical files, but the files that are read aren't hashed,
+	 * since hashing needs the whole of both files even after they differ.
+	 * Files whose cached hashes differ are read to find where they differ */
+	if (opts.cache_neutral) {
+		ContentHash first_hash;
+		ContentHash second_hash;
+		if (opts.cache != NULL \
+			&& opts.cache->lookup(hash_cache_key(first_file_info), &first_hash) \
+			&& opts.cache->lookup(hash_cache_key(second_file_info), \
+				&second_hash) \
+			&& first_hash == second_hash) {
+
+			return 0;
+		}
+		return compare_files_cache_neutral(first_path, second_path, \
+			first_file_info.st_size, opts.cancel, mismatch_offset);
+	}
+
+	if (opts.cache != NULL) {
+		return compare_files_cached(first_path, second_path, first_file_info, \
+			second_file_info, *opts.cache, opts.cancel, mismatch_offset);
+	}
+
+	if (opts.scheduler != NULL) {
+		DevicePolicy first_policy = \
+			opts.scheduler->policy(first_file_info.st_dev);
+		DevicePolicy second_policy = \
+			opts.scheduler->policy(second_file_info.st_dev);
+
+		if (first_policy.rotational || second_policy.rotational) {
+			size_t chunk_size = std::max(first_policy.read_size, \
+				second_policy.read_size);
+			bool overlap = (first_file_info.st_dev != second_file_info.st_dev);
+			return compare_files_chunked(first_path, second_path, \
+				first_file_info.st_size, chunk_size, overlap, opts.cancel, \
+				mismatch_offset);
+		}
+	}
+
+	/* A huge file would keep one worker busy long after the rest of the
+	 * tree has been compared, so its ranges are shared out */
+	if (opts.pool != NULL && opts.pool->size() > 1 \
+		&& first_file_info.st_size >= PARALLEL_COMPARE_THRESHOLD) {
+
+		return compare_files_parallel(first_path, second_path, \
+			first_file_info, second_file_info, *opts.pool, opts.scheduler, \
+			opts.cancel, mismatch_offset);
+	}
+
+	/* Compare the contents with whichever backend was asked for. In auto
+	 * mode, files large enough for the cost of setting up the mappings to pay
+	 * off are mapped, and everything else is streamed */
+	switch (opts.backend) {
+		case BACKEND_MMAP:
+			return compare_files_mmap(first_path, second_path, \
+				first_file_info.st_size, opts.cancel, mismatch_offset);
+		case BACKEND_STREAM:
+			return compare_files_stream(first_path, second_path, \
+				opts.cancel, mismatch_offset);
+		case BACKEND_URING:
+			return compare_files_uring(first_path, second_path, \
+				first_file_info.st_size, opts.cancel, mismatch_offset);
+		case BACKEND_AUTO:
+		default:
+			if (first_file_info.st_size >= opts.mmap_threshold) {
+				return compare_files_mmap(first_path, second_path, \
+					first_file_info.st_size, opts.cancel, mismatch_offset);
+			}
+			return compare_files_stream(first_path, second_path, \
+				opts.cancel, mismatch_offset);
+	}
 	/* }}} */
 }
 
 
 /** Takes two paths and returns 0 if the files are byte-for-byte identical,
  * and -1 if they are not. Both file paths must point to regular files and
- * both regular files must exist.
+ * both regular files must exist. In quick mode, files of the same size are
+ * taken to be identical if their modification times and modes are the same,
+ * and 1 is returned (without reading the files) if they aren't, unless
+ * suspect files are to be verified.
  *
  * \param '&first_path' a file path that points to the first file we wish to
  *     compare.
  * \param '&second_path' a file path that points to the second file we wish to
  *     compare.
- * \return 0 if they files are byte-for-byte identical, -1 otherwise.
+ * \param '&first_info' what is known about the first file. It is stat'd
+ *     (and '&first_info' filled in) if it hasn't been already.
+ * \param '&second_info' what is known about the second file. It is stat'd
+ *     (and '&second_info' filled in) if it hasn't been already.
+ * \param '&opts' the options that decide which backend reads the files,
+ *     which hash cache (if any) to use and whether to use quick mode.
+ * \param '*cmp' the comparison to record the details of the result in: its
+ *     'mismatch_offset' is set if the files are read and a difference is
+ *     found, and its 'same_inode' is set if both paths lead to the same file.
+ * \return 0 if they files are byte-for-byte identical, 1 if only their
+ *     metadata was compared and it differs, -1 otherwise.
  */
-int compare_files(fs::path &first_path, fs::path &second_path) {
+int compare_files(fs::path &first_path, fs::path &second_path, \
+	FileInfo &first_info, FileInfo &second_info, CompareOptions &opts, \
+	PartialFileComparison *cmp) {
 	/* {{{ */
 	/* Check if the files differ in size. If they do, they cannot be
-	 * byte-for-byte identical */
-	struct stat first_file_info;
-	struct stat second_file_info;
+	 * byte-for-byte identical. The walk may have told us the files are
+	 * regular without stat'ing them, in which case they are stat'd now */
+	unsigned int mask = file_info_mask(opts);
 
-	if(stat(first_path.c_str(), &first_file_info) != 0) {
+	if (!first_info.stat_done && stat_file_info(first_path, mask, \
+		opts.follow_symlinks, &first_info) != 0) {
 		/* stat() failed, return -1 */
 		return -1;
 	}
 
-	if(stat(second_path.c_str(), &second_file_info) != 0) {
+	if (!second_info.stat_done && stat_file_info(second_path, mask, \
+		opts.follow_symlinks, &second_info) != 0) {
 		/* stat() failed, return -1 */
 		return -1;
 	}
 
+	struct stat &first_file_info = first_info.st;
+	struct stat &second_file_info = second_info.st;
+
+	/* If both paths lead to the same inode on the same device (e.g. hard
+	 * links, bind mounts or a tree compared with itself) then they are the
+	 * same file and must be identical, so there's no need to read them */
+	if (first_file_info.st_dev == second_file_info.st_dev \
+		&& first_file_info.st_ino == second_file_info.st_ino) {
+
+		cmp->same_inode = true;
+		return 0;
+	}
+
 	if (first_file_info.st_size != second_file_info.st_size) {
 		return -1;
 	}
 
-	/* Read through both files simultaneously, comparing their bytes. If at any
-	 * point two bytes at the same location in the files differ, return -1 */
-	std::ifstream first_stream(first_path.c_str(), std::ifstream::binary);
-	std::ifstream second_stream(second_path.c_str(), std::ifstream::binary);
-	first_stream.sync_with_stdio(false);
-	second_stream.sync_with_stdio(false);
-	/* Create a buffer of 8192 chars, all initialized to 0(?) */
-	std::vector<char> first_buf(8192, 0);
-	std::vector<char> second_buf(8192, 0);
-
-	while(first_stream.good() && second_stream.good()) {
-		first_stream.read(first_buf.data(), first_buf.size());
-		second_stream.read(second_buf.data(), second_buf.size());
-		std::streamsize first_bytes_read = first_stream.gcount();
-		std::streamsize second_bytes_read = second_stream.gcount();
-
-		/* One file ended before the other */
-		if (first_bytes_read != second_bytes_read) {
-			return -1;
+	if (opts.quick) {
+		if (first_file_info.st_mtim.tv_sec == second_file_info.st_mtim.tv_sec \
+			&& first_file_info.st_mtim.tv_nsec \
+				== second_file_info.st_mtim.tv_nsec \
+			&& first_file_info.st_mode == second_file_info.st_mode) {
+			return 0;
 		}
+		/* Same size but different metadata is ambiguous: the content may or
+		 * may not have changed */
+		if (!opts.verify_suspect) {
+			return 1;
+		}
+	}
 
-		if (0 != std::memcmp(first_buf.data(), second_buf.data(), \
-			first_bytes_read)) {
+	if (opts.scheduler == NULL) {
+		return compare_file_contents(first_path, second_path, first_info, \
+			second_info, opts, &cmp->mismatch_offset);
+	}
 
-			return -1;
-		}
+	/* Wait for the devices the files are on to have room for another
+	 * reader */
+	opts.scheduler->acquire(first_file_info.st_dev, second_file_info.st_dev);
+	int ret = compare_file_contents(first_path, second_path, first_info, \
+		second_info, opts, &cmp->mismatch_offset);
+	opts.scheduler->release(first_file_info.st_dev, second_file_info.st_dev);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes two paths to symlinks and returns 0 if the symlinks have the same
+ * target, and -1 if they do not. The targets are compared as they are
+ * written, without being resolved.
+ *
+ * \param '&first_path' a file path that points to the first symlink.
+ * \param '&second_path' a file path that points to the second symlink.
+ * \return 0 if both symlinks were read and have the same target, -1
+ *     otherwise.
+ */
+int compare_symlinks(fs::path &first_path, fs::path &second_path) {
+	/* {{{ */
+	std::string first_target;
+	std::string second_target;
+
+	if (read_link_target(AT_FDCWD, first_path.c_str(), first_target) != 0 \
+		|| read_link_target(AT_FDCWD, second_path.c_str(), \
+			second_target) != 0) {
+		return -1;
 	}
 
-	return 0;
+	return (first_target == second_target) ? 0 : -1;
 	/* }}} */
 }
 
@@ -181,29 +647,51 @@ int compare_files(fs::path &first_path, fs::path &second_path) {
  *     compare.
  * \param '&second_path' a file path that points to the second file we wish to
  *     compare.
+ * \param 'first_hint' what the directory walk knows about the first file
+ *     (see get_file_info()), or FILE_HINT_UNKNOWN.
+ * \param 'second_hint' what the directory walk knows about the second file
+ *     (see get_file_info()), or FILE_HINT_UNKNOWN.
+ * \param '&opts' the options that decide how regular files are compared.
  * \return a PartialFileComparison that will represents whether the two files
  *     are equivalent, if they differ and how they differ, as well as the two
  *     file types of the files.
  */
-PartialFileComparison compare_path( \
-	fs::path &first_path, fs::path &second_path) {
+PartialFileComparison compare_path(fs::path &first_path, \
+	fs::path &second_path, unsigned char first_hint, \
+	unsigned char second_hint, CompareOptions &opts) {
 	/* {{{ */
 
 	PartialFileComparison ret;
+	ret.first_ft = fs::file_type::not_found;
+	ret.second_ft = fs::file_type::not_found;
+	ret.mismatch_offset = -1;
+	ret.same_inode = false;
+
+	/* Find out whether each file exists and what type it is with at most one
+	 * stat() per file (and none at all for files the walk already knows
+	 * enough about). Regular files are stat'd again only if both exist, since
+	 * that's the only time their size and inode are needed */
+	unsigned int mask = file_info_mask(opts);
+	FileInfo first_info;
+	FileInfo second_info;
+	get_file_info(first_path, first_hint, mask, opts.follow_symlinks, \
+		&first_info);
+	get_file_info(second_path, second_hint, mask, opts.follow_symlinks, \
+		&second_info);
 
 	/* Check file existences first. If neither path points to files that exist,
 	 * return that neither exists. If one file exists, but the other does not,
 	 * get the file mode/type of the existing file and return, setting the
 	 * comparison member so that the caller knows which file does not exist */
-	if (!fs::exists(first_path) && !fs::exists(second_path)) {
+	if (!first_info.exists && !second_info.exists) {
 		ret.file_cmp = MISMATCH_NEITHER_EXISTS;
 		return ret;
-	} else if (fs::exists(first_path) && !fs::exists(second_path)) {
-		ret.first_ft = fs::status(first_path).type();
+	} else if (first_info.exists && !second_info.exists) {
+		ret.first_ft = first_info.type;
 		ret.file_cmp = MISMATCH_ONLY_FIRST_EXISTS;
 		return ret;
-	} else if (!fs::exists(first_path) && fs::exists(second_path)) {
-		ret.second_ft = fs::status(second_path).type();
+	} else if (!first_info.exists && second_info.exists) {
+		ret.second_ft = second_info.type;
 		ret.file_cmp = MISMATCH_ONLY_SECOND_EXISTS;
 		return ret;
 	}
@@ -212,8 +700,8 @@ PartialFileComparison compare_path( \
 	 * they are of different types (e.g. a fifo vs a regular file) then
 	 * return with the two file modes/types and setting the comparison member
 	 * so the caller knows the types of the two files */
-	ret.first_ft = fs::status(first_path).type();
-	ret.second_ft = fs::status(second_path).type();
+	ret.first_ft = first_info.type;
+	ret.second_ft = second_info.type;
 
 	if (ret.first_ft != ret.second_ft) {
 		ret.file_cmp = MISMATCH_TYPE;
@@ -245,13 +733,24 @@ PartialFileComparison compare_path( \
 		/* If the file comparison succeeded we know that this means the two
 		 * files are byte-for-byte identical. Return with the comparison
 		 * member set to match */
-		if (compare_files(first_path, second_path) == 0) {
+		int files_cmp = compare_files(first_path, second_path, first_info, \
+			second_info, opts, &ret);
+		if (files_cmp == 0) {
 			ret.file_cmp = MATCH;
 			return ret;
+		} else if (files_cmp == 1) {
+			ret.file_cmp = MISMATCH_METADATA;
+			return ret;
 		} else {
 			ret.file_cmp = MISMATCH_CONTENT;
 			return ret;
 		}
+	} else if (ret.first_ft == fs::file_type::symlink) {
+		/* Symlinks that aren't followed match if they point to the same
+		 * place */
+		ret.file_cmp = (compare_symlinks(first_path, second_path) == 0) \
+			? MATCH : MISMATCH_CONTENT;
+		return ret;
 	/* TODO: Other file types do not yet have support. At the moment, they are
 	 * treated the same way directories are: if they both exist, and are of
 	 * the same type, return that they match. */
@@ -263,181 +762,1741 @@ PartialFileComparison compare_path( \
 }
 
 
-/** Returns a sorted vector list of FullFileComparisons representing
- * comparisons between every file contained in one of the root directories and
- * the file of the same relative path in the other root directory. This includes
- * comparisons between a file and its non-existent equivalent if there is no
- * equivalent in the other root directory. The list is sorted by the relative
- * path of each FullFileComparison.
+/** Compares the files of the path with the id 'id' in the two trees, just
+ * as compare_path() does. The full paths only exist while the comparison
+ * runs.
  *
  * \param '&first_root' the file path to the root of the first directory tree.
  * \param '&second_root' the file path to the root of the second directory tree.
- * \return a vector list of FullFileComparisons representing the comparisons
- *     between every file contained in both root directories.
+ * \param '&paths' the table the path is in.
+ * \param 'id' the id of the relative path of the files.
+ * \param '&opts' the options that decide how regular files are compared.
+ * \return a PartialFileComparison that represents whether the two files are
+ *     equivalent (see compare_path()).
  */
-std::vector<FullFileComparison> compare_directory_trees( \
-	fs::path &first_root, fs::path &second_root) {
+PartialFileComparison compare_path_id(fs::path &first_root, \
+	fs::path &second_root, const PathTable &paths, PathId id, \
+	CompareOptions &opts) {
 	/* {{{ */
+	const PathNode &n = paths.node(id);
+	fs::path file_rp = paths.path(id);
+	fs::path first_path = first_root / file_rp;
+	fs::path second_path = second_root / file_rp;
 
-	std::vector<FullFileComparison> ret;
-	/* Get the first directory file list and the second directory file list:
-	 * the list of files in each directory */
-	std::vector<fs::path> first_ft = files_in_tree(first_root);
-	std::vector<fs::path> second_ft = files_in_tree(second_root);
+	return compare_path(first_path, second_path, n.first_hint, \
+		n.second_hint, opts);
+	/* }}} */
+}
 
-	/* Create a vector that contains both the files from the first directory
-	 * tree and the files from the second directory tree */
-	std::vector<fs::path> combined_ft(first_ft.begin(), first_ft.end());
-	combined_ft.insert(combined_ft.end(), second_ft.begin(), second_ft.end());
-	/* Sort the combined file tree and remove duplicate items */
-	std::sort(combined_ft.begin(), combined_ft.end());
-	auto last = std::unique(combined_ft.begin(), combined_ft.end());
-	combined_ft.erase(last, combined_ft.end());
 
-	/* Go through all the files in the combined  file list, create two full
-	 * paths to the file, one rooted at '&first_root', one rooted at
-	 * '&second_root', and compare them */
-	for (auto &e: combined_ft) {
-		FullFileComparison res;
-		res.first_path = first_root / e;
-		res.second_path = second_root / e;
-		res.partial_cmp = compare_path(res.first_path, res.second_path);
-		ret.push_back(res);
+/** Adds the entries of two listings of the same relative directory to
+ * '&paths', merged like a merge join so that a name in both listings is
+ * added once, and then does the same for every subdirectory, depth first.
+ * Since the entries of each listing are sorted and every subdirectory is
+ * added right after its own entry, paths are added (and so numbered) in the
+ * order a sort of all the relative paths would produce.
+ *
+ * \param '&paths' the table the paths are added to.
+ * \param 'parent' the id of the relative path of the two directories.
+ * \param '*first' the listing of the directory in the first tree, or NULL
+ *     if the first tree has no such directory.
+ * \param '*second' the listing of the directory in the second tree, or NULL
+ *     if the second tree has no such directory.
+ */
+void merge_listings(PathTable &paths, PathId parent, DirListing *first, \
+	DirListing *second) {
+	/* {{{ */
+
+	static DirListing empty_listing = { "", { 0 }, {}, {}, {}, true };
+	DirListing &fl = (first != NULL) ? *first : empty_listing;
+	DirListing &sl = (second != NULL) ? *second : empty_listing;
+	/* A name missing from a listing is only known not to exist if the
+	 * directory was read in full */
+	unsigned char first_missing = fl.complete \
+		? FILE_HINT_ABSENT : FILE_HINT_UNKNOWN;
+	unsigned char second_missing = sl.complete \
+		? FILE_HINT_ABSENT : FILE_HINT_UNKNOWN;
+
+	size_t i = 0;
+	size_t j = 0;
+	while (i < fl.types.size() || j < sl.types.size()) {
+		std::string_view first_name;
+		std::string_view second_name;
+		if (i < fl.types.size()) {
+			first_name = std::string_view(fl.names).substr( \
+				fl.name_starts[i], fl.name_starts[i + 1] - fl.name_starts[i]);
+		}
+		if (j < sl.types.size()) {
+			second_name = std::string_view(sl.names).substr( \
+				sl.name_starts[j], sl.name_starts[j + 1] - sl.name_starts[j]);
+		}
+
+		int cmp;
+		if (i == fl.types.size()) {
+			cmp = 1;
+		} else if (j == sl.types.size()) {
+			cmp = -1;
+		} else {
+			cmp = first_name.compare(second_name);
+		}
+
+		std::string_view name = (cmp <= 0) ? first_name : second_name;
+		PathId id = paths.add(parent, name.data(), name.size(), \
+			(cmp <= 0) ? fl.types[i] : first_missing, \
+			(cmp >= 0) ? sl.types[j] : second_missing);
+
+		DirListing *first_sub = (cmp <= 0) ? fl.subdirs[i].get() : NULL;
+		DirListing *second_sub = (cmp >= 0) ? sl.subdirs[j].get() : NULL;
+		if (first_sub != NULL || second_sub != NULL) {
+			merge_listings(paths, id, first_sub, second_sub);
+		}
+
+		if (cmp <= 0) i++;
+		if (cmp >= 0) j++;
 	}
+	/* }}} */
+}
 
-	return ret;
+
+/** Fills '&paths' with the relative file paths of every file (in the broad
+ * sense) that exists in at least one of the two directory trees, in sorted
+ * order and without duplicates. Both trees are walked at the same time on
+ * '&pool'.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&pool' the thread pool the directory trees will be walked on.
+ * \param 'follow_symlinks' whether symlinks to directories are walked into.
+ * \param '&paths' an empty table to add the relative file paths to. Every
+ *     id after PATH_ID_ROOT is the id of one of the paths.
+ */
+void sorted_union_of_trees(fs::path &first_root, fs::path &second_root, \
+	ThreadPool &pool, bool follow_symlinks, PathTable &paths) {
+	/* {{{ */
+
+	/* Walk both directory trees at the same time */
+	TreeWalk first_walk(first_root, follow_symlinks);
+	TreeWalk second_walk(second_root, follow_symlinks);
+	DirListing first_listing;
+	DirListing second_listing;
+	files_in_tree(pool, first_root, first_walk, first_listing);
+	files_in_tree(pool, second_root, second_walk, second_listing);
+	pool.wait_idle();
+	fs::path extension = "";
+	walk_linked_directories(pool, first_root, first_walk, extension, \
+		first_listing);
+	walk_linked_directories(pool, second_root, second_walk, extension, \
+		second_listing);
+
+	merge_listings(paths, PATH_ID_ROOT, &first_listing, &second_listing);
 	/* }}} */
 }
 
 
-int main(int argc, char **argv) {
-	bool flag_print_totals = false;
-	bool flag_print_matches = false;
-	bool flag_pretty_output = false;
+/** Fills '&paths' with the relative file paths of every file (in the broad
+ * sense) in the directory tree rooted at '&root', in sorted order. The tree
+ * is walked on '&pool'.
+ *
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&pool' the thread pool the directory tree will be walked on.
+ * \param 'follow_symlinks' whether symlinks to directories are walked into.
+ * \param '&paths' an empty table to add the relative file paths to. Every
+ *     id after PATH_ID_ROOT is the id of one of the paths.
+ */
+void sorted_files_in_tree(fs::path &root, ThreadPool &pool, \
+	bool follow_symlinks, PathTable &paths) {
+	/* {{{ */
+	TreeWalk walk(root, follow_symlinks);
+	DirListing listing;
+	files_in_tree(pool, root, walk, listing);
+	pool.wait_idle();
+	fs::path extension = "";
+	walk_linked_directories(pool, root, walk, extension, listing);
 
-	int opt;
-	struct option opt_table[] = {
-		{ "matches",  no_argument,  NULL,  'm' },
-		{ "pretty",   no_argument,  NULL,  'p' },
-		{ "totals",   no_argument,  NULL,  't' },
-		{ 0, 0, 0, 0 }
-	};
-	char opt_string[] = { "mpt" };
+	merge_listings(paths, PATH_ID_ROOT, &listing, NULL);
+	/* }}} */
+}
 
-	while ((opt = getopt_long(argc, argv, opt_string, opt_table, NULL)) != -1) {
-		switch (opt) {
-			case 'm': flag_print_matches = true; break;
-			case 'p': flag_pretty_output = true; break;
-			case 't': flag_print_totals = true; break;
-		}
-	}
 
-	/* If after parsing all the flags there aren't 2 arguments left */
-	if (optind + 2 != argc) {
-		fprintf(stdout, "Expected 2 arguments, received %d\n", argc - 1);
-	}
+/** Returns the ids of the paths in '&paths' in the order their files sit on
+ * disk (see DiskPosition), so that comparing them in that order reads each
+ * rotational disk in one sweep. Each path is placed by where its file in
+ * the first tree is, or where its file in the second tree is if it is only
+ * in the second tree. Paths that aren't regular files in either tree come
+ * first, since comparing them reads no data. The positions are looked up on
+ * '&pool'.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&paths' the relative file paths of both trees.
+ * \param '&pool' the thread pool the positions will be looked up on.
+ * \return the ids of every path after PATH_ID_ROOT, sorted by position.
+ */
+std::vector<PathId> disk_ordered_ids(fs::path &first_root, \
+	fs::path &second_root, PathTable &paths, ThreadPool &pool) {
+	/* {{{ */
+	std::vector<DiskPosition> positions(paths.size());
+	memset(positions.data(), 0, positions.size() * sizeof(DiskPosition));
 
-	fs::path first_path(argv[optind]);
-	optind++;
-	fs::path second_path(argv[optind]);
-	/* Create an array of arguments that specify directories so that
-	 * we can check their validity */
-	std::array<fs::path, 2> directory_args = \
-		{ first_path, second_path };
+	/* Only the hints that could be a regular file are worth a look */
+	auto could_be_regular = [](unsigned char hint) {
+		return hint == DT_REG || hint == DT_LNK || hint == FILE_HINT_UNKNOWN;
+	};
 
-	/* Loop through all the arguments that specify directories and check that
-	 * they are valid */
-	for (auto &e: directory_args) {
-		/* Check if the given argument is a file path that points to something
-		* that exists... */
-		if (!fs::exists(e)) {
-			std::cout << "Provided directory (" << e << \
-				") does not exist. Exiting...\n";
-			return -1;
-		} else {
-			/* ... and that it points to a directory */
-			if (!fs::is_directory(e)) {
-				std::cout << "Provided directory (" << e << \
-					") is not a directory. Exiting...\n";
-				return -1;
+	for (size_t start = 1; start < paths.size(); \
+		start += COMPARISONS_PER_TASK) {
+
+		size_t end = std::min(start + COMPARISONS_PER_TASK, paths.size());
+		pool.submit([&, start, end] {
+			for (size_t id = start; id < end; id++) {
+				const PathNode &n = paths.node((PathId) id);
+				fs::path file_rp = paths.path((PathId) id);
+
+				if (could_be_regular(n.first_hint) && disk_position( \
+					first_root / file_rp, &positions[id]) == 0) {
+					continue;
+				}
+				if (could_be_regular(n.second_hint) && disk_position( \
+					second_root / file_rp, &positions[id]) == 0) {
+					continue;
+				}
+				memset(&positions[id], 0, sizeof(DiskPosition));
 			}
-		}
+		});
 	}
+	pool.wait_idle();
 
-	/* Compare the directory trees! */
-	auto comparisons = compare_directory_trees(first_path, second_path);
+	std::vector<PathId> ret(paths.size() - 1);
+	for (size_t id = 1; id < paths.size(); id++) {
+		ret[id - 1] = (PathId) id;
+	}
+	std::stable_sort(ret.begin(), ret.end(), [&positions](PathId a, PathId b) {
+		return positions[a] < positions[b];
+	});
 
-	long max_num_file_matches = 0;
-	long max_num_dir_matches = 0;
-	long num_file_matches = 0;
-	long num_dir_matches = 0;
+	return ret;
+	/* }}} */
+}
 
-	for (auto e: comparisons) {
-		if (flag_print_totals) {
-			if (e.partial_cmp.first_ft == fs::file_type::directory \
-				|| e.partial_cmp.second_ft == fs::file_type::directory) {
 
-				max_num_dir_matches++;
-			}
-			if (e.partial_cmp.first_ft == fs::file_type::regular \
-				|| e.partial_cmp.second_ft == fs::file_type::regular) {
+/** Fills '&paths' with the relative file paths of every file contained in
+ * one of the root directories and returns a list of PartialFileComparisons
+ * representing comparisons between the files of each relative path in the
+ * two root directories. This includes comparisons between a file and its
+ * non-existent equivalent if there is no equivalent in the other root
+ * directory. The comparison of the path with the id 'id' is at index
+ * 'id - 1', so the list is sorted by relative path.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&paths' an empty table the relative file paths will be added to.
+ * \param '&pool' the thread pool the comparisons will be run on.
+ * \param '&opts' the options that decide how regular files are compared.
+ * \return a vector list of PartialFileComparisons representing the
+ *     comparisons between every file contained in both root directories.
+ */
+std::vector<PartialFileComparison> compare_directory_trees( \
+	fs::path &first_root, fs::path &second_root, PathTable &paths, \
+	ThreadPool &pool, CompareOptions &opts) {
+	/* {{{ */
+
+	sorted_union_of_trees(first_root, second_root, pool, \
+		opts.follow_symlinks, paths);
+	std::vector<PartialFileComparison> ret(paths.size() - 1);
+
+	auto compare_id = [&](size_t id) {
+		ret[id - 1] = compare_path_id(first_root, second_root, paths, \
+			(PathId) id, opts);
+	};
 
-				max_num_file_matches++;
+	/* In disk order, or when prefetching, the comparisons are started
+	 * strictly in order: rather than handing each worker a batch, every
+	 * worker takes the next comparison from the ordered list as soon as it
+	 * finishes the last, so the number taken so far is a cursor the
+	 * prefetcher can stay ahead of. The results still go to the slots of
+	 * their paths, so they are printed in path order */
+	if (opts.disk_order || opts.prefetch_files > 0) {
+		std::vector<PathId> order;
+		if (opts.disk_order) {
+			order = disk_ordered_ids(first_root, second_root, paths, pool);
+		} else {
+			order.resize(paths.size() - 1);
+			for (size_t id = 1; id < paths.size(); id++) {
+				order[id - 1] = (PathId) id;
 			}
 		}
+		std::atomic<size_t> next(0);
 
-		switch (e.partial_cmp.file_cmp) {
-			case MATCH:
-				if (flag_print_matches) {
-					if (flag_pretty_output) printf("%s%s", BOLD, GREEN);
-					printf("\"%s\" == \"%s\"\n",
-						e.first_path.c_str(), e.second_path.c_str());
-					if (flag_pretty_output) printf("%s", NORMAL);
+		/* Only regular files have data worth reading ahead */
+		auto could_be_read = [&](unsigned char hint) {
+			return hint == DT_REG || hint == FILE_HINT_UNKNOWN \
+				|| (hint == DT_LNK && opts.follow_symlinks);
+		};
+		Prefetcher prefetcher(opts.prefetch_files, opts.prefetch_budget);
+		if (opts.prefetch_files > 0) {
+			prefetcher.start(order.size(), [&](size_t i, fs::path &first_path, \
+				fs::path &second_path) {
+				const PathNode &n = paths.node(order[i]);
+				if (!could_be_read(n.first_hint) \
+					&& !could_be_read(n.second_hint)) {
+					return false;
 				}
-				if (e.partial_cmp.first_ft == fs::file_type::regular) {
-					num_file_matches++;
-				} else if (e.partial_cmp.first_ft == fs::file_type::directory) {
-					num_dir_matches++;
+				fs::path file_rp = paths.path(order[i]);
+				first_path = first_root / file_rp;
+				second_path = second_root / file_rp;
+				return true;
+			}, &next);
+		}
+
+		for (size_t w = 0; w < pool.size(); w++) {
+			pool.submit([&] {
+				size_t i;
+				while ((i = next.fetch_add(1)) < order.size()) {
+					compare_id(order[i]);
+					if (opts.prefetch_files > 0) {
+						prefetcher.job_finished(i);
+					}
 				}
-				break;
-			case MISMATCH_TYPE:
-				if (flag_pretty_output) printf("%s%s", BOLD, RED);
-				printf("\"%s\" is not of the same type as \"%s\"\n",
-					e.first_path.c_str(), e.second_path.c_str());
-				if (flag_pretty_output) printf("%s", NORMAL);
-				break;
-			case MISMATCH_CONTENT:
-				if (flag_pretty_output) printf("%s%s", BOLD, RED);
-				printf("\"%s\" differs from \"%s\"\n",
-					e.first_path.c_str(), e.second_path.c_str());
-				if (flag_pretty_output) printf("%s", NORMAL);
-				break;
-			case MISMATCH_NEITHER_EXISTS:
-				if (flag_pretty_output) printf("%s%s", BOLD, RED);
-				printf("Neither \"%s\" nor \"%s\" exist\n",
-					e.first_path.c_str(), e.second_path.c_str());
-				if (flag_pretty_output) printf("%s", NORMAL);
-				break;
-			case MISMATCH_ONLY_FIRST_EXISTS:
-				if (flag_pretty_output) printf("%s%s", BOLD, RED);
-				printf("\"%s\" exists, but \"%s\" does NOT exist\n",
-					e.first_path.c_str(), e.second_path.c_str());
-				if (flag_pretty_output) printf("%s", NORMAL);
-				break;
-			case MISMATCH_ONLY_SECOND_EXISTS:
-				if (flag_pretty_output) printf("%s%s", BOLD, RED);
-				printf("\"%s\" does NOT exist, but \"%s\" does exist\n",
-					e.first_path.c_str(), e.second_path.c_str());
-				if (flag_pretty_output) printf("%s", NORMAL);
-				break;
+			});
 		}
+		pool.wait_idle();
+
+		return ret;
 	}
 
-	if (flag_print_totals) {
-		fprintf(stdout, "All done!\n");
-		fprintf(stdout, "File byte-for-byte matches: %ld/%ld\n", \
-			num_file_matches, max_num_file_matches);
-		fprintf(stdout, "Directory matches: %ld/%ld\n", num_dir_matches, \
-			max_num_dir_matches);
+	/* Go through all the files in the combined  file list, create two full
+	 * paths to the file, one rooted at '&first_root', one rooted at
+	 * '&second_root', and compare them. Every comparison writes to its own
+	 * slot in 'ret', so the results stay in sorted order no matter which
+	 * worker finishes first. The comparisons are handed to the pool in small
+	 * batches to keep the per-task overhead low while still leaving enough
+	 * tasks for idle workers to steal. The full paths only exist while their
+	 * comparison runs */
+	for (size_t start = 1; start < paths.size(); \
+		start += COMPARISONS_PER_TASK) {
+
+		size_t end = std::min(start + COMPARISONS_PER_TASK, paths.size());
+		pool.submit([&, start, end] {
+			for (size_t id = start; id < end; id++) {
+				compare_id(id);
+			}
+		});
+	}
+	pool.wait_idle();
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Compares every file (in the broad sense) in the directory 'dir_id' of the
+ * first tree with the file of the same name in the directory 'dir_id' of
+ * the second tree, and then does the same for every subdirectory, depth
+ * first. The two directories are read together, their entries are sorted
+ * locally and then merged like a merge join, so each relative path is added
+ * to '&paths' and handed to '&visit' as soon as it is known. Since the
+ * entries of each directory are visited in sorted order and every
+ * subdirectory is visited right after its own entry, the paths are added
+ * (and so numbered) in the same order a sort of all the relative paths
+ * would produce, and '&visit' sees them in that order.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&first_walk' the walk of the first tree.
+ * \param '&second_walk' the walk of the second tree.
+ * \param '&paths' the table the relative paths are added to. The walk is the
+ *     only thread that may add to it.
+ * \param 'dir_id' the id of the relative path of the directory to be
+ *     compared.
+ * \param 'in_first' whether 'dir_id' is a directory that should be read in
+ *     the first tree.
+ * \param 'in_second' whether 'dir_id' is a directory that should be read in
+ *     the second tree.
+ * \param '&visit' the function the id of each relative path will be handed
+ *     to. It is expected to submit the comparison of the path to a thread
+ *     pool.
+ * \param '*stop' if not NULL, the walk ends as soon as this becomes true.
+ */
+void lockstep_compare_directory(fs::path &first_root, fs::path &second_root, \
+	TreeWalk &first_walk, TreeWalk &second_walk, PathTable &paths, \
+	PathId dir_id, bool in_first, bool in_second, PathVisitor &visit, \
+	const std::atomic<bool> *stop) {
+	/* {{{ */
+	if (stop != NULL && stop->load()) {
+		return;
+	}
+
+	fs::path extension = paths.path(dir_id);
+	std::vector<DirEntry> first_entries;
+	std::vector<DirEntry> second_entries;
+	std::vector<bool> first_descend;
+	std::vector<bool> second_descend;
+
+	/* A name missing from a listing is only known not to exist if the
+	 * directory was read in full */
+	unsigned char first_missing = FILE_HINT_ABSENT;
+	unsigned char second_missing = FILE_HINT_ABSENT;
+
+	if (in_first) {
+		fs::path dir_path = first_root / extension;
+		if (list_directory(dir_path, first_entries, first_descend, \
+			first_walk) != 0) {
+			first_walk.report_unreadable(dir_path);
+			first_missing = FILE_HINT_UNKNOWN;
+		}
+	}
+	if (in_second) {
+		fs::path dir_path = second_root / extension;
+		if (list_directory(dir_path, second_entries, second_descend, \
+			second_walk) != 0) {
+			second_walk.report_unreadable(dir_path);
+			second_missing = FILE_HINT_UNKNOWN;
+		}
+	}
+
+	std::vector<size_t> first_order = sorted_entry_order(first_entries);
+	std::vector<size_t> second_order = sorted_entry_order(second_entries);
+
+	/* Merge the two sorted listings. At each step, take the entry with the
+	 * smallest name from either (or both, if the names are equal) listing */
+	size_t i = 0;
+	size_t j = 0;
+	while (i < first_order.size() || j < second_order.size()) {
+		if (stop != NULL && stop->load()) {
+			return;
+		}
+		int cmp;
+		if (i == first_order.size()) {
+			cmp = 1;
+		} else if (j == second_order.size()) {
+			cmp = -1;
+		} else {
+			cmp = first_entries[first_order[i]].name.compare( \
+				second_entries[second_order[j]].name);
+		}
+
+		bool descend_first = (cmp <= 0 && first_descend[first_order[i]]);
+		bool descend_second = (cmp >= 0 && second_descend[second_order[j]]);
+		std::string &name = (cmp <= 0) \
+			? first_entries[first_order[i]].name \
+			: second_entries[second_order[j]].name;
+
+		/* Pass on the types the listings reported, so that the comparison
+		 * needn't stat files the listings already describe */
+		unsigned char first_hint = (cmp <= 0) \
+			? first_entries[first_order[i]].type : first_missing;
+		unsigned char second_hint = (cmp >= 0) \
+			? second_entries[second_order[j]].type : second_missing;
+		PathId id = paths.add(dir_id, name.data(), name.size(), first_hint, \
+			second_hint);
+		visit(id);
+
+		/* The lockstep walk reaches the entries in sorted order, so it can
+		 * claim the links it may follow as it gets to them */
+		if (descend_first && first_entries[first_order[i]].type == DT_LNK) {
+			descend_first = first_walk.claim_link(first_root / extension / name);
+		}
+		if (descend_second \
+			&& second_entries[second_order[j]].type == DT_LNK) {
+			descend_second = second_walk.claim_link( \
+				second_root / extension / name);
+		}
+		if (descend_first || descend_second) {
+			lockstep_compare_directory(first_root, second_root, first_walk, \
+				second_walk, paths, id, descend_first, descend_second, visit, \
+				stop);
+		}
+
+		if (cmp <= 0) i++;
+		if (cmp >= 0) j++;
+	}
+	/* }}} */
+}
+
+
+/** Returns a vector list of PartialFileComparisons, exactly like
+ * compare_directory_trees(), but walks the two directory trees in lockstep
+ * (see lockstep_compare_directory()) instead of listing both trees in full
+ * and sorting the table. Comparisons start as soon as the first directory
+ * has been read, and the walk itself only ever holds the listings of the
+ * directories between the roots and the directory being read.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&paths' an empty table the walk fills with every relative path. Its
+ *     ids are in sorted order.
+ * \param '&pool' the thread pool the comparisons will be run on.
+ * \param '&opts' the options that decide how regular files are compared.
+ * \return a vector list of PartialFileComparisons where the comparison of
+ *     the path with the id 'id' is at index 'id - 1'.
+ */
+std::vector<PartialFileComparison> compare_directory_trees_lockstep( \
+	fs::path &first_root, fs::path &second_root, PathTable &paths, \
+	ThreadPool &pool, CompareOptions &opts) {
+	/* {{{ */
+
+	std::deque<PartialFileComparison> results;
+	PathVisitor visit = [&](PathId id) {
+		/* Elements of a std::deque stay where they are as the deque grows, so
+		 * the task can keep a pointer to its result */
+		results.emplace_back();
+		PartialFileComparison *res = &results.back();
+		pool.submit([res, id, &first_root, &second_root, &paths, &opts] {
+			*res = compare_path_id(first_root, second_root, paths, id, opts);
+		});
+	};
+
+	TreeWalk first_walk(first_root, opts.follow_symlinks);
+	TreeWalk second_walk(second_root, opts.follow_symlinks);
+	lockstep_compare_directory(first_root, second_root, first_walk, \
+		second_walk, paths, PATH_ID_ROOT, true, true, visit, NULL);
+	pool.wait_idle();
+
+	return std::vector<PartialFileComparison>(results.begin(), \
+		results.end());
+	/* }}} */
+}
+
+
+/** Compares the two directory trees exactly like
+ * compare_directory_trees_lockstep(), but instead of collecting every
+ * comparison, hands each one to '&sink' as soon as it and all the
+ * comparisons sorted before it have finished. The trees are always walked in
+ * lockstep, since listing them in full first would mean nothing could be
+ * handed on until both had been walked. Comparisons pass through a
+ * ReorderBuffer of REORDER_BUFFER_CAPACITY slots, and the walk blocks while
+ * the buffer is full, so the memory used for results stays the same no
+ * matter how large the trees are.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&paths' an empty table that is filled with every relative path.
+ *     The ids of the FullFileComparisons handed to '&sink' refer to it.
+ * \param '&pool' the thread pool the comparisons will be run on.
+ * \param '&opts' the options that decide how regular files are compared.
+ * \param 'sink' the function every FullFileComparison will be handed to, in
+ *     sorted order. It is never called by more than one thread at a time.
+ */
+void stream_directory_tree_comparisons(fs::path &first_root, \
+	fs::path &second_root, PathTable &paths, ThreadPool &pool, \
+	CompareOptions &opts, ComparisonSink sink) {
+	/* {{{ */
+
+	ReorderBuffer buffer(REORDER_BUFFER_CAPACITY, sink);
+	PathVisitor visit = [&](PathId id) {
+		size_t seq;
+		FullFileComparison *res = buffer.reserve(seq);
+		res->id = id;
+		pool.submit([&, res, seq, id] {
+			res->partial_cmp = compare_path_id(first_root, second_root, \
+				paths, id, opts);
+			buffer.complete(seq);
+		});
+	};
+
+	TreeWalk first_walk(first_root, opts.follow_symlinks);
+	TreeWalk second_walk(second_root, opts.follow_symlinks);
+	lockstep_compare_directory(first_root, second_root, first_walk, \
+		second_walk, paths, PATH_ID_ROOT, true, true, visit, NULL);
+
+	buffer.wait_drained();
+	/* }}} */
+}
+
+
+/** Compares the two directory trees until the first difference is found
+ * (a path missing from one tree, or files of different types or contents),
+ * and then stops. The trees are walked in lockstep (see
+ * lockstep_compare_directory()), so a missing path is found while the walk
+ * is still going, and the workers of '&pool' compare the paths in the order
+ * the walk finds them. As soon as a comparison finds a difference, the walk
+ * ends, the comparisons that haven't started are skipped and the reads of
+ * the ones in progress are cancelled (see CompareOptions). With more than
+ * one worker, the difference found first isn't necessarily the first in
+ * path order. A directory that can't be read may hide a difference, so it
+ * counts as one too.
+ *
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&paths' an empty table the walk fills with the relative paths it
+ *     finds. The id of '&difference' refers to it.
+ * \param '&pool' the thread pool the comparisons will be run on.
+ * \param '&opts' the options that decide how regular files are compared.
+ * \param '&difference' set to the first difference found, if one is found.
+ *     If that is a directory that couldn't be read, which the walk has
+ *     already reported, its id is PATH_ID_ROOT.
+ * \return true if the trees differ (or can't be shown to be identical),
+ *     false if they are identical.
+ */
+bool first_difference_in_trees(fs::path &first_root, fs::path &second_root, \
+	PathTable &paths, ThreadPool &pool, CompareOptions &opts, \
+	FullFileComparison &difference) {
+	/* {{{ */
+	/* The paths the walk has found but no worker has taken yet. Workers take
+	 * them in the order the walk found them, so that the cheap comparisons
+	 * near the start of a tree aren't held up behind later ones. The walk
+	 * waits while FAIL_FAST_QUEUE_CAPACITY paths are pending, so the queue
+	 * (and the table of paths) only grows as fast as the comparisons go */
+	std::deque<PathId> pending;
+	bool walk_done = false;
+	std::mutex lock;
+	std::condition_variable path_available;
+	std::condition_variable space_available;
+	std::atomic<bool> found(false);
+	/* Finding a difference cancels the reads of the comparisons still
+	 * running */
+	CompareOptions cancel_opts = opts;
+	cancel_opts.cancel = &found;
+
+	auto next_path = [&](PathId &id) {
+		std::unique_lock<std::mutex> guard(lock);
+		path_available.wait(guard, [&] {
+			return !pending.empty() || walk_done || found.load();
+		});
+		if (pending.empty() || found.load()) {
+			return false;
+		}
+		id = pending.front();
+		pending.pop_front();
+		guard.unlock();
+		space_available.notify_one();
+		return true;
+	};
+
+	/* Once reads have been cancelled, the comparisons still running fail
+	 * whether or not their files differ, so only the first difference
+	 * counts */
+	auto report_difference = [&](FullFileComparison &res) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!found.load()) {
+				difference = res;
+				found.store(true);
+			}
+		}
+		path_available.notify_all();
+		space_available.notify_all();
+	};
+
+	for (size_t w = 0; w < pool.size(); w++) {
+		pool.submit([&] {
+			PathId id;
+			while (next_path(id)) {
+				FullFileComparison res;
+				res.id = id;
+				res.partial_cmp = compare_path_id(first_root, second_root, \
+					paths, id, cancel_opts);
+				if (res.partial_cmp.file_cmp != MATCH) {
+					report_difference(res);
+				}
+			}
+		});
+	}
+
+	TreeWalk first_walk(first_root, opts.follow_symlinks);
+	TreeWalk second_walk(second_root, opts.follow_symlinks);
+	auto check_unreadable = [&] {
+		if (first_walk.found_unreadable() || second_walk.found_unreadable()) {
+			FullFileComparison res;
+			res.id = PATH_ID_ROOT;
+			res.partial_cmp.file_cmp = MISMATCH_CONTENT;
+			report_difference(res);
+		}
+	};
+
+	PathVisitor visit = [&](PathId id) {
+		check_unreadable();
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			space_available.wait(guard, [&] {
+				return pending.size() < FAIL_FAST_QUEUE_CAPACITY \
+					|| found.load();
+			});
+			if (found.load()) {
+				return;
+			}
+			pending.push_back(id);
+		}
+		path_available.notify_one();
+	};
+
+	lockstep_compare_directory(first_root, second_root, first_walk, \
+		second_walk, paths, PATH_ID_ROOT, true, true, visit, &found);
+	check_unreadable();
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		walk_done = true;
+	}
+	path_available.notify_all();
+	pool.wait_idle();
+
+	return found.load();
+	/* }}} */
+}
+
+
+/** Takes a path to a file (in the broad sense) and returns the record that
+ * describes it in a manifest. Like compare_path(), symlinks are only
+ * followed if '&opts' says so, and otherwise are recorded by the hash of
+ * their target.
+ *
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&file_rp' the path of the file, relative to '&root'.
+ * \param '&opts' the options that decide which hash cache (if any) is used
+ *     when regular files are hashed.
+ * \return the ManifestRecord describing the file.
+ */
+ManifestRecord manifest_record(fs::path &root, fs::path &file_rp, \
+	CompareOptions &opts) {
+	/* {{{ */
+	ManifestRecord ret;
+	fs::path file_path = root / file_rp;
+
+	FileInfo file_info;
+	stat_file_info(file_path, STATX_SIZE | STATX_INO | STATX_MTIME \
+		| STATX_CTIME, opts.follow_symlinks, &file_info);
+
+	ret.path = file_rp;
+	ret.type = file_info.type;
+	ret.size = 0;
+	ret.hashed = false;
+	memset(&ret.hash, 0, sizeof(ret.hash));
+
+	if (ret.type == fs::file_type::regular) {
+		ret.size = file_info.st.st_size;
+		ret.hashed = (hash_file_cached(file_path, file_info.st, opts.cache, \
+			&ret.hash) == 0);
+	} else if (ret.type == fs::file_type::symlink) {
+		ret.hashed = (hash_link_target(file_path, &ret.hash) == 0);
+	}
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Hashes every file in the directory tree rooted at '&root' and writes a
+ * manifest of the tree (the path, type, size and content hash of every
+ * file) to 'out_path'. The files are hashed on '&pool'.
+ *
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '*out_path' the path of the manifest file to create.
+ * \param '&pool' the thread pool the tree will be walked and hashed on.
+ * \param '&opts' the options that decide which hash cache (if any) is used.
+ * \return 0 on success, -1 if the manifest could not be written.
+ */
+int write_tree_manifest(fs::path &root, const char *out_path, \
+	ThreadPool &pool, CompareOptions &opts) {
+	/* {{{ */
+	PathTable paths;
+	sorted_files_in_tree(root, pool, opts.follow_symlinks, paths);
+	std::vector<ManifestRecord> records(paths.size() - 1);
+
+	for (size_t start = 1; start < paths.size(); \
+		start += COMPARISONS_PER_TASK) {
+
+		size_t end = std::min(start + COMPARISONS_PER_TASK, paths.size());
+		pool.submit([&, start, end] {
+			for (size_t id = start; id < end; id++) {
+				fs::path file_rp = paths.path((PathId) id);
+				records[id - 1] = manifest_record(root, file_rp, opts);
+			}
+		});
+	}
+	pool.wait_idle();
+
+	return write_manifest_file(out_path, root, records);
+	/* }}} */
+}
+
+
+/** Takes a manifest record and a path and returns a PartialFileComparison
+ * that represents whether the file the record describes and the file the
+ * path points to are the same or different, exactly as compare_path()
+ * would if the manifest's tree were still there to be read. Regular files
+ * are compared by content hash, so only the file at '&second_path' is read.
+ *
+ * \param '*record' the manifest record of the first file, or NULL if the
+ *     manifest has no such file.
+ * \param '&second_path' a file path that points to the second file we wish
+ *     to compare.
+ * \param '&opts' the options that decide which hash cache (if any) is used.
+ * \return a PartialFileComparison that represents whether the two files
+ *     are equivalent, if they differ and how they differ, as well as the two
+ *     file types of the files.
+ */
+PartialFileComparison compare_path_to_record(ManifestRecord *record, \
+	fs::path &second_path, CompareOptions &opts) {
+	/* {{{ */
+
+	PartialFileComparison ret;
+	ret.first_ft = fs::file_type::not_found;
+	ret.second_ft = fs::file_type::not_found;
+	ret.mismatch_offset = -1;
+	ret.same_inode = false;
+
+	FileInfo second_info;
+	stat_file_info(second_path, file_info_mask(opts), opts.follow_symlinks, \
+		&second_info);
+
+	/* Broken symlinks that were followed are recorded, but didn't exist */
+	bool first_exists = (record != NULL \
+		&& record->type != fs::file_type::not_found);
+	bool second_exists = second_info.exists;
+	if (!first_exists && !second_exists) {
+		ret.file_cmp = MISMATCH_NEITHER_EXISTS;
+		return ret;
+	} else if (first_exists && !second_exists) {
+		ret.first_ft = record->type;
+		ret.file_cmp = MISMATCH_ONLY_FIRST_EXISTS;
+		return ret;
+	} else if (!first_exists && second_exists) {
+		ret.second_ft = second_info.type;
+		ret.file_cmp = MISMATCH_ONLY_SECOND_EXISTS;
+		return ret;
+	}
+
+	ret.first_ft = record->type;
+	ret.second_ft = second_info.type;
+	if (ret.first_ft != ret.second_ft) {
+		ret.file_cmp = MISMATCH_TYPE;
+		return ret;
+	}
+
+	/* As in compare_path(), only regular files have their content compared.
+	 * A file that couldn't be read when the manifest was written (or can't
+	 * be read now) can't be shown to match */
+	if (ret.first_ft == fs::file_type::regular) {
+		ContentHash second_hash;
+
+		if (record->hashed && second_info.st.st_size == record->size \
+			&& hash_file_cached(second_path, second_info.st, opts.cache, \
+				&second_hash) == 0 \
+			&& second_hash == record->hash) {
+
+			ret.file_cmp = MATCH;
+		} else {
+			ret.file_cmp = MISMATCH_CONTENT;
+		}
+		return ret;
+	} else if (ret.first_ft == fs::file_type::symlink) {
+		ContentHash second_hash;
+
+		ret.file_cmp = (record->hashed \
+			&& hash_link_target(second_path, &second_hash) == 0 \
+			&& second_hash == record->hash) ? MATCH : MISMATCH_CONTENT;
+		return ret;
+	}
+
+	ret.file_cmp = MATCH;
+	return ret;
+	/* }}} */
+}
+
+
+/** Adds the relative path '&file_rp' to '&paths', along with any of its
+ * parent directories the table doesn't have yet. Paths must be added in
+ * sorted order, so that the parents of each path are either the parents of
+ * the path added before it or haven't been added at all. The paths are
+ * added without hints, as nothing about their files is known yet.
+ *
+ * \param '&paths' the table to add the path to.
+ * \param '&chain' the ids of the components of the path added before this
+ *     one, from the top down. It is updated to those of '&file_rp'.
+ * \param '&file_rp' the relative path to add.
+ * \return the id of '&file_rp' in '&paths'.
+ */
+PathId add_sorted_path(PathTable &paths, std::vector<PathId> &chain, \
+	const fs::path &file_rp) {
+	/* {{{ */
+	size_t depth = 0;
+	for (const fs::path &component : file_rp) {
+		const std::string &name = component.native();
+		if (name.empty()) {
+			continue;
+		}
+		if (depth < chain.size() && paths.name(chain[depth]) == name) {
+			depth++;
+			continue;
+		}
+
+		chain.resize(depth);
+		PathId parent = (depth == 0) ? PATH_ID_ROOT : chain[depth - 1];
+		chain.push_back(paths.add(parent, name.data(), name.size(), \
+			FILE_HINT_UNKNOWN, FILE_HINT_UNKNOWN));
+		depth++;
+	}
+	chain.resize(depth);
+
+	return (depth == 0) ? PATH_ID_ROOT : chain[depth - 1];
+	/* }}} */
+}
+
+
+/** Returns a sorted vector list of FullFileComparisons representing
+ * comparisons between every file in a manifest and the file of the same
+ * relative path in the directory tree rooted at '&second_root' (and the
+ * other way round), just as compare_directory_trees() would if the tree the
+ * manifest was written from were the first tree.
+ *
+ * \param '&records' the records of the manifest, sorted by path.
+ * \param '&second_root' the file path to the root of the directory tree to
+ *     verify against the manifest.
+ * \param '&paths' an empty table that is filled with every relative path in
+ *     the manifest or the directory tree. The ids of the FullFileComparisons
+ *     refer to it.
+ * \param '&pool' the thread pool the comparisons will be run on.
+ * \param '&opts' the options that decide which hash cache (if any) is used.
+ * \return a vector list of FullFileComparisons representing the comparisons
+ *     between every file in the manifest or the directory tree.
+ */
+std::vector<FullFileComparison> compare_tree_to_manifest( \
+	std::vector<ManifestRecord> &records, fs::path &second_root, \
+	PathTable &paths, ThreadPool &pool, CompareOptions &opts) {
+	/* {{{ */
+
+	PathTable second_paths;
+	sorted_files_in_tree(second_root, pool, opts.follow_symlinks, \
+		second_paths);
+
+	/* Merge the manifest's paths with the tree's paths, remembering for each
+	 * path the record that describes it (if there is one) */
+	std::vector<PathId> combined_ids;
+	std::vector<ManifestRecord *> combined_records;
+	std::vector<PathId> chain;
+	size_t r = 0;
+	size_t f = 1;
+	fs::path second_rp;
+	if (f < second_paths.size()) {
+		second_rp = second_paths.path((PathId) f);
+	}
+	while (r < records.size() || f < second_paths.size()) {
+		ManifestRecord *record = NULL;
+		bool in_second = false;
+		if (f == second_paths.size() \
+			|| (r < records.size() && records[r].path < second_rp)) {
+			record = &records[r++];
+		} else if (r == records.size() || second_rp < records[r].path) {
+			in_second = true;
+		} else {
+			record = &records[r++];
+			in_second = true;
+		}
+
+		combined_ids.push_back(add_sorted_path(paths, chain, \
+			in_second ? second_rp : record->path));
+		combined_records.push_back(record);
+		if (in_second && ++f < second_paths.size()) {
+			second_rp = second_paths.path((PathId) f);
+		}
+	}
+
+	std::vector<FullFileComparison> ret(combined_ids.size());
+	for (size_t start = 0; start < combined_ids.size(); \
+		start += COMPARISONS_PER_TASK) {
+
+		size_t end = std::min(start + COMPARISONS_PER_TASK, \
+			combined_ids.size());
+		pool.submit([&, start, end] {
+			for (size_t i = start; i < end; i++) {
+				FullFileComparison &res = ret[i];
+				fs::path second_path = second_root \
+					/ paths.path(combined_ids[i]);
+				res.id = combined_ids[i];
+				res.partial_cmp = compare_path_to_record(combined_records[i], \
+					second_path, opts);
+			}
+		});
+	}
+	pool.wait_idle();
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes the index entries of two files (in the broad sense) and returns a
+ * PartialFileComparison that represents whether they are the same or
+ * different, exactly as compare_path() would for the files themselves.
+ * Regular files are compared by their indexed content hashes.
+ *
+ * \param '*first' the index entry of the first file, or NULL if there is no
+ *     such file.
+ * \param '*second' the index entry of the second file, or NULL if there is
+ *     no such file.
+ * \return a PartialFileComparison that represents whether the two files
+ *     are equivalent, if they differ and how they differ, as well as the two
+ *     file types of the files.
+ */
+PartialFileComparison compare_index_entries(const IndexEntry *first, \
+	const IndexEntry *second) {
+	/* {{{ */
+
+	PartialFileComparison ret;
+	ret.first_ft = fs::file_type::not_found;
+	ret.second_ft = fs::file_type::not_found;
+	ret.mismatch_offset = -1;
+	ret.same_inode = false;
+
+	/* Broken symlinks are listed, but don't exist */
+	bool first_exists = (first != NULL \
+		&& first->type != fs::file_type::not_found);
+	bool second_exists = (second != NULL \
+		&& second->type != fs::file_type::not_found);
+
+	if (!first_exists && !second_exists) {
+		ret.file_cmp = MISMATCH_NEITHER_EXISTS;
+		return ret;
+	} else if (first_exists && !second_exists) {
+		ret.first_ft = first->type;
+		ret.file_cmp = MISMATCH_ONLY_FIRST_EXISTS;
+		return ret;
+	} else if (!first_exists && second_exists) {
+		ret.second_ft = second->type;
+		ret.file_cmp = MISMATCH_ONLY_SECOND_EXISTS;
+		return ret;
+	}
+
+	ret.first_ft = first->type;
+	ret.second_ft = second->type;
+	if (ret.first_ft != ret.second_ft) {
+		ret.file_cmp = MISMATCH_TYPE;
+		return ret;
+	}
+
+	if (ret.first_ft == fs::file_type::regular) {
+		if (first->dev == second->dev && first->ino == second->ino) {
+			ret.same_inode = true;
+			ret.file_cmp = MATCH;
+		} else if (first->hashed && second->hashed \
+			&& first->size == second->size && first->hash == second->hash) {
+			ret.file_cmp = MATCH;
+		} else {
+			ret.file_cmp = MISMATCH_CONTENT;
+		}
+		return ret;
+	} else if (ret.first_ft == fs::file_type::symlink) {
+		/* The hashes of unfollowed symlinks are the hashes of their targets */
+		ret.file_cmp = (first->hashed && second->hashed \
+			&& first->hash == second->hash) ? MATCH : MISMATCH_CONTENT;
+		return ret;
+	}
+
+	ret.file_cmp = MATCH;
+	return ret;
+	/* }}} */
+}
+
+
+/** Compares every file (in the broad sense) in the indexed directory
+ * 'dir_id' of the first tree with the file of the same name in the
+ * indexed directory of the same name in the second tree, and then does the
+ * same for every subdirectory, depth first, in the same order as
+ * lockstep_compare_directory(). No file is touched: everything comes from
+ * the two indexes. When two subdirectories have the same Merkle hash, their
+ * subtrees are identical, so unless matches are to be reported they are
+ * skipped and only counted.
+ *
+ * \param '&paths' the table the relative paths are added to. The ids of the
+ *     FullFileComparisons handed to '&sink' refer to it.
+ * \param 'dir_id' the id of the path of the directories being compared.
+ * \param '*first_dir' the index of the directory in the first tree, or NULL
+ *     if the first tree has no such directory.
+ * \param '*second_dir' the index of the directory in the second tree, or
+ *     NULL if the second tree has no such directory.
+ * \param 'expand_matches' whether matching subtrees are walked (so that
+ *     every match in them is handed to '&sink') rather than skipped.
+ * \param '&sink' the function every FullFileComparison will be handed to, in
+ *     sorted order.
+ * \param '&totals' the totals the files and directories of skipped subtrees
+ *     are added to.
+ */
+void merkle_compare_directory(PathTable &paths, PathId dir_id, \
+	const IndexDir *first_dir, const IndexDir *second_dir, \
+	bool expand_matches, ComparisonSink &sink, ComparisonTotals &totals) {
+	/* {{{ */
+	static const std::vector<IndexEntry> no_entries;
+	const std::vector<IndexEntry> &first_entries = \
+		first_dir != NULL ? first_dir->entries : no_entries;
+	const std::vector<IndexEntry> &second_entries = \
+		second_dir != NULL ? second_dir->entries : no_entries;
+
+	size_t f = 0;
+	size_t s = 0;
+	while (f < first_entries.size() || s < second_entries.size()) {
+		const IndexEntry *fe = NULL;
+		const IndexEntry *se = NULL;
+
+		if (s == second_entries.size() || (f < first_entries.size() \
+			&& first_entries[f].name < second_entries[s].name)) {
+			fe = &first_entries[f++];
+		} else if (f == first_entries.size() \
+			|| second_entries[s].name < first_entries[f].name) {
+			se = &second_entries[s++];
+		} else {
+			fe = &first_entries[f++];
+			se = &second_entries[s++];
+		}
+
+		const std::string &name = (fe != NULL) ? fe->name : se->name;
+		FullFileComparison res;
+		res.id = paths.add(dir_id, name.data(), name.size(), \
+			FILE_HINT_UNKNOWN, FILE_HINT_UNKNOWN);
+		res.partial_cmp = compare_index_entries(fe, se);
+		sink(res);
+
+		const IndexDir *first_sub = (fe != NULL && fe->dir != nullptr) \
+			? fe->dir.get() : NULL;
+		const IndexDir *second_sub = (se != NULL && se->dir != nullptr) \
+			? se->dir.get() : NULL;
+		if (first_sub == NULL && second_sub == NULL) {
+			continue;
+		}
+
+		/* Identical subtrees can only produce matches, so if those aren't
+		 * wanted there's no need to walk them */
+		if (!expand_matches && first_sub != NULL && second_sub != NULL \
+			&& first_sub->complete && second_sub->complete \
+			&& first_sub->hash == second_sub->hash) {
+
+			totals.max_num_file_matches += first_sub->num_files;
+			totals.num_file_matches += first_sub->num_files;
+			totals.max_num_dir_matches += first_sub->num_dirs;
+			totals.num_dir_matches += first_sub->num_dirs;
+			continue;
+		}
+
+		merkle_compare_directory(paths, res.id, first_sub, second_sub, \
+			expand_matches, sink, totals);
+	}
+	/* }}} */
+}
+
+
+/** Brings the sidecar index of the directory tree rooted at '&root' up to
+ * date and saves it. The previous index (if there is one) is used to avoid
+ * re-reading unchanged directories and re-hashing unchanged files.
+ *
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&pool' the thread pool the tree will be indexed on.
+ * \param '&opts' the options that decide which hash cache (if any) is used.
+ * \param '&index' set to the up to date index of the tree.
+ */
+void update_tree_index(fs::path &root, ThreadPool &pool, \
+	CompareOptions &opts, IndexDir &index) {
+	/* {{{ */
+	std::string index_path;
+	bool have_path = (merkle_index_path(root, index_path) == 0);
+	IndexDir old_index;
+	bool have_old = have_path \
+		&& (read_merkle_index(index_path.c_str(), old_index) == 0);
+
+	refresh_merkle_index(pool, root, have_old ? &old_index : NULL, index, \
+		opts.cache, opts.follow_symlinks);
+
+	/* Failing to save the index only makes the next run slower, so it isn't
+	 * fatal */
+	if (have_path && write_merkle_index(index_path.c_str(), index) != 0) {
+		std::cerr << "Could not save the index \"" << index_path << "\"\n";
+	}
+	/* }}} */
+}
+
+
+/** Prints a FullFileComparison (if it is a mismatch, or if matches are to be
+ * printed) and adds it to the running totals. The paths of the two files
+ * are only put together from the id of the comparison if it is printed.
+ *
+ * \param '&e' the FullFileComparison to be printed.
+ * \param '&first_root' the file path to the root of the first directory tree.
+ * \param '&second_root' the file path to the root of the second directory tree.
+ * \param '&paths' the table the id of '&e' refers to.
+ * \param '&opts' the options controlling what gets printed and how.
+ * \param '&totals' the running totals to be updated.
+ */
+void print_comparison(FullFileComparison &e, fs::path &first_root, \
+	fs::path &second_root, const PathTable &paths, PrintOptions &opts, \
+	ComparisonTotals &totals) {
+	/* {{{ */
+
+	if (opts.print_totals) {
+		if (e.partial_cmp.first_ft == fs::file_type::directory \
+			|| e.partial_cmp.second_ft == fs::file_type::directory) {
+
+			totals.max_num_dir_matches++;
+		}
+		if (e.partial_cmp.first_ft == fs::file_type::regular \
+			|| e.partial_cmp.second_ft == fs::file_type::regular) {
+
+			totals.max_num_file_matches++;
+		}
+	}
+
+	fs::path first_path;
+	fs::path second_path;
+	if (e.partial_cmp.file_cmp != MATCH || opts.print_matches) {
+		fs::path file_rp = paths.path(e.id);
+		first_path = first_root / file_rp;
+		second_path = second_root / file_rp;
+	}
+
+	switch (e.partial_cmp.file_cmp) {
+		case MATCH:
+			if (opts.print_matches) {
+				if (opts.pretty_output) printf("%s%s", BOLD, GREEN);
+				if (opts.label_same_inode && e.partial_cmp.same_inode) {
+					printf("\"%s\" == \"%s\" (same inode)\n",
+						first_path.c_str(), second_path.c_str());
+				} else {
+					printf("\"%s\" == \"%s\"\n",
+						first_path.c_str(), second_path.c_str());
+				}
+				if (opts.pretty_output) printf("%s", NORMAL);
+			}
+			if (e.partial_cmp.first_ft == fs::file_type::regular) {
+				totals.num_file_matches++;
+			} else if (e.partial_cmp.first_ft == fs::file_type::directory) {
+				totals.num_dir_matches++;
+			}
+			break;
+		case MISMATCH_TYPE:
+			if (opts.pretty_output) printf("%s%s", BOLD, RED);
+			printf("\"%s\" is not of the same type as \"%s\"\n",
+				first_path.c_str(), second_path.c_str());
+			if (opts.pretty_output) printf("%s", NORMAL);
+			break;
+		case MISMATCH_CONTENT:
+			if (opts.pretty_output) printf("%s%s", BOLD, RED);
+			/* Like cmp, number the bytes of the files from 1 */
+			if (e.partial_cmp.mismatch_offset >= 0) {
+				printf("\"%s\" differs from \"%s\" at byte %lld\n",
+					first_path.c_str(), second_path.c_str(),
+					(long long) e.partial_cmp.mismatch_offset + 1);
+			} else {
+				printf("\"%s\" differs from \"%s\"\n",
+					first_path.c_str(), second_path.c_str());
+			}
+			if (opts.pretty_output) printf("%s", NORMAL);
+			break;
+		case MISMATCH_METADATA:
+			if (opts.pretty_output) printf("%s%s", BOLD, RED);
+			printf("\"%s\" may differ from \"%s\" (modification time or " \
+				"mode differs)\n", first_path.c_str(), second_path.c_str());
+			if (opts.pretty_output) printf("%s", NORMAL);
+			break;
+		case MISMATCH_NEITHER_EXISTS:
+			if (opts.pretty_output) printf("%s%s", BOLD, RED);
+			printf("Neither \"%s\" nor \"%s\" exist\n",
+				first_path.c_str(), second_path.c_str());
+			if (opts.pretty_output) printf("%s", NORMAL);
+			break;
+		case MISMATCH_ONLY_FIRST_EXISTS:
+			if (opts.pretty_output) printf("%s%s", BOLD, RED);
+			printf("\"%s\" exists, but \"%s\" does NOT exist\n",
+				first_path.c_str(), second_path.c_str());
+			if (opts.pretty_output) printf("%s", NORMAL);
+			break;
+		case MISMATCH_ONLY_SECOND_EXISTS:
+			if (opts.pretty_output) printf("%s%s", BOLD, RED);
+			printf("\"%s\" does NOT exist, but \"%s\" does exist\n",
+				first_path.c_str(), second_path.c_str());
+			if (opts.pretty_output) printf("%s", NORMAL);
+			break;
+	}
+	/* }}} */
+}
+
+
+/** Parses a count given on the command line: a non-negative decimal
+ * integer and nothing else.
+ *
+ * \param '*str' the string to parse.
+ * \param '*count' set to the count.
+ * \return 0 on success, -1 if '*str' isn't a non-negative integer.
+ */
+int parse_count(const char *str, uint64_t *count) {
+	/* {{{ */
+	char *end;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (str[0] < '0' || str[0] > '9' || errno != 0 || *end != '\0') {
+		return -1;
+	}
+	*count = (uint64_t) value;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Parses a size given on the command line: a positive integer, optionally
+ * followed by K, M or G (or their lowercase forms) for kibibytes, mebibytes
+ * or gibibytes. The size must start with a digit, so leading whitespace and
+ * signs are rejected rather than passed on to strtoull().
+ *
+ * \param '*str' the string to parse.
+ * \param '*size' set to the size.
+ * \return 0 on success, -1 if '*str' isn't a positive size.
+ */
+int parse_size(const char *str, uint64_t *size) {
+	/* {{{ */
+	char *end;
+	errno = 0;
+	unsigned long long value = strtoull(str, &end, 10);
+	if (str[0] < '0' || str[0] > '9' || errno != 0 || value == 0) {
+		return -1;
+	}
+
+	unsigned shift = 0;
+	switch (*end) {
+		case '\0': break;
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		default: return -1;
+	}
+	if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+		return -1;
+	}
+	*size = (uint64_t) value << shift;
+
+	return 0;
+	/* }}} */
+}
+
+
+/* The benchmarks link against everything in this file but main() */
+#ifndef CMP_TREE_NO_MAIN
+int main(int argc, char **argv) {
+	PrintOptions print_opts = { false, false, false, false };
+	bool flag_lockstep = false;
+	bool flag_stream = false;
+	bool flag_write_manifest = false;
+	bool flag_against_manifest = false;
+	bool flag_merkle = false;
+	bool flag_fail_fast = false;
+	bool flag_quiet = false;
+	bool found_difference = false;
+	size_t num_jobs = default_num_jobs();
+	CompareOptions compare_opts = { BACKEND_AUTO, MMAP_THRESHOLD_DEFAULT, \
+		NULL, false, false, false, NULL, false, 0, PREFETCH_BUDGET_DEFAULT, \
+		false, NULL, NULL };
+	HashCache cache;
+	enum IoPolicy io_policy = IO_POLICY_AUTO;
+	enum IoClass io_class = IO_CLASS_DEFAULT;
+	uint64_t max_read_rate = 0;
+	uint64_t max_iops = 0;
+	uint64_t latency_target_ms = 0;
+	char *cache_path = NULL;
+
+	int opt;
+	struct option opt_table[] = {
+		{ "backend",  required_argument,  NULL,  'b' },
+		{ "follow-symlinks",  no_argument,  NULL,  'L' },
+		{ "jobs",     required_argument,  NULL,  'j' },
+		{ "lockstep", no_argument,        NULL,  'l' },
+		{ "matches",  no_argument,        NULL,  'm' },
+		{ "pretty",   no_argument,        NULL,  'p' },
+		{ "quiet",    no_argument,        NULL,  'q' },
+		{ "stream",   no_argument,        NULL,  's' },
+		{ "totals",   no_argument,        NULL,  't' },
+		{ "mmap-threshold",  required_argument,  NULL,  OPT_MMAP_THRESHOLD },
+		{ "label-same-inode",  no_argument,      NULL,  OPT_LABEL_SAME_INODE },
+		{ "cache",            required_argument,  NULL,  OPT_CACHE },
+		{ "write-manifest",   no_argument,        NULL,  OPT_WRITE_MANIFEST },
+		{ "against-manifest", no_argument,        NULL,  OPT_AGAINST_MANIFEST },
+		{ "merkle",           no_argument,        NULL,  OPT_MERKLE },
+		{ "quick",            no_argument,        NULL,  OPT_QUICK },
+		{ "verify-suspect",   no_argument,        NULL,  OPT_VERIFY_SUSPECT },
+		{ "io-policy",        required_argument,  NULL,  OPT_IO_POLICY },
+		{ "disk-order",       no_argument,        NULL,  OPT_DISK_ORDER },
+		{ "prefetch",         required_argument,  NULL,  OPT_PREFETCH },
+		{ "prefetch-budget",  required_argument,  NULL,  OPT_PREFETCH_BUDGET },
+		{ "cache-neutral",    no_argument,        NULL,  OPT_CACHE_NEUTRAL },
+		{ "max-read-rate",    required_argument,  NULL,  OPT_MAX_READ_RATE },
+		{ "max-iops",         required_argument,  NULL,  OPT_MAX_IOPS },
+		{ "latency-target",   required_argument,  NULL,  OPT_LATENCY_TARGET },
+		{ "io-class",         required_argument,  NULL,  OPT_IO_CLASS },
+		{ "fail-fast",        no_argument,        NULL,  OPT_FAIL_FAST },
+		{ 0, 0, 0, 0 }
+	};
+	char opt_string[] = { "b:j:Llmpqst" };
+
+	while ((opt = getopt_long(argc, argv, opt_string, opt_table, NULL)) != -1) {
+		switch (opt) {
+			case 'b':
+				if (0 == strcmp(optarg, "auto")) {
+					compare_opts.backend = BACKEND_AUTO;
+				} else if (0 == strcmp(optarg, "stream")) {
+					compare_opts.backend = BACKEND_STREAM;
+				} else if (0 == strcmp(optarg, "mmap")) {
+					compare_opts.backend = BACKEND_MMAP;
+				} else if (0 == strcmp(optarg, "uring")) {
+					compare_opts.backend = BACKEND_URING;
+				} else {
+					std::cerr << "Unknown backend \"" << optarg << "\" " \
+						"(expected auto, stream, mmap or uring). Exiting...\n";
+					return -1;
+				}
+				break;
+			case 'j': {
+				uint64_t jobs;
+				if (parse_count(optarg, &jobs) != 0 || jobs == 0 \
+					|| jobs > SIZE_MAX) {
+					std::cerr << "Number of jobs must be a positive integer, " \
+						"received \"" << optarg << "\". Exiting...\n";
+					return -1;
+				}
+				num_jobs = (size_t) jobs;
+				break;
+			}
+			case 'L': compare_opts.follow_symlinks = true; break;
+			case 'l': flag_lockstep = true; break;
+			case 'm': print_opts.print_matches = true; break;
+			case 'p': print_opts.pretty_output = true; break;
+			case 'q':
+				flag_quiet = true;
+				flag_fail_fast = true;
+				break;
+			case 's': flag_stream = true; break;
+			case 't': print_opts.print_totals = true; break;
+			case OPT_MMAP_THRESHOLD: {
+				uint64_t threshold;
+				if (parse_size(optarg, &threshold) != 0 \
+					|| threshold > INT64_MAX) {
+					std::cerr << "Mmap threshold must be a positive number " \
+						"of bytes, received \"" << optarg << "\". Exiting...\n";
+					return -1;
+				}
+				compare_opts.mmap_threshold = (off_t) threshold;
+				break;
+			}
+			case OPT_LABEL_SAME_INODE:
+				print_opts.label_same_inode = true;
+				break;
+			case OPT_CACHE:
+				cache_path = optarg;
+				break;
+			case OPT_WRITE_MANIFEST: flag_write_manifest = true; break;
+			case OPT_AGAINST_MANIFEST: flag_against_manifest = true; break;
+			case OPT_MERKLE: flag_merkle = true; break;
+			case OPT_QUICK: compare_opts.quick = true; break;
+			case OPT_VERIFY_SUSPECT:
+				compare_opts.quick = true;
+				compare_opts.verify_suspect = true;
+				break;
+			case OPT_IO_POLICY:
+				if (0 == strcmp(optarg, "auto")) {
+					io_policy = IO_POLICY_AUTO;
+				} else if (0 == strcmp(optarg, "rotational")) {
+					io_policy = IO_POLICY_ROTATIONAL;
+				} else if (0 == strcmp(optarg, "solid")) {
+					io_policy = IO_POLICY_SOLID;
+				} else {
+					std::cerr << "Unknown I/O policy \"" << optarg << "\" " \
+						"(expected auto, rotational or solid). Exiting...\n";
+					return -1;
+				}
+				break;
+			case OPT_DISK_ORDER: compare_opts.disk_order = true; break;
+			case OPT_PREFETCH: {
+				uint64_t files;
+				if (parse_count(optarg, &files) != 0 || files > SIZE_MAX) {
+					std::cerr << "Number of files to prefetch must be a " \
+						"non-negative integer, received \"" << optarg \
+						<< "\". Exiting...\n";
+					return -1;
+				}
+				compare_opts.prefetch_files = (size_t) files;
+				break;
+			}
+			case OPT_PREFETCH_BUDGET: {
+				uint64_t budget;
+				if (parse_size(optarg, &budget) != 0) {
+					std::cerr << "Prefetch budget must be a positive number " \
+						"of bytes, received \"" << optarg << "\". Exiting...\n";
+					return -1;
+				}
+				compare_opts.prefetch_budget = (size_t) budget;
+				break;
+			}
+			case OPT_CACHE_NEUTRAL: compare_opts.cache_neutral = true; break;
+			case OPT_MAX_READ_RATE:
+				if (parse_size(optarg, &max_read_rate) != 0) {
+					std::cerr << "Maximum read rate must be a positive number " \
+						"of bytes per second, received \"" << optarg \
+						<< "\". Exiting...\n";
+					return -1;
+				}
+				break;
+			case OPT_MAX_IOPS:
+				if (parse_count(optarg, &max_iops) != 0 || max_iops == 0) {
+					std::cerr << "Maximum IOPS must be a positive integer, " \
+						"received \"" << optarg << "\". Exiting...\n";
+					return -1;
+				}
+				break;
+			case OPT_LATENCY_TARGET:
+				if (parse_count(optarg, &latency_target_ms) != 0 \
+					|| latency_target_ms == 0) {
+					std::cerr << "Latency target must be a positive number " \
+						"of milliseconds, received \"" << optarg \
+						<< "\". Exiting...\n";
+					return -1;
+				}
+				break;
+			case OPT_IO_CLASS:
+				if (0 == strcmp(optarg, "idle")) {
+					io_class = IO_CLASS_IDLE;
+				} else if (0 == strcmp(optarg, "best-effort")) {
+					io_class = IO_CLASS_BEST_EFFORT;
+				} else {
+					std::cerr << "Unknown I/O class \"" << optarg << "\" " \
+						"(expected idle or best-effort). Exiting...\n";
+					return -1;
+				}
+				break;
+			case OPT_FAIL_FAST: flag_fail_fast = true; break;
+		}
+	}
+
+	/* If after parsing all the flags there aren't 2 arguments left */
+	if (optind + 2 != argc) {
+		fprintf(stderr, "Expected 2 arguments, received %d\n", argc - 1);
+	}
+
+	/* Like cmp -s, quiet mode only reports through the exit code, so from
+	 * here on not even errors are printed */
+	if (flag_quiet) {
+		std::cerr.setstate(std::ios_base::badbit);
+	}
+
+	fs::path first_path(argv[optind]);
+	optind++;
+	fs::path second_path(argv[optind]);
+	/* Create a list of the arguments that specify directories so that we can
+	 * check their validity. When writing a manifest, the second argument is
+	 * the manifest to create, and when verifying against one, the first
+	 * argument is the manifest to read */
+	std::vector<fs::path> directory_args;
+	if (!flag_against_manifest) {
+		directory_args.push_back(first_path);
+	}
+	if (!flag_write_manifest) {
+		directory_args.push_back(second_path);
+	}
+
+	/* Loop through all the arguments that specify directories and check that
+	 * they are valid */
+	for (auto &e: directory_args) {
+		/* Check if the given argument is a file path that points to something
+		* that exists... */
+		if (!fs::exists(e)) {
+			std::cerr << "Provided directory (" << e << \
+				") does not exist. Exiting...\n";
+			return -1;
+		} else {
+			/* ... and that it points to a directory */
+			if (!fs::is_directory(e)) {
+				std::cerr << "Provided directory (" << e << \
+					") is not a directory. Exiting...\n";
+				return -1;
+			}
+		}
+	}
+
+	if (cache_path != NULL) {
+		if (cache.open(cache_path) != 0) {
+			std::cerr << "Could not load the hash cache \"" << cache_path \
+				<< "\". Exiting...\n";
+			return -1;
+		}
+		compare_opts.cache = &cache;
+	}
+
+	fs::path manifest_root;
+	std::vector<ManifestRecord> manifest;
+	if (flag_against_manifest \
+		&& read_manifest_file(first_path.c_str(), manifest_root, manifest) != 0) {
+
+		std::cerr << "Could not read the manifest " << first_path \
+			<< ". Exiting...\n";
+		return -1;
+	}
+
+	/* Ignoring these would make a run that can't tell whether the trees
+	 * differ look like one that found them identical */
+	if (flag_fail_fast && (flag_write_manifest || flag_merkle \
+		|| flag_against_manifest)) {
+		std::cerr << "Fail-fast and quiet modes only apply to comparing two " \
+			"directory trees directly. Exiting...\n";
+		return -1;
+	}
+
+	/* The other modes start comparing before they have every path, so they
+	 * can't sort the comparisons */
+	if (compare_opts.disk_order && (flag_write_manifest || flag_merkle \
+		|| flag_stream || flag_lockstep || flag_against_manifest \
+		|| flag_fail_fast)) {
+		std::cerr << "Disk order only applies to the default mode, " \
+			"comparing in path order\n";
+		compare_opts.disk_order = false;
+	}
+	/* Prefetching in quick mode would read files that are never compared */
+	if (compare_opts.prefetch_files > 0 && (flag_write_manifest \
+		|| flag_merkle || flag_stream || flag_lockstep || flag_fail_fast \
+		|| flag_against_manifest || compare_opts.quick)) {
+		std::cerr << "Prefetching only applies to the default mode without " \
+			"--quick, not prefetching\n";
+		compare_opts.prefetch_files = 0;
+	}
+	/* The modes that hash files rather than comparing them read them
+	 * normally */
+	if (compare_opts.cache_neutral && (flag_write_manifest || flag_merkle \
+		|| flag_against_manifest)) {
+		std::cerr << "Cache-neutral reading only applies to comparing " \
+			"files directly, reading files normally\n";
+	}
+	/* Prefetched files would stay in the page cache */
+	if (compare_opts.prefetch_files > 0 && compare_opts.cache_neutral) {
+		std::cerr << "Prefetching fills the page cache, not prefetching in " \
+			"cache-neutral mode\n";
+		compare_opts.prefetch_files = 0;
+	}
+
+	IoScheduler scheduler(io_policy);
+	compare_opts.scheduler = &scheduler;
+
+	/* The latency target works by lowering the rates, so it needs one */
+	if (latency_target_ms != 0 && max_read_rate == 0 && max_iops == 0) {
+		std::cerr << "The latency target only applies with a maximum read " \
+			"rate or IOPS, ignoring it\n";
+	}
+	ReadThrottle throttle((double) max_read_rate, (double) max_iops, \
+		(double) latency_target_ms / 1000);
+	if (max_read_rate != 0 || max_iops != 0) {
+		ReadThrottle::install(&throttle);
+	}
+	/* Set before any other thread starts, so that every thread inherits it.
+	 * Failing to set it only makes the comparison less polite, so it isn't
+	 * fatal */
+	if (set_io_class(io_class) != 0) {
+		std::cerr << "Could not set the I/O class, reading at the default " \
+			"priority\n";
+	}
+
+	/* The index of each tree is kept next to its root, so a root with no
+	 * parent directory can't have one */
+	if (flag_merkle && !flag_against_manifest) {
+		for (auto &e: directory_args) {
+			std::string index_path;
+			if (merkle_index_path(e, index_path) != 0) {
+				std::cerr << "Cannot keep an index for " << e << ", since " \
+					"it has no parent directory to keep it in. Exiting...\n";
+				return -1;
+			}
+		}
+	}
+
+	/* Compare the directory trees! In disk order, when prefetching and in
+	 * fail-fast mode, every worker stays in a loop taking the next
+	 * comparison until there are none left, so none would be free to help
+	 * with the ranges of a huge file, and they aren't shared out */
+	ThreadPool pool(num_jobs);
+	if (!compare_opts.disk_order && compare_opts.prefetch_files == 0 \
+		&& !flag_fail_fast) {
+
+		compare_opts.pool = &pool;
+	}
+	ComparisonTotals totals = { 0, 0, 0, 0 };
+	/* Every mode refers to the paths it compares by their ids in here */
+	PathTable paths;
+
+	if (flag_write_manifest) {
+		if (write_tree_manifest(first_path, second_path.c_str(), pool, \
+			compare_opts) != 0) {
+
+			std::cerr << "Could not write the manifest " << second_path \
+				<< ". Exiting...\n";
+			return -1;
+		}
+	} else if (flag_merkle && !flag_against_manifest) {
+		IndexDir first_index;
+		IndexDir second_index;
+		update_tree_index(first_path, pool, compare_opts, first_index);
+		update_tree_index(second_path, pool, compare_opts, second_index);
+
+		ComparisonSink sink = [&](FullFileComparison &e) {
+			print_comparison(e, first_path, second_path, paths, print_opts, \
+				totals);
+		};
+		merkle_compare_directory(paths, PATH_ID_ROOT, &first_index, \
+			&second_index, print_opts.print_matches, sink, totals);
+	} else if (flag_fail_fast) {
+		FullFileComparison difference;
+		found_difference = first_difference_in_trees(first_path, second_path, \
+			paths, pool, compare_opts, difference);
+		if (found_difference && !flag_quiet \
+			&& difference.id != PATH_ID_ROOT) {
+			print_comparison(difference, first_path, second_path, paths, \
+				print_opts, totals);
+		}
+	} else if (flag_stream && !flag_against_manifest) {
+		stream_directory_tree_comparisons(first_path, second_path, paths, \
+			pool, compare_opts, [&](FullFileComparison &e) {
+				print_comparison(e, first_path, second_path, paths, \
+					print_opts, totals);
+			});
+	} else if (flag_against_manifest) {
+		std::vector<FullFileComparison> comparisons = \
+			compare_tree_to_manifest(manifest, second_path, paths, pool, \
+				compare_opts);
+
+		for (auto &e: comparisons) {
+			print_comparison(e, manifest_root, second_path, paths, \
+				print_opts, totals);
+		}
+	} else {
+		std::vector<PartialFileComparison> comparisons;
+		if (flag_lockstep) {
+			comparisons = compare_directory_trees_lockstep(first_path, \
+				second_path, paths, pool, compare_opts);
+		} else {
+			comparisons = compare_directory_trees(first_path, second_path, \
+				paths, pool, compare_opts);
+		}
+
+		/* The ids of the table are in sorted order, and the comparison of
+		 * each is at the index before it */
+		FullFileComparison e;
+		for (size_t id = 1; id < paths.size(); id++) {
+			e.id = (PathId) id;
+			e.partial_cmp = comparisons[id - 1];
+			print_comparison(e, first_path, second_path, paths, print_opts, \
+				totals);
+		}
+	}
+
+	/* Failing to save the cache only makes the next run slower, so it isn't
+	 * fatal */
+	if (cache_path != NULL && cache.save() != 0) {
+		std::cerr << "Could not save the hash cache \"" << cache_path \
+			<< "\"\n";
+	}
+
+	/* A run that stopped at the first difference has no totals to give */
+	if (print_opts.print_totals && !flag_write_manifest && !flag_fail_fast) {
+		fprintf(stdout, "All done!\n");
+		fprintf(stdout, "File byte-for-byte matches: %ld/%ld\n", \
+			totals.num_file_matches, totals.max_num_file_matches);
+		fprintf(stdout, "Directory matches: %ld/%ld\n", \
+			totals.num_dir_matches, totals.max_num_dir_matches);
+	}
+
+	/* Like cmp and diff, exit with 1 when the trees differ, so that scripts
+	 * can tell */
+	if (flag_fail_fast && found_difference) {
+		return 1;
 	}
 }
+#endif
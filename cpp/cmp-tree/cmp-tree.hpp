@@ -2,10 +2,60 @@
 #define CMP_TREE_HPP
 
 /* C++ includes */
+#include <atomic>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* C includes */
+#include <sys/types.h>
+
+/* Local includes */
+#include "path-table.hpp"
 
 namespace fs = std::filesystem;
 
+class HashCache;
+class IoScheduler;
+class ThreadPool;
+
+
+/* The number of paths compared by each task handed to the thread pool */
+#define COMPARISONS_PER_TASK 16
+/* The number of comparisons that may be in flight or waiting to be printed
+ * when results are streamed */
+#define REORDER_BUFFER_CAPACITY 4096
+/* The number of paths the walk of fail-fast mode may find ahead of the
+ * comparisons, before it waits for them to catch up */
+#define FAIL_FAST_QUEUE_CAPACITY 4096
+/* The size (in bytes) from which the automatic backend choice memory maps
+ * files instead of streaming them */
+#define MMAP_THRESHOLD_DEFAULT (1024 * 1024)
+
+/* Values for command line options that only have a long form */
+#define OPT_MMAP_THRESHOLD 256
+#define OPT_LABEL_SAME_INODE 257
+#define OPT_CACHE 258
+#define OPT_WRITE_MANIFEST 259
+#define OPT_AGAINST_MANIFEST 260
+#define OPT_MERKLE 261
+#define OPT_QUICK 262
+#define OPT_VERIFY_SUSPECT 263
+#define OPT_IO_POLICY 264
+#define OPT_DISK_ORDER 265
+#define OPT_PREFETCH 266
+#define OPT_PREFETCH_BUDGET 267
+#define OPT_CACHE_NEUTRAL 268
+#define OPT_MAX_READ_RATE 269
+#define OPT_MAX_IOPS 270
+#define OPT_LATENCY_TARGET 271
+#define OPT_IO_CLASS 272
+#define OPT_FAIL_FAST 273
+
+
 enum FileCmp {
 	/* For when the two files (understood in the broad sense) match. For regular
 	 * files, this indicates that the two files are byte-for-byte identical.
@@ -16,8 +66,13 @@ enum FileCmp {
 	MISMATCH_TYPE,
 	/* For when the two files (understood in the broad sense) match in their
 	 * type, but mismatch in their content (e.g. both are regular files, but
-	 * they are not byte-for-byte identical). */
+	 * they are not byte-for-byte identical, or both are symlinks with
+	 * different targets). */
 	MISMATCH_CONTENT,
+	/* For when two regular files are the same size, but differ in their
+	 * modification time or mode, and their content was not compared (see
+	 * CompareOptions::quick). */
+	MISMATCH_METADATA,
 	/* For when neither of the two files (understood in the broad sense)
 	 * exist. */
 	MISMATCH_NEITHER_EXISTS,
@@ -30,16 +85,126 @@ enum FileCmp {
 };
 
 
+enum CompareBackend {
+	/* Memory map files of at least 'mmap_threshold' bytes and stream every
+	 * other file. */
+	BACKEND_AUTO,
+	/* Read files through a pair of std::ifstreams. */
+	BACKEND_STREAM,
+	/* Memory map files and compare the mapped regions directly. */
+	BACKEND_MMAP,
+	/* Read files with io_uring, keeping up to 2 * URING_CHUNKS_IN_FLIGHT
+	 * reads of one file pair in flight on each worker, so there are only as
+	 * many pairs being read at once as there are workers. Falls back to
+	 * BACKEND_STREAM if io_uring is unavailable. */
+	BACKEND_URING,
+};
+
+
+typedef struct compare_options {
+	enum CompareBackend backend;
+	off_t mmap_threshold;
+	/* If not NULL, files are compared by their content hashes where those
+	 * are cached, and the hashes of files that have to be read are added */
+	HashCache *cache;
+	/* Decide whether regular files of the same size match from their
+	 * modification times and modes alone, without reading them */
+	bool quick;
+	/* In quick mode, read the files whose metadata differs (but whose sizes
+	 * are the same) rather than reporting them as MISMATCH_METADATA */
+	bool verify_suspect;
+	/* Treat symlinks as the files they point to, and walk into symlinks to
+	 * directories, rather than comparing the symlinks' targets */
+	bool follow_symlinks;
+	/* If not NULL, regular files are only read once the devices they are on
+	 * have room for another reader, and files on rotational devices are read
+	 * according to the devices' policies (see IoScheduler) */
+	IoScheduler *scheduler;
+	/* Start the comparisons in the order the files are on disk rather than
+	 * in path order (see disk_ordered_ids()). Only the default mode, which
+	 * has every path before any comparison starts, can do this */
+	bool disk_order;
+	/* If not 0, a Prefetcher warms the page cache for the comparisons up to
+	 * this many ahead of the last one started, holding at most
+	 * 'prefetch_budget' bytes for comparisons that haven't finished. Like
+	 * disk order, only the default mode can do this */
+	size_t prefetch_files;
+	size_t prefetch_budget;
+	/* Read regular files without leaving them in the page cache (see
+	 * compare_files_cache_neutral()), so that comparing huge trees doesn't
+	 * push out the pages other programs rely on */
+	bool cache_neutral;
+	/* If not NULL and it has more than one worker, files of at least
+	 * PARALLEL_COMPARE_THRESHOLD bytes on solid state devices are split into
+	 * ranges that are compared by several of its workers at once (see
+	 * compare_files_parallel()). It is left NULL in the modes whose workers
+	 * never go back to the pool for more tasks (disk order, prefetching and
+	 * fail-fast), since the helpers would never get to run there */
+	ThreadPool *pool;
+	/* If not NULL, the reads of regular file content give up (and their
+	 * comparisons fail) once this becomes true. Fail-fast mode points it at
+	 * a flag of its own, which it sets when it finds a difference */
+	const std::atomic<bool> *cancel;
+}CompareOptions;
+
 typedef struct partial_file_cmp {
 	enum FileCmp file_cmp;
 	fs::file_type first_ft;
 	fs::file_type second_ft;
+	/* For MISMATCH_CONTENT, the offset of the first byte at which the two
+	 * files differ, or -1 if it isn't known (e.g. because the files differ in
+	 * size and so were never read). */
+	off_t mismatch_offset;
+	/* For MATCH, whether the two paths lead to the same inode on the same
+	 * device, in which case the files were not read. */
+	bool same_inode;
 }PartialFileComparison;
 
+/* The entries of one directory found by a directory walk, sorted by name */
+typedef struct dir_listing {
+	/* The names of the entries, one after another */
+	std::string names;
+	/* Where the name of each entry starts in 'names', plus the end of the
+	 * last name */
+	std::vector<uint32_t> name_starts;
+	/* The DT_* type of each entry */
+	std::vector<unsigned char> types;
+	/* For each entry the walk descended into, the listing of that
+	 * directory, and nullptr for every other entry */
+	std::vector<std::unique_ptr<struct dir_listing>> subdirs;
+	/* The indices (in ascending order) of the symlinks to directories that
+	 * the walk may follow, which are only walked into once the rest of the
+	 * tree has been walked (see walk_linked_directories()) */
+	std::vector<uint32_t> dir_links;
+	/* Whether the directory was read in full */
+	bool complete;
+}DirListing;
+
 typedef struct full_file_cmp {
 	PartialFileComparison partial_cmp;
-	fs::path first_path;
-	fs::path second_path;
+	/* The id of the relative path of the two files, in the PathTable of the
+	 * comparison. The full paths are only built when they are printed */
+	PathId id;
 }FullFileComparison;
 
+/* A function that is handed the id of each file (in the broad sense) a walk
+ * of the directory trees finds, once the walk has added its relative path
+ * (and what the walk knows about the file in each tree, see
+ * get_file_info()) to its PathTable */
+typedef std::function<void(PathId)> PathVisitor;
+
+typedef struct print_options {
+	bool print_totals;
+	bool print_matches;
+	bool pretty_output;
+	bool label_same_inode;
+}PrintOptions;
+
+typedef struct comparison_totals {
+	long max_num_file_matches;
+	long max_num_dir_matches;
+	long num_file_matches;
+	long num_dir_matches;
+}ComparisonTotals;
+
 #endif
@@ -0,0 +1,1132 @@
+/* C++ includes */
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* C includes */
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "compare-backends.hpp"
+#include "compare-kernel.hpp"
+#include "content-hash.hpp"
+#include "file-info.hpp"
+#include "hash-cache.hpp"
+#include "read-throttle.hpp"
+#include "thread-pool.hpp"
+#include "uring-engine.hpp"
+
+namespace fs = std::filesystem;
+
+
+/** Returns whether the comparison a read belongs to has been cancelled.
+ *
+ * \param '*cancel' the cancellation flag of the comparison, or NULL if it
+ *     can't be cancelled.
+ * \return true if the comparison should give up, false otherwise.
+ */
+static bool is_cancelled(const std::atomic<bool> *cancel) {
+	/* {{{ */
+	return cancel != NULL && cancel->load(std::memory_order_relaxed);
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files of the same size and returns 0 if the
+ * files are byte-for-byte identical, and -1 if they are not. The files are
+ * read through a pair of std::ifstreams.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int compare_files_stream(fs::path &first_path, fs::path &second_path, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+	/* Read through both files simultaneously, comparing their bytes. If at any
+	 * point two bytes at the same location in the files differ, return -1 */
+	std::ifstream first_stream(first_path.c_str(), std::ifstream::binary);
+	std::ifstream second_stream(second_path.c_str(), std::ifstream::binary);
+	/* A file that can't be opened must not look like an empty one, or it
+	 * would match where the other backends report a failure */
+	if (!first_stream.is_open() || !second_stream.is_open()) {
+		return -1;
+	}
+	first_stream.sync_with_stdio(false);
+	second_stream.sync_with_stdio(false);
+	/* Create a buffer of 8192 chars, all initialized to 0(?) */
+	std::vector<char> first_buf(8192, 0);
+	std::vector<char> second_buf(8192, 0);
+	off_t pos = 0;
+
+	while(first_stream.good() && second_stream.good()) {
+		if (is_cancelled(cancel)) {
+			return -1;
+		}
+		int64_t start = read_throttle_begin(2 * first_buf.size(), 2);
+		first_stream.read(first_buf.data(), first_buf.size());
+		second_stream.read(second_buf.data(), second_buf.size());
+		read_throttle_end(start);
+		std::streamsize first_bytes_read = first_stream.gcount();
+		std::streamsize second_bytes_read = second_stream.gcount();
+		size_t common = (size_t) std::min(first_bytes_read, second_bytes_read);
+
+		size_t diff = first_mismatch(first_buf.data(), second_buf.data(), \
+			common);
+		if (diff != common) {
+			*mismatch_offset = pos + diff;
+			return -1;
+		}
+
+		/* One file ended before the other */
+		if (first_bytes_read != second_bytes_read) {
+			*mismatch_offset = pos + common;
+			return -1;
+		}
+		pos += common;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/* Where the calling thread jumps back to if touching a mapped window raises
+ * SIGBUS, or NULL if it isn't comparing mapped windows */
+static thread_local sigjmp_buf *mapped_window_guard = NULL;
+static std::once_flag sigbus_handler_once;
+/* What SIGBUS did before handle_sigbus() was installed */
+static struct sigaction previous_sigbus_action;
+
+
+/** Handles SIGBUS, which the kernel raises when a thread touches a page of a
+ * mapping that lies past the end of the file, because the file was
+ * truncated after it was mapped. A thread comparing mapped windows gives up
+ * on the comparison; any other SIGBUS is handled as it was before.
+ *
+ * \param 'sig' the signal, SIGBUS.
+ */
+static void handle_sigbus(int sig) {
+	/* {{{ */
+	if (mapped_window_guard != NULL) {
+		siglongjmp(*mapped_window_guard, 1);
+	}
+
+	sigaction(SIGBUS, &previous_sigbus_action, NULL);
+	raise(sig);
+	/* }}} */
+}
+
+
+/** Compares two mapped windows of 'len' bytes, surviving the files being
+ * truncated underneath them.
+ *
+ * \param '*first' the window of the first file.
+ * \param '*second' the window of the second file.
+ * \param 'len' the length of both windows.
+ * \param '*diff' set to the offset of the first byte at which the windows
+ *     differ, or 'len' if they don't.
+ * \return 0 on success, -1 if either file no longer covers its window.
+ */
+static int compare_mapped_windows(const void *first, const void *second, \
+	size_t len, size_t *diff) {
+	/* {{{ */
+	sigjmp_buf guard;
+	if (sigsetjmp(guard, 1) != 0) {
+		mapped_window_guard = NULL;
+		return -1;
+	}
+
+	mapped_window_guard = &guard;
+	*diff = first_mismatch(first, second, len);
+	mapped_window_guard = NULL;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files that are both 'size' bytes long and
+ * returns 0 if the files are byte-for-byte identical, and -1 if they are
+ * not. Rather than reading the files into buffers, both files are memory
+ * mapped MMAP_WINDOW_SIZE bytes at a time and the mapped regions are
+ * compared directly, so the data is never copied out of the page cache. Each
+ * window is advised as sequential and will-need so the kernel reads ahead
+ * aggressively and drops pages behind us. If either file is truncated while
+ * it is being compared, the comparison fails rather than the SIGBUS killing
+ * the program.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param 'size' the size in bytes of both files.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int compare_files_mmap(fs::path &first_path, fs::path &second_path, \
+	off_t size, const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+
+	/* Empty files can't be mapped, but are trivially identical */
+	if (size == 0) {
+		return 0;
+	}
+
+	std::call_once(sigbus_handler_once, [] {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = handle_sigbus;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGBUS, &action, &previous_sigbus_action);
+	});
+
+	int first_fd = open(first_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (first_fd == -1) {
+		return -1;
+	}
+	int second_fd = open(second_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (second_fd == -1) {
+		close(first_fd);
+		return -1;
+	}
+
+	int ret = 0;
+	for (off_t offset = 0; offset < size && ret == 0; \
+		offset += MMAP_WINDOW_SIZE) {
+
+		if (is_cancelled(cancel)) {
+			ret = -1;
+			break;
+		}
+		size_t window = (size_t) std::min((off_t) MMAP_WINDOW_SIZE, \
+			size - offset);
+		/* The kernel reads the mapped windows in on its own, so how long
+		 * that takes can't be told apart from comparing them, and only the
+		 * rates apply */
+		read_throttle_begin(2 * window, \
+			(unsigned) (2 * ((window + THROTTLE_OP_SIZE - 1) \
+				/ THROTTLE_OP_SIZE)));
+
+		void *first_map = mmap(NULL, window, PROT_READ, MAP_SHARED, \
+			first_fd, offset);
+		if (first_map == MAP_FAILED) {
+			ret = -1;
+			break;
+		}
+		void *second_map = mmap(NULL, window, PROT_READ, MAP_SHARED, \
+			second_fd, offset);
+		if (second_map == MAP_FAILED) {
+			munmap(first_map, window);
+			ret = -1;
+			break;
+		}
+
+		madvise(first_map, window, MADV_SEQUENTIAL);
+		madvise(first_map, window, MADV_WILLNEED);
+		madvise(second_map, window, MADV_SEQUENTIAL);
+		madvise(second_map, window, MADV_WILLNEED);
+
+		size_t diff;
+		if (compare_mapped_windows(first_map, second_map, window, &diff) \
+			!= 0) {
+			ret = -1;
+		} else if (diff != window) {
+			*mismatch_offset = offset + diff;
+			ret = -1;
+		}
+
+		munmap(first_map, window);
+		munmap(second_map, window);
+	}
+
+	close(first_fd);
+	close(second_fd);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files that are both 'size' bytes long and
+ * returns 0 if the files are byte-for-byte identical, and -1 if they are
+ * not. The files are read with the calling thread's io_uring engine, which
+ * keeps many reads of both files in flight at once. If io_uring is not
+ * available, the files are compared with compare_files_stream() instead.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param 'size' the size in bytes of both files.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int compare_files_uring(fs::path &first_path, fs::path &second_path, \
+	off_t size, const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+
+	UringEngine *engine = UringEngine::for_this_thread();
+	if (engine == NULL) {
+		return compare_files_stream(first_path, second_path, cancel, \
+			mismatch_offset);
+	}
+
+	int first_fd = open(first_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (first_fd == -1) {
+		return -1;
+	}
+	int second_fd = open(second_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (second_fd == -1) {
+		close(first_fd);
+		return -1;
+	}
+
+	int ret = engine->compare_files(first_fd, second_fd, size, cancel, \
+		mismatch_offset);
+
+	close(first_fd);
+	close(second_fd);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Reads from 'fd' into 'buf' until 'len' bytes have been read or the end of
+ * the file is reached.
+ *
+ * \param 'fd' the file descriptor to read from.
+ * \param '*buf' the buffer to read into.
+ * \param 'len' the number of bytes to read.
+ * \param '*cancel' if not NULL, reading gives up (and fails) once this
+ *     becomes true.
+ * \return the number of bytes read (less than 'len' only at the end of the
+ *     file), or -1 on failure.
+ */
+static ssize_t read_full(int fd, char *buf, size_t len, \
+	const std::atomic<bool> *cancel) {
+	/* {{{ */
+	size_t total = 0;
+
+	while (total < len) {
+		if (is_cancelled(cancel)) {
+			return -1;
+		}
+		int64_t start = read_throttle_begin(len - total, 1);
+		ssize_t n = read(fd, buf + total, len - total);
+		read_throttle_end(start);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		total += (size_t) n;
+	}
+
+	return (ssize_t) total;
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files that are both 'size' bytes long and
+ * returns 0 if the files are byte-for-byte identical, and -1 if they are
+ * not. The files are read 'chunk_size' bytes at a time, a whole chunk of one
+ * file and then the same chunk of the other, so that a disk both files are
+ * on only has to seek between them once per chunk. If the files are on
+ * different devices, the kernel is asked to start reading each chunk of the
+ * second file before the same chunk of the first file is read, so that
+ * both devices are busy at once rather than taking turns.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param 'size' the size in bytes of both files.
+ * \param 'chunk_size' the number of bytes read from each file at a time.
+ * \param 'overlap' whether the reads of the two files should overlap, which
+ *     is only worth doing if they are on different devices.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int compare_files_chunked(fs::path &first_path, fs::path &second_path, \
+	off_t size, size_t chunk_size, bool overlap, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+	int first_fd = open(first_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (first_fd == -1) {
+		return -1;
+	}
+	int second_fd = open(second_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (second_fd == -1) {
+		close(first_fd);
+		return -1;
+	}
+	posix_fadvise(first_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(second_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/* Don't allocate large buffers for small files */
+	size_t buf_size = (size_t) std::min((off_t) chunk_size, \
+		std::max(size, (off_t) 1));
+	std::vector<char> first_buf(buf_size);
+	std::vector<char> second_buf(buf_size);
+	int ret = 0;
+
+	for (off_t offset = 0; offset < size && ret == 0; offset += buf_size) {
+		size_t len = (size_t) std::min((off_t) buf_size, size - offset);
+
+		if (overlap) {
+			posix_fadvise(second_fd, offset, len, POSIX_FADV_WILLNEED);
+		}
+		ssize_t first_n = read_full(first_fd, first_buf.data(), len, cancel);
+		ssize_t second_n = read_full(second_fd, second_buf.data(), len, \
+			cancel);
+		if (first_n < 0 || second_n < 0) {
+			ret = -1;
+			break;
+		}
+
+		size_t common = (size_t) std::min(first_n, second_n);
+		size_t diff = first_mismatch(first_buf.data(), second_buf.data(), \
+			common);
+		if (diff != common || first_n != second_n || common != len) {
+			/* A file that got shorter since it was stat'd differs where it
+			 * ends */
+			*mismatch_offset = offset + diff;
+			ret = -1;
+		}
+	}
+
+	close(first_fd);
+	close(second_fd);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Reads from 'fd' at 'offset' into 'buf' until 'len' bytes have been read
+ * or the end of the file is reached.
+ *
+ * \param 'fd' the file descriptor to read from.
+ * \param '*buf' the buffer to read into.
+ * \param 'len' the number of bytes to read.
+ * \param 'offset' the offset to read from.
+ * \param '*cancel' if not NULL, reading gives up (and fails) once this
+ *     becomes true.
+ * \return the number of bytes read (less than 'len' only at the end of the
+ *     file), or -1 on failure.
+ */
+static ssize_t pread_full(int fd, char *buf, size_t len, off_t offset, \
+	const std::atomic<bool> *cancel) {
+	/* {{{ */
+	size_t total = 0;
+
+	while (total < len) {
+		if (is_cancelled(cancel)) {
+			return -1;
+		}
+		int64_t start = read_throttle_begin(len - total, 1);
+		ssize_t n = pread(fd, buf + total, len - total, \
+			offset + (off_t) total);
+		read_throttle_end(start);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		total += (size_t) n;
+	}
+
+	return (ssize_t) total;
+	/* }}} */
+}
+
+
+/* A pair of files being compared range by range by several workers */
+typedef struct range_comparison {
+	fs::path first_path;
+	fs::path second_path;
+	off_t size;
+	/* If not NULL, every worker gives up once this becomes true */
+	const std::atomic<bool> *cancel;
+	size_t num_ranges;
+	/* The next range to be taken by a worker */
+	std::atomic<size_t> next_range;
+	/* The lowest range a difference has been found in (0 if a read failed),
+	 * or 'num_ranges' if none has been. This is the cancellation flag:
+	 * workers stop as soon as their range is past it, while the ranges
+	 * before it are still compared, since one of them may hold an earlier
+	 * difference */
+	std::atomic<size_t> cancel_after;
+	std::mutex lock;
+	std::condition_variable finished;
+	/* The number of helpers comparing ranges */
+	unsigned active;
+	/* Whether the worker that started the comparison has stopped taking
+	 * ranges, after which helpers that haven't started yet do nothing */
+	bool claiming_done;
+	/* The offset of the first difference found so far, or -1 */
+	off_t mismatch_offset;
+	bool failed;
+}RangeComparison;
+
+
+/** Lowers the cancellation flag of '&state' to 'range', unless it is already
+ * lower.
+ *
+ * \param '&state' the comparison.
+ * \param 'range' the range a difference was found in.
+ */
+static void cancel_ranges_after(RangeComparison &state, size_t range) {
+	/* {{{ */
+	size_t current = state.cancel_after.load();
+	while (range < current \
+		&& !state.cancel_after.compare_exchange_weak(current, range)) {}
+	/* }}} */
+}
+
+
+/** Takes ranges of the files of '&state' one after another and compares
+ * them, until every range has been taken or the comparison is cancelled.
+ * Each worker opens the files itself, so that the kernel's read-ahead
+ * follows each worker's sequential reading of its own range.
+ *
+ * \param '&state' the comparison.
+ */
+static void compare_ranges(RangeComparison &state) {
+	/* {{{ */
+	int first_fd = open(state.first_path.c_str(), O_RDONLY | O_CLOEXEC);
+	int second_fd = open(state.second_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (first_fd == -1 || second_fd == -1) {
+		if (first_fd != -1) close(first_fd);
+		if (second_fd != -1) close(second_fd);
+		std::lock_guard<std::mutex> guard(state.lock);
+		state.failed = true;
+		cancel_ranges_after(state, 0);
+		return;
+	}
+	posix_fadvise(first_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(second_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	std::vector<char> first_buf(PARALLEL_READ_SIZE);
+	std::vector<char> second_buf(PARALLEL_READ_SIZE);
+	size_t range;
+
+	while ((range = state.next_range.fetch_add(1)) < state.num_ranges) {
+		off_t start = (off_t) range * PARALLEL_RANGE_SIZE;
+		off_t end = std::min(start + (off_t) PARALLEL_RANGE_SIZE, state.size);
+
+		for (off_t offset = start; offset < end; \
+			offset += PARALLEL_READ_SIZE) {
+
+			if (range > state.cancel_after.load()) {
+				break;
+			}
+
+			size_t len = (size_t) std::min((off_t) PARALLEL_READ_SIZE, \
+				end - offset);
+			ssize_t first_n = pread_full(first_fd, first_buf.data(), len, \
+				offset, state.cancel);
+			ssize_t second_n = pread_full(second_fd, second_buf.data(), len, \
+				offset, state.cancel);
+			if (first_n < 0 || second_n < 0) {
+				std::lock_guard<std::mutex> guard(state.lock);
+				state.failed = true;
+				cancel_ranges_after(state, 0);
+				break;
+			}
+
+			size_t common = (size_t) std::min(first_n, second_n);
+			size_t diff = first_mismatch(first_buf.data(), second_buf.data(), \
+				common);
+			if (diff != common || first_n != second_n || common != len) {
+				/* A file that got shorter since it was stat'd differs where
+				 * it ends */
+				std::lock_guard<std::mutex> guard(state.lock);
+				off_t found = offset + (off_t) diff;
+				if (state.mismatch_offset == -1 \
+					|| found < state.mismatch_offset) {
+
+					state.mismatch_offset = found;
+				}
+				cancel_ranges_after(state, range);
+				break;
+			}
+		}
+	}
+
+	close(first_fd);
+	close(second_fd);
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files that are both 'size' bytes long and
+ * returns 0 if the files are byte-for-byte identical, and -1 if they are
+ * not. The files are split into ranges of PARALLEL_RANGE_SIZE bytes, which
+ * the calling thread and helpers on '&pool' take in order and compare at
+ * the same time with pread(), so that one huge file doesn't keep a single
+ * worker busy long after the others have finished. As soon as a
+ * difference is found, the ranges after it are abandoned. The ranges before
+ * it are still compared, so that the first differing byte is the one
+ * reported.
+ *
+ * Each helper reads as a comparison of its own, so it takes a slot on the
+ * devices of both files from '*scheduler' first. The calling thread waits
+ * for the helpers while holding its own slots, so a helper that finds no
+ * free slot doesn't wait for one, and leaves its share of the ranges to the
+ * others.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param '&first_file_info' the stat of the first file.
+ * \param '&second_file_info' the stat of the second file, which is the same
+ *     size as the first.
+ * \param '&pool' the pool the helpers are run on. The calling thread may be
+ *     one of its workers.
+ * \param '*scheduler' the scheduler the helpers take their slots from, or
+ *     NULL if reads aren't scheduled.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int compare_files_parallel(fs::path &first_path, fs::path &second_path, \
+	struct stat &first_file_info, struct stat &second_file_info, \
+	ThreadPool &pool, IoScheduler *scheduler, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+	off_t size = first_file_info.st_size;
+	dev_t first_dev = first_file_info.st_dev;
+	dev_t second_dev = second_file_info.st_dev;
+
+	/* Helpers may only get to run after the comparison is over, so they
+	 * share ownership of its state */
+	std::shared_ptr<RangeComparison> state = \
+		std::make_shared<RangeComparison>();
+	state->first_path = first_path;
+	state->second_path = second_path;
+	state->size = size;
+	state->cancel = cancel;
+	state->num_ranges = (size_t) ((size + PARALLEL_RANGE_SIZE - 1) \
+		/ PARALLEL_RANGE_SIZE);
+	state->next_range = 0;
+	state->cancel_after = state->num_ranges;
+	state->active = 0;
+	state->claiming_done = false;
+	state->mismatch_offset = -1;
+	state->failed = false;
+
+	size_t num_helpers = std::min(pool.size() - 1, state->num_ranges - 1);
+	for (size_t h = 0; h < num_helpers; h++) {
+		pool.submit([state, scheduler, first_dev, second_dev] {
+			if (scheduler != NULL \
+				&& !scheduler->try_acquire(first_dev, second_dev)) {
+				return;
+			}
+			bool started = false;
+			{
+				std::lock_guard<std::mutex> guard(state->lock);
+				if (!state->claiming_done) {
+					state->active++;
+					started = true;
+				}
+			}
+			if (started) {
+				compare_ranges(*state);
+			}
+			/* The slots are given back before the caller can see that the
+			 * helper is done */
+			if (scheduler != NULL) {
+				scheduler->release(first_dev, second_dev);
+			}
+			if (started) {
+				{
+					std::lock_guard<std::mutex> guard(state->lock);
+					state->active--;
+				}
+				state->finished.notify_all();
+			}
+		});
+	}
+
+	/* Compare ranges alongside the helpers, and then wait for the helpers
+	 * that started to finish theirs */
+	compare_ranges(*state);
+	std::unique_lock<std::mutex> guard(state->lock);
+	state->claiming_done = true;
+	state->finished.wait(guard, [&] { return state->active == 0; });
+
+	if (state->failed) {
+		return -1;
+	}
+	if (state->mismatch_offset != -1) {
+		*mismatch_offset = state->mismatch_offset;
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/* A file opened to be read without filling the page cache */
+typedef struct uncached_file {
+	int fd;
+	/* Whether reads bypass the page cache (O_DIRECT). If not, the ranges
+	 * read are dropped from the page cache once they have been used */
+	bool direct;
+}UncachedFile;
+
+
+/** Opens the file at '&path' for reading with O_DIRECT, or for ordinary
+ * reading if the file system doesn't support O_DIRECT.
+ *
+ * \param '&path' a file path that points to the file.
+ * \param '*f' set to the opened file.
+ * \return 0 on success, -1 if the file couldn't be opened.
+ */
+static int open_uncached(fs::path &path, UncachedFile *f) {
+	/* {{{ */
+	f->direct = true;
+	f->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+	if (f->fd == -1 && errno == EINVAL) {
+		f->direct = false;
+		f->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	}
+	if (f->fd == -1) {
+		return -1;
+	}
+	posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Reads up to 'len' bytes at 'offset' from '*f' into 'buf', stopping
+ * early only at the end of the file. If a direct read is refused (e.g.
+ * because the device's blocks are larger than DIRECT_IO_ALIGNMENT, or a
+ * short read left the next read unaligned), the file falls back to
+ * ordinary reads.
+ *
+ * \param '*f' the file to read from.
+ * \param '*buf' the buffer to read into, aligned to DIRECT_IO_ALIGNMENT.
+ * \param 'len' the number of bytes to read, a multiple of
+ *     DIRECT_IO_ALIGNMENT.
+ * \param 'offset' the offset to read from, a multiple of
+ *     DIRECT_IO_ALIGNMENT.
+ * \param '*cancel' if not NULL, reading gives up (and fails) once this
+ *     becomes true.
+ * \return the number of bytes read, or -1 on failure.
+ */
+static ssize_t read_uncached(UncachedFile *f, char *buf, size_t len, \
+	off_t offset, const std::atomic<bool> *cancel) {
+	/* {{{ */
+	size_t total = 0;
+
+	while (total < len) {
+		if (is_cancelled(cancel)) {
+			return -1;
+		}
+		int64_t start = read_throttle_begin(len - total, 1);
+		ssize_t n = pread(f->fd, buf + total, len - total, \
+			offset + (off_t) total);
+		read_throttle_end(start);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL && f->direct) {
+				int flags = fcntl(f->fd, F_GETFL);
+				if (flags != -1 \
+					&& fcntl(f->fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+
+					f->direct = false;
+					continue;
+				}
+			}
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		total += (size_t) n;
+	}
+
+	return (ssize_t) total;
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files that are both 'size' bytes long and
+ * returns 0 if the files are byte-for-byte identical, and -1 if they are
+ * not, without leaving the files in the page cache. The files are read
+ * with O_DIRECT, CACHE_NEUTRAL_CHUNK_SIZE bytes at a time, into a pair of
+ * aligned buffers, so the pages other programs have cached are never pushed
+ * out. Where O_DIRECT isn't supported, the files are read normally and each
+ * chunk is dropped from the page cache (POSIX_FADV_DONTNEED) as soon as it
+ * has been compared. Either way the comparison never holds more than the
+ * two buffers in memory.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param 'size' the size in bytes of both files.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int compare_files_cache_neutral(fs::path &first_path, fs::path &second_path, \
+	off_t size, const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+	UncachedFile first;
+	UncachedFile second;
+	if (open_uncached(first_path, &first) != 0) {
+		return -1;
+	}
+	if (open_uncached(second_path, &second) != 0) {
+		close(first.fd);
+		return -1;
+	}
+
+	/* Don't allocate large buffers for small files. Direct reads need
+	 * whole blocks, so the buffers are rounded up to the alignment */
+	size_t buf_size = (size_t) std::min((off_t) CACHE_NEUTRAL_CHUNK_SIZE, \
+		std::max(size, (off_t) 1));
+	buf_size = (buf_size + DIRECT_IO_ALIGNMENT - 1) \
+		/ DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+	void *mem;
+	if (posix_memalign(&mem, DIRECT_IO_ALIGNMENT, 2 * buf_size) != 0) {
+		close(first.fd);
+		close(second.fd);
+		return -1;
+	}
+	char *first_buf = (char *) mem;
+	char *second_buf = first_buf + buf_size;
+	int ret = 0;
+
+	for (off_t offset = 0; offset < size && ret == 0; offset += buf_size) {
+		size_t len = (size_t) std::min((off_t) buf_size, size - offset);
+		size_t read_len = (len + DIRECT_IO_ALIGNMENT - 1) \
+			/ DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+
+		ssize_t first_n = read_uncached(&first, first_buf, read_len, offset, \
+			cancel);
+		ssize_t second_n = read_uncached(&second, second_buf, read_len, \
+			offset, cancel);
+		if (first_n < 0 || second_n < 0) {
+			ret = -1;
+			break;
+		}
+
+		/* Whatever a file grew by since it was stat'd is ignored, like the
+		 * other backends ignore it */
+		first_n = std::min(first_n, (ssize_t) len);
+		second_n = std::min(second_n, (ssize_t) len);
+		size_t common = (size_t) std::min(first_n, second_n);
+		size_t diff = first_mismatch(first_buf, second_buf, common);
+		if (diff != common || first_n != second_n || common != len) {
+			/* A file that got shorter since it was stat'd differs where it
+			 * ends */
+			*mismatch_offset = offset + diff;
+			ret = -1;
+		}
+
+		if (!first.direct) {
+			posix_fadvise(first.fd, offset, read_len, POSIX_FADV_DONTNEED);
+		}
+		if (!second.direct) {
+			posix_fadvise(second.fd, offset, read_len, POSIX_FADV_DONTNEED);
+		}
+	}
+
+	free(mem);
+	close(first.fd);
+	close(second.fd);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes a path to a regular file and computes the hash of its content.
+ *
+ * \param '&path' a file path that points to the file we wish to hash.
+ * \param '*cancel' if not NULL, hashing gives up (and fails) once this
+ *     becomes true.
+ * \param '*hash' set to the hash of the file's content.
+ * \return 0 on success, -1 if the file could not be read.
+ */
+int hash_file(fs::path &path, const std::atomic<bool> *cancel, \
+	ContentHash *hash) {
+	/* {{{ */
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	std::vector<char> buf(HASH_BUFFER_SIZE);
+	Blake3Hasher hasher;
+	ssize_t n;
+	while ((n = read_full(fd, buf.data(), buf.size(), cancel)) > 0) {
+		hasher.update(buf.data(), (size_t) n);
+	}
+	close(fd);
+
+	if (n < 0) {
+		return -1;
+	}
+	hasher.finalize(hash);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a path to a symlink and computes the hash of its target, so that
+ * symlinks can be recorded and compared the same way regular files are.
+ *
+ * \param '&path' a file path that points to the symlink.
+ * \param '*hash' set to the hash of the symlink's target.
+ * \return 0 on success, -1 if the symlink could not be read.
+ */
+int hash_link_target(fs::path &path, ContentHash *hash) {
+	/* {{{ */
+	std::string target;
+	if (read_link_target(AT_FDCWD, path.c_str(), target) != 0) {
+		return -1;
+	}
+
+	Blake3Hasher hasher;
+	hasher.update(target.data(), target.size());
+	hasher.finalize(hash);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a path to a regular file and returns the hash of its content,
+ * from 'cache' if the hash of the file's current content is cached there,
+ * and otherwise by reading the file (in which case the hash is added to
+ * 'cache').
+ *
+ * \param '&path' a file path that points to the file we wish to hash.
+ * \param '&file_info' the stat() data of the file.
+ * \param '*cache' the cache to use, or NULL to always read the file.
+ * \param '*hash' set to the hash of the file's content.
+ * \return 0 on success, -1 if the file could not be read.
+ */
+int hash_file_cached(fs::path &path, struct stat &file_info, \
+	HashCache *cache, ContentHash *hash) {
+	/* {{{ */
+	if (cache == NULL) {
+		return hash_file(path, NULL, hash);
+	}
+
+	HashCacheKey key = hash_cache_key(file_info);
+	if (cache->lookup(key, hash)) {
+		return 0;
+	}
+	if (hash_file(path, NULL, hash) != 0) {
+		return -1;
+	}
+	cache->insert(key, *hash);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files of the same size, compares them and
+ * hashes both of them in a single pass. Unlike the other backends, reading
+ * doesn't stop at the first difference, since both hashes are wanted
+ * whatever the result of the comparison.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, and left untouched if they are identical.
+ * \param '*first_hash' set to the hash of the first file's content.
+ * \param '*second_hash' set to the hash of the second file's content.
+ * \return 0 if both files were read to the end, -1 otherwise.
+ */
+int compare_and_hash_files(fs::path &first_path, fs::path &second_path, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset, \
+	ContentHash *first_hash, ContentHash *second_hash) {
+	/* {{{ */
+	int first_fd = open(first_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (first_fd == -1) {
+		return -1;
+	}
+	int second_fd = open(second_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (second_fd == -1) {
+		close(first_fd);
+		return -1;
+	}
+	posix_fadvise(first_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(second_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	std::vector<char> first_buf(HASH_BUFFER_SIZE);
+	std::vector<char> second_buf(HASH_BUFFER_SIZE);
+	Blake3Hasher first_hasher;
+	Blake3Hasher second_hasher;
+	bool differ = false;
+	off_t pos = 0;
+	int ret = 0;
+
+	while (true) {
+		ssize_t first_n = read_full(first_fd, first_buf.data(), \
+			first_buf.size(), cancel);
+		ssize_t second_n = read_full(second_fd, second_buf.data(), \
+			second_buf.size(), cancel);
+		if (first_n < 0 || second_n < 0) {
+			ret = -1;
+			break;
+		}
+		if (first_n == 0 && second_n == 0) {
+			break;
+		}
+
+		if (!differ) {
+			size_t common = (size_t) std::min(first_n, second_n);
+			size_t diff = first_mismatch(first_buf.data(), second_buf.data(), \
+				common);
+			if (diff != common || first_n != second_n) {
+				*mismatch_offset = pos + diff;
+				differ = true;
+			}
+		}
+		first_hasher.update(first_buf.data(), (size_t) first_n);
+		second_hasher.update(second_buf.data(), (size_t) second_n);
+		pos += std::max(first_n, second_n);
+	}
+
+	close(first_fd);
+	close(second_fd);
+
+	if (ret == 0) {
+		first_hasher.finalize(first_hash);
+		second_hasher.finalize(second_hash);
+	}
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes two paths to regular files of the same size and returns 0 if the
+ * files are identical, and -1 if they are not, using 'cache' to avoid
+ * reading files whose content hash is already known. If both files have a
+ * cached hash, neither is read and the hashes are compared. If only one
+ * does, only the other file is read (and hashed). If the hashes match, the
+ * files are identical. Otherwise both files are compared byte-for-byte and
+ * hashed as they are read, so that the offset of their first difference is
+ * known. Newly computed hashes are added to the cache.
+ *
+ * \param '&first_path' a file path that points to the first file we wish to
+ *     compare.
+ * \param '&second_path' a file path that points to the second file we wish to
+ *     compare.
+ * \param '&first_file_info' the stat() data of the first file.
+ * \param '&second_file_info' the stat() data of the second file.
+ * \param '&cache' the cache to look hashes up in and add new hashes to.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are identical, -1 otherwise.
+ */
+int compare_files_cached(fs::path &first_path, fs::path &second_path, \
+	struct stat &first_file_info, struct stat &second_file_info, \
+	HashCache &cache, const std::atomic<bool> *cancel, \
+	off_t *mismatch_offset) {
+	/* {{{ */
+	HashCacheKey first_key = hash_cache_key(first_file_info);
+	HashCacheKey second_key = hash_cache_key(second_file_info);
+	ContentHash first_hash;
+	ContentHash second_hash;
+	bool first_cached = cache.lookup(first_key, &first_hash);
+	bool second_cached = cache.lookup(second_key, &second_hash);
+
+	if (first_cached && !second_cached) {
+		if (hash_file(second_path, cancel, &second_hash) != 0) {
+			return -1;
+		}
+		cache.insert(second_key, second_hash);
+		second_cached = true;
+	} else if (second_cached && !first_cached) {
+		if (hash_file(first_path, cancel, &first_hash) != 0) {
+			return -1;
+		}
+		cache.insert(first_key, first_hash);
+		first_cached = true;
+	}
+
+	/* Files whose hashes differ are still read, so that the offset of their
+	 * first difference is reported whether or not their hashes were cached */
+	if (first_cached && second_cached && first_hash == second_hash) {
+		return 0;
+	}
+
+	off_t diff = -1;
+	if (compare_and_hash_files(first_path, second_path, cancel, &diff, \
+		&first_hash, &second_hash) != 0) {
+
+		return -1;
+	}
+	cache.insert(first_key, first_hash);
+	cache.insert(second_key, second_hash);
+
+	if (diff != -1) {
+		*mismatch_offset = diff;
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
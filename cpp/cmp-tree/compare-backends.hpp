@@ -0,0 +1,69 @@
+#ifndef COMPARE_BACKENDS_HPP
+#define COMPARE_BACKENDS_HPP
+
+/* C++ includes */
+#include <atomic>
+#include <filesystem>
+
+/* C includes */
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Local includes */
+#include "content-hash.hpp"
+#include "hash-cache.hpp"
+#include "io-scheduler.hpp"
+#include "thread-pool.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* The size of the regions of each file that the mmap backend maps and
+ * compares at a time */
+#define MMAP_WINDOW_SIZE (64 * 1024 * 1024)
+/* The size of the buffers files are read into when they are hashed */
+#define HASH_BUFFER_SIZE (128 * 1024)
+/* The size of the chunks cache-neutral comparisons read from each file at a
+ * time */
+#define CACHE_NEUTRAL_CHUNK_SIZE (1024 * 1024)
+/* The alignment of the buffers, offsets and lengths of O_DIRECT reads. It
+ * covers the logical block size of nearly every device */
+#define DIRECT_IO_ALIGNMENT 4096
+/* Files of at least this many bytes are compared by several workers at
+ * once (see compare_files_parallel()) */
+#define PARALLEL_COMPARE_THRESHOLD (256 * 1024 * 1024)
+/* The size of the ranges a file compared in parallel is split into */
+#define PARALLEL_RANGE_SIZE (64 * 1024 * 1024)
+/* The size of each read of a range */
+#define PARALLEL_READ_SIZE (1024 * 1024)
+
+
+int compare_files_stream(fs::path &first_path, fs::path &second_path, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset);
+int compare_files_mmap(fs::path &first_path, fs::path &second_path, \
+	off_t size, const std::atomic<bool> *cancel, off_t *mismatch_offset);
+int compare_files_uring(fs::path &first_path, fs::path &second_path, \
+	off_t size, const std::atomic<bool> *cancel, off_t *mismatch_offset);
+int compare_files_chunked(fs::path &first_path, fs::path &second_path, \
+	off_t size, size_t chunk_size, bool overlap, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset);
+int compare_files_parallel(fs::path &first_path, fs::path &second_path, \
+	struct stat &first_file_info, struct stat &second_file_info, \
+	ThreadPool &pool, IoScheduler *scheduler, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset);
+int compare_files_cache_neutral(fs::path &first_path, fs::path &second_path, \
+	off_t size, const std::atomic<bool> *cancel, off_t *mismatch_offset);
+int hash_file(fs::path &path, const std::atomic<bool> *cancel, \
+	ContentHash *hash);
+int hash_link_target(fs::path &path, ContentHash *hash);
+int hash_file_cached(fs::path &path, struct stat &file_info, \
+	HashCache *cache, ContentHash *hash);
+int compare_and_hash_files(fs::path &first_path, fs::path &second_path, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset, \
+	ContentHash *first_hash, ContentHash *second_hash);
+int compare_files_cached(fs::path &first_path, fs::path &second_path, \
+	struct stat &first_file_info, struct stat &second_file_info, \
+	HashCache &cache, const std::atomic<bool> *cancel, \
+	off_t *mismatch_offset);
+
+#endif
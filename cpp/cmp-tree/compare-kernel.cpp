@@ -0,0 +1,273 @@
+/* C++ includes */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Local includes */
+#include "compare-kernel.hpp"
+
+/* The vectorised kernels are only built for x86, every other architecture
+ * uses the scalar kernel */
+#if defined(__x86_64__) || defined(__i386__)
+#define COMPARE_KERNEL_X86
+#endif
+
+#ifdef COMPARE_KERNEL_X86
+/* C includes */
+#include <immintrin.h>
+#endif
+
+
+typedef size_t (*MismatchKernel)(const uint8_t *, const uint8_t *, size_t);
+
+
+/** Returns the offset of the first byte at which the two buffers differ,
+ * comparing one byte at a time. Used for the tails of buffers and on CPUs
+ * without any of the vector extensions below.
+ *
+ * \param '*first' the first buffer.
+ * \param '*second' the second buffer.
+ * \param 'len' the number of bytes to compare.
+ * \return the offset of the first differing byte, or 'len' if the buffers
+ *     are identical.
+ */
+static size_t first_mismatch_scalar(const uint8_t *first, \
+	const uint8_t *second, size_t len) {
+	/* {{{ */
+
+	/* Skip over identical 8 byte words first */
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t a;
+		uint64_t b;
+		memcpy(&a, first + i, 8);
+		memcpy(&b, second + i, 8);
+		if (a != b) {
+			break;
+		}
+	}
+	for (; i < len; i++) {
+		if (first[i] != second[i]) {
+			return i;
+		}
+	}
+
+	return len;
+	/* }}} */
+}
+
+
+#ifdef COMPARE_KERNEL_X86
+/** SSE2 version of first_mismatch_scalar(), comparing 64 bytes per
+ * iteration.
+ */
+__attribute__((target("sse2")))
+static size_t first_mismatch_sse2(const uint8_t *first, \
+	const uint8_t *second, size_t len) {
+	/* {{{ */
+
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		__m128i eq0 = _mm_cmpeq_epi8( \
+			_mm_loadu_si128((const __m128i *) (first + i)), \
+			_mm_loadu_si128((const __m128i *) (second + i)));
+		__m128i eq1 = _mm_cmpeq_epi8( \
+			_mm_loadu_si128((const __m128i *) (first + i + 16)), \
+			_mm_loadu_si128((const __m128i *) (second + i + 16)));
+		__m128i eq2 = _mm_cmpeq_epi8( \
+			_mm_loadu_si128((const __m128i *) (first + i + 32)), \
+			_mm_loadu_si128((const __m128i *) (second + i + 32)));
+		__m128i eq3 = _mm_cmpeq_epi8( \
+			_mm_loadu_si128((const __m128i *) (first + i + 48)), \
+			_mm_loadu_si128((const __m128i *) (second + i + 48)));
+		__m128i all = _mm_and_si128(_mm_and_si128(eq0, eq1), \
+			_mm_and_si128(eq2, eq3));
+
+		/* Only work out exactly where the difference is once we know there
+		 * is one somewhere in these 64 bytes */
+		if (_mm_movemask_epi8(all) != 0xFFFF) {
+			uint64_t mask = \
+				(uint64_t) (uint16_t) _mm_movemask_epi8(eq0) \
+				| (uint64_t) (uint16_t) _mm_movemask_epi8(eq1) << 16 \
+				| (uint64_t) (uint16_t) _mm_movemask_epi8(eq2) << 32 \
+				| (uint64_t) (uint16_t) _mm_movemask_epi8(eq3) << 48;
+			return i + __builtin_ctzll(~mask);
+		}
+	}
+	for (; i + 16 <= len; i += 16) {
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8( \
+			_mm_loadu_si128((const __m128i *) (first + i)), \
+			_mm_loadu_si128((const __m128i *) (second + i))));
+		if (mask != 0xFFFF) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+
+	return i + first_mismatch_scalar(first + i, second + i, len - i);
+	/* }}} */
+}
+
+
+/** AVX2 version of first_mismatch_scalar(), comparing 128 bytes per
+ * iteration.
+ */
+__attribute__((target("avx2")))
+static size_t first_mismatch_avx2(const uint8_t *first, \
+	const uint8_t *second, size_t len) {
+	/* {{{ */
+
+	size_t i = 0;
+	for (; i + 128 <= len; i += 128) {
+		__m256i eq0 = _mm256_cmpeq_epi8( \
+			_mm256_loadu_si256((const __m256i *) (first + i)), \
+			_mm256_loadu_si256((const __m256i *) (second + i)));
+		__m256i eq1 = _mm256_cmpeq_epi8( \
+			_mm256_loadu_si256((const __m256i *) (first + i + 32)), \
+			_mm256_loadu_si256((const __m256i *) (second + i + 32)));
+		__m256i eq2 = _mm256_cmpeq_epi8( \
+			_mm256_loadu_si256((const __m256i *) (first + i + 64)), \
+			_mm256_loadu_si256((const __m256i *) (second + i + 64)));
+		__m256i eq3 = _mm256_cmpeq_epi8( \
+			_mm256_loadu_si256((const __m256i *) (first + i + 96)), \
+			_mm256_loadu_si256((const __m256i *) (second + i + 96)));
+		__m256i all = _mm256_and_si256(_mm256_and_si256(eq0, eq1), \
+			_mm256_and_si256(eq2, eq3));
+
+		if ((unsigned) _mm256_movemask_epi8(all) != 0xFFFFFFFFu) {
+			uint64_t lo = \
+				(uint64_t) (uint32_t) _mm256_movemask_epi8(eq0) \
+				| (uint64_t) (uint32_t) _mm256_movemask_epi8(eq1) << 32;
+			if (lo != UINT64_MAX) {
+				return i + __builtin_ctzll(~lo);
+			}
+			uint64_t hi = \
+				(uint64_t) (uint32_t) _mm256_movemask_epi8(eq2) \
+				| (uint64_t) (uint32_t) _mm256_movemask_epi8(eq3) << 32;
+			return i + 64 + __builtin_ctzll(~hi);
+		}
+	}
+	for (; i + 32 <= len; i += 32) {
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8( \
+			_mm256_loadu_si256((const __m256i *) (first + i)), \
+			_mm256_loadu_si256((const __m256i *) (second + i))));
+		if (mask != 0xFFFFFFFFu) {
+			return i + __builtin_ctz(~mask);
+		}
+	}
+
+	return i + first_mismatch_scalar(first + i, second + i, len - i);
+	/* }}} */
+}
+
+
+/** AVX-512 version of first_mismatch_scalar(), comparing 256 bytes per
+ * iteration. The tail is handled with masked loads instead of falling back
+ * to the scalar loop.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static size_t first_mismatch_avx512(const uint8_t *first, \
+	const uint8_t *second, size_t len) {
+	/* {{{ */
+
+	size_t i = 0;
+	for (; i + 256 <= len; i += 256) {
+		__mmask64 ne0 = _mm512_cmpneq_epi8_mask( \
+			_mm512_loadu_si512(first + i), _mm512_loadu_si512(second + i));
+		__mmask64 ne1 = _mm512_cmpneq_epi8_mask( \
+			_mm512_loadu_si512(first + i + 64), \
+			_mm512_loadu_si512(second + i + 64));
+		__mmask64 ne2 = _mm512_cmpneq_epi8_mask( \
+			_mm512_loadu_si512(first + i + 128), \
+			_mm512_loadu_si512(second + i + 128));
+		__mmask64 ne3 = _mm512_cmpneq_epi8_mask( \
+			_mm512_loadu_si512(first + i + 192), \
+			_mm512_loadu_si512(second + i + 192));
+
+		if ((ne0 | ne1 | ne2 | ne3) != 0) {
+			if (ne0) return i + __builtin_ctzll(ne0);
+			if (ne1) return i + 64 + __builtin_ctzll(ne1);
+			if (ne2) return i + 128 + __builtin_ctzll(ne2);
+			return i + 192 + __builtin_ctzll(ne3);
+		}
+	}
+	for (; i < len; i += 64) {
+		size_t remaining = len - i;
+		__mmask64 load_mask = (remaining >= 64) \
+			? ~(__mmask64) 0 : (((__mmask64) 1 << remaining) - 1);
+		__mmask64 ne = _mm512_mask_cmpneq_epi8_mask(load_mask, \
+			_mm512_maskz_loadu_epi8(load_mask, first + i), \
+			_mm512_maskz_loadu_epi8(load_mask, second + i));
+		if (ne) {
+			return i + __builtin_ctzll(ne);
+		}
+	}
+
+	return len;
+	/* }}} */
+}
+#endif
+
+
+/** Picks the widest kernel the CPU supports, as reported by cpuid, or the
+ * scalar kernel on CPUs other than x86.
+ *
+ * \param '**name' set to the name of the chosen kernel.
+ * \return the chosen kernel.
+ */
+static MismatchKernel select_kernel(const char **name) {
+	/* {{{ */
+#ifdef COMPARE_KERNEL_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f") \
+		&& __builtin_cpu_supports("avx512bw")) {
+
+		*name = "avx512";
+		return first_mismatch_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		*name = "avx2";
+		return first_mismatch_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		*name = "sse2";
+		return first_mismatch_sse2;
+	}
+#endif
+
+	*name = "scalar";
+	return first_mismatch_scalar;
+	/* }}} */
+}
+
+
+static const char *kernel_name = NULL;
+static const MismatchKernel kernel = select_kernel(&kernel_name);
+
+
+/** Returns the offset of the first byte at which the two buffers differ.
+ * On x86, the comparison is done by a vectorised kernel (AVX-512, AVX2 or
+ * SSE2) chosen once, at start up, based on what the CPU supports.
+ *
+ * \param '*first' the first buffer.
+ * \param '*second' the second buffer.
+ * \param 'len' the number of bytes to compare.
+ * \return the offset of the first differing byte, or 'len' if the buffers
+ *     are identical.
+ */
+size_t first_mismatch(const void *first, const void *second, size_t len) {
+	/* {{{ */
+	return kernel((const uint8_t *) first, (const uint8_t *) second, len);
+	/* }}} */
+}
+
+
+/** Returns the name of the kernel first_mismatch() uses on this CPU.
+ *
+ * \return one of "avx512", "avx2", "sse2" or "scalar".
+ */
+const char *compare_kernel_name() {
+	/* {{{ */
+	return kernel_name;
+	/* }}} */
+}
@@ -0,0 +1,11 @@
+#ifndef COMPARE_KERNEL_HPP
+#define COMPARE_KERNEL_HPP
+
+/* C++ includes */
+#include <cstddef>
+
+
+size_t first_mismatch(const void *first, const void *second, size_t len);
+const char *compare_kernel_name();
+
+#endif
@@ -0,0 +1,269 @@
+/* C++ includes */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Local includes */
+#include "content-hash.hpp"
+
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+
+/* Domain separation flags */
+#define BLAKE3_CHUNK_START (1 << 0)
+#define BLAKE3_CHUNK_END (1 << 1)
+#define BLAKE3_PARENT (1 << 2)
+#define BLAKE3_ROOT (1 << 3)
+
+
+static const uint32_t BLAKE3_IV[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t BLAKE3_MSG_PERMUTATION[16] = {
+	2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8,
+};
+
+
+/* The BLAKE3 compression function {{{ */
+static inline uint32_t rotr32(uint32_t w, unsigned c) {
+	return (w >> c) | (w << (32 - c));
+}
+
+
+static inline void g(uint32_t state[16], size_t a, size_t b, size_t c, \
+	size_t d, uint32_t mx, uint32_t my) {
+
+	state[a] = state[a] + state[b] + mx;
+	state[d] = rotr32(state[d] ^ state[a], 16);
+	state[c] = state[c] + state[d];
+	state[b] = rotr32(state[b] ^ state[c], 12);
+	state[a] = state[a] + state[b] + my;
+	state[d] = rotr32(state[d] ^ state[a], 8);
+	state[c] = state[c] + state[d];
+	state[b] = rotr32(state[b] ^ state[c], 7);
+}
+
+
+static inline void round_function(uint32_t state[16], const uint32_t m[16]) {
+	/* Mix the columns */
+	g(state, 0, 4, 8, 12, m[0], m[1]);
+	g(state, 1, 5, 9, 13, m[2], m[3]);
+	g(state, 2, 6, 10, 14, m[4], m[5]);
+	g(state, 3, 7, 11, 15, m[6], m[7]);
+	/* Mix the diagonals */
+	g(state, 0, 5, 10, 15, m[8], m[9]);
+	g(state, 1, 6, 11, 12, m[10], m[11]);
+	g(state, 2, 7, 8, 13, m[12], m[13]);
+	g(state, 3, 4, 9, 14, m[14], m[15]);
+}
+
+
+static void compress(const uint32_t cv[8], const uint8_t block[64], \
+	uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16]) {
+
+	uint32_t m[16];
+	for (size_t i = 0; i < 16; i++) {
+		m[i] = (uint32_t) block[4 * i] \
+			| (uint32_t) block[4 * i + 1] << 8 \
+			| (uint32_t) block[4 * i + 2] << 16 \
+			| (uint32_t) block[4 * i + 3] << 24;
+	}
+
+	uint32_t state[16] = {
+		cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+		BLAKE3_IV[0], BLAKE3_IV[1], BLAKE3_IV[2], BLAKE3_IV[3],
+		(uint32_t) counter, (uint32_t) (counter >> 32), block_len, flags,
+	};
+
+	for (size_t r = 0; r < 7; r++) {
+		round_function(state, m);
+		if (r == 6) {
+			break;
+		}
+		uint32_t permuted[16];
+		for (size_t i = 0; i < 16; i++) {
+			permuted[i] = m[BLAKE3_MSG_PERMUTATION[i]];
+		}
+		memcpy(m, permuted, sizeof(m));
+	}
+
+	for (size_t i = 0; i < 8; i++) {
+		out[i] = state[i] ^ state[i + 8];
+		out[i + 8] = state[i + 8] ^ cv[i];
+	}
+}
+
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], \
+	uint32_t flags, uint32_t out_cv[8]) {
+
+	uint8_t block[64];
+	for (size_t i = 0; i < 8; i++) {
+		for (size_t j = 0; j < 4; j++) {
+			block[4 * i + j] = (uint8_t) (left[i] >> (8 * j));
+			block[32 + 4 * i + j] = (uint8_t) (right[i] >> (8 * j));
+		}
+	}
+
+	uint32_t out[16];
+	compress(BLAKE3_IV, block, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT | flags, out);
+	memcpy(out_cv, out, 8 * sizeof(uint32_t));
+}
+/* }}} */
+
+
+/** Creates a hasher for a new, empty input.
+ */
+Blake3Hasher::Blake3Hasher() \
+	: chunk_counter(0), block_len(0), blocks_compressed(0), cv_stack_len(0) {
+	/* {{{ */
+	memcpy(chunk_cv, BLAKE3_IV, sizeof(chunk_cv));
+	memset(block, 0, sizeof(block));
+	/* }}} */
+}
+
+
+/** Adds the chaining value of a completed chunk to the stack of subtree
+ * chaining values, merging it with its left siblings for as long as
+ * 'total_chunks' says the subtrees they root are complete.
+ *
+ * \param 'cv' the chaining value of the chunk that was just completed.
+ * \param 'total_chunks' the number of chunks completed so far.
+ */
+void Blake3Hasher::push_chunk_cv(uint32_t cv[8], uint64_t total_chunks) {
+	/* {{{ */
+	while ((total_chunks & 1) == 0) {
+		cv_stack_len--;
+		parent_cv(cv_stack[cv_stack_len], cv, 0, cv);
+		total_chunks >>= 1;
+	}
+	memcpy(cv_stack[cv_stack_len], cv, 8 * sizeof(uint32_t));
+	cv_stack_len++;
+	/* }}} */
+}
+
+
+/** Feeds 'len' more bytes of input to the hasher.
+ *
+ * \param '*data' the bytes to be hashed.
+ * \param 'len' the number of bytes to be hashed.
+ */
+void Blake3Hasher::update(const void *data, size_t len) {
+	/* {{{ */
+	const uint8_t *input = (const uint8_t *) data;
+
+	while (len > 0) {
+		/* The current chunk is full and more input is coming, so it can't be
+		 * the root: finish it and start the next one */
+		if (blocks_compressed * BLAKE3_BLOCK_LEN + block_len \
+			== BLAKE3_CHUNK_LEN) {
+
+			uint32_t out[16];
+			compress(chunk_cv, block, chunk_counter, (uint32_t) block_len, \
+				BLAKE3_CHUNK_END, out);
+			push_chunk_cv(out, chunk_counter + 1);
+
+			chunk_counter++;
+			memcpy(chunk_cv, BLAKE3_IV, sizeof(chunk_cv));
+			memset(block, 0, sizeof(block));
+			block_len = 0;
+			blocks_compressed = 0;
+		}
+
+		/* The current block is full and more input is coming, so it can't be
+		 * the last block of its chunk */
+		if (block_len == BLAKE3_BLOCK_LEN) {
+			uint32_t out[16];
+			compress(chunk_cv, block, chunk_counter, BLAKE3_BLOCK_LEN, \
+				blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0, out);
+			memcpy(chunk_cv, out, sizeof(chunk_cv));
+			blocks_compressed++;
+			memset(block, 0, sizeof(block));
+			block_len = 0;
+		}
+
+		size_t take = std::min(BLAKE3_BLOCK_LEN - block_len, len);
+		memcpy(block + block_len, input, take);
+		block_len += take;
+		input += take;
+		len -= take;
+	}
+	/* }}} */
+}
+
+
+/** Finishes hashing and writes the first 'out_len' (at most 64) bytes of the
+ * BLAKE3 output to '*out'. The hasher must not be used afterwards.
+ *
+ * \param '*out' the buffer the output will be written to.
+ * \param 'out_len' the number of bytes of output wanted.
+ */
+void Blake3Hasher::finalize(uint8_t *out, size_t out_len) {
+	/* {{{ */
+
+	/* Start from the final (possibly partial) block of the last chunk and
+	 * merge it up through every subtree waiting on the stack. Whatever
+	 * node ends up at the top is compressed once more as the root */
+	uint32_t input_cv[8];
+	uint8_t input_block[64];
+	uint32_t input_block_len = (uint32_t) block_len;
+	uint32_t flags = BLAKE3_CHUNK_END \
+		| (blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0);
+	uint64_t counter = chunk_counter;
+	memcpy(input_cv, chunk_cv, sizeof(input_cv));
+	memcpy(input_block, block, sizeof(input_block));
+
+	for (size_t i = cv_stack_len; i > 0; i--) {
+		uint32_t out_words[16];
+		compress(input_cv, input_block, counter, input_block_len, flags, \
+			out_words);
+
+		for (size_t w = 0; w < 8; w++) {
+			for (size_t j = 0; j < 4; j++) {
+				input_block[4 * w + j] = (uint8_t) (cv_stack[i - 1][w] >> (8 * j));
+				input_block[32 + 4 * w + j] = (uint8_t) (out_words[w] >> (8 * j));
+			}
+		}
+		memcpy(input_cv, BLAKE3_IV, sizeof(input_cv));
+		input_block_len = BLAKE3_BLOCK_LEN;
+		flags = BLAKE3_PARENT;
+		counter = 0;
+	}
+
+	uint32_t root[16];
+	compress(input_cv, input_block, counter, input_block_len, \
+		flags | BLAKE3_ROOT, root);
+
+	out_len = std::min(out_len, (size_t) 64);
+	for (size_t i = 0; i < out_len; i++) {
+		out[i] = (uint8_t) (root[i / 4] >> (8 * (i % 4)));
+	}
+	/* }}} */
+}
+
+
+/** Finishes hashing and stores the content hash (the first CONTENT_HASH_LEN
+ * bytes of the BLAKE3 output) in '*out'. The hasher must not be used
+ * afterwards.
+ *
+ * \param '*out' the content hash to be filled in.
+ */
+void Blake3Hasher::finalize(ContentHash *out) {
+	/* {{{ */
+	finalize(out->bytes, CONTENT_HASH_LEN);
+	/* }}} */
+}
+
+
+bool operator==(const ContentHash &a, const ContentHash &b) {
+	return 0 == memcmp(a.bytes, b.bytes, CONTENT_HASH_LEN);
+}
+
+
+bool operator!=(const ContentHash &a, const ContentHash &b) {
+	return !(a == b);
+}
@@ -0,0 +1,48 @@
+#ifndef CONTENT_HASH_HPP
+#define CONTENT_HASH_HPP
+
+/* C++ includes */
+#include <cstddef>
+#include <cstdint>
+
+
+/* The number of bytes of BLAKE3 output kept as a file's content hash */
+#define CONTENT_HASH_LEN 16
+
+
+typedef struct content_hash {
+	uint8_t bytes[CONTENT_HASH_LEN];
+}ContentHash;
+
+
+/* An incremental BLAKE3 hasher (the portable, single-threaded form of the
+ * algorithm). Feed it data with update() in pieces of any size, then call
+ * finalize() once. */
+class Blake3Hasher {
+public:
+	Blake3Hasher();
+
+	void update(const void *data, size_t len);
+	void finalize(uint8_t *out, size_t out_len);
+	void finalize(ContentHash *out);
+
+private:
+	void push_chunk_cv(uint32_t cv[8], uint64_t total_chunks);
+
+	/* The state of the chunk currently being hashed */
+	uint32_t chunk_cv[8];
+	uint64_t chunk_counter;
+	uint8_t block[64];
+	size_t block_len;
+	size_t blocks_compressed;
+	/* The chaining values of completed subtrees that are waiting for a
+	 * sibling. 54 levels are enough for 2^64 bytes of input */
+	uint32_t cv_stack[54][8];
+	size_t cv_stack_len;
+};
+
+
+bool operator==(const ContentHash &a, const ContentHash &b);
+bool operator!=(const ContentHash &a, const ContentHash &b);
+
+#endif
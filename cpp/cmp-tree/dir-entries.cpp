@@ -0,0 +1,84 @@
+/* C++ includes */
+#include <string>
+#include <vector>
+
+/* C includes */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "dir-entries.hpp"
+
+
+/* The layout of the records getdents64() fills its buffer with */
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+
+/** Appends every entry (other than the special "." and ".." entries) of the
+ * open directory '&dir_fd' to '&entries'. The directory is read with
+ * getdents64() and the file type reported by the file system is trusted, so
+ * on file systems that fill in 'd_type' (ext4, xfs, btrfs, ...) no entry
+ * needs to be stat'd. Entries whose type comes back as DT_UNKNOWN are
+ * resolved with a single fstatat() relative to '&dir_fd' that does not follow
+ * symlinks, so the type always describes the entry itself.
+ *
+ * \param 'dir_fd' a file descriptor for the directory to be read, opened with
+ *     O_DIRECTORY.
+ * \param '&entries' the list the directory entries will be appended to.
+ * \return 0 if the whole directory was read, -1 if getdents64() failed (in
+ *     which case 'errno' is set and '&entries' may hold a partial listing).
+ */
+int read_dir_entries(int dir_fd, std::vector<DirEntry> &entries) {
+	/* {{{ */
+	static thread_local std::vector<char> buf;
+	if (buf.size() < GETDENTS_BUFFER_SIZE) {
+		buf.resize(GETDENTS_BUFFER_SIZE);
+	}
+
+	while (true) {
+		long bytes_read = syscall(SYS_getdents64, dir_fd, buf.data(), buf.size());
+		if (bytes_read < 0) {
+			return -1;
+		}
+		/* End of directory */
+		if (bytes_read == 0) {
+			return 0;
+		}
+
+		for (long pos = 0; pos < bytes_read;) {
+			struct linux_dirent64 *d = \
+				(struct linux_dirent64 *) (buf.data() + pos);
+			pos += d->d_reclen;
+
+			/* Skip the special "." and ".." entries */
+			if (d->d_name[0] == '.' && (d->d_name[1] == '\0' \
+				|| (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+
+				continue;
+			}
+
+			unsigned char type = d->d_type;
+			if (type == DT_UNKNOWN) {
+				struct stat file_info;
+				if (fstatat(dir_fd, d->d_name, &file_info, \
+					AT_SYMLINK_NOFOLLOW) == 0) {
+
+					type = IFTODT(file_info.st_mode);
+				}
+			}
+
+			entries.push_back({ std::string(d->d_name), type });
+		}
+	}
+	/* }}} */
+}
@@ -0,0 +1,24 @@
+#ifndef DIR_ENTRIES_HPP
+#define DIR_ENTRIES_HPP
+
+/* C++ includes */
+#include <string>
+#include <vector>
+
+
+/* The size of the buffer each thread hands to getdents64(). Large buffers let
+ * big directories be read in very few system calls */
+#define GETDENTS_BUFFER_SIZE (128 * 1024)
+
+
+typedef struct dir_entry {
+	std::string name;
+	/* One of the DT_* constants from <dirent.h>. This is only DT_UNKNOWN if
+	 * the file system did not report a type and fstatat() failed too */
+	unsigned char type;
+}DirEntry;
+
+
+int read_dir_entries(int dir_fd, std::vector<DirEntry> &entries);
+
+#endif
@@ -0,0 +1,90 @@
+/* C++ includes */
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+
+/* C includes */
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "disk-order.hpp"
+
+namespace fs = std::filesystem;
+
+
+/** Looks up where the data of the regular file at '&path' starts on disk,
+ * by asking the file system (with the FIEMAP ioctl) for the file's first
+ * extent. Only that one extent is asked for, and the file's dirty pages are
+ * not flushed first, so the lookup never reads or writes any data.
+ *
+ * \param '&path' a file path that points to the file.
+ * \param '*pos' set to the position of the file. If the file system can't
+ *     report extents, 'physical' is 0 and the file is placed by its inode
+ *     number alone.
+ * \return 0 on success, -1 if the file couldn't be opened or isn't a regular
+ *     file.
+ */
+int disk_position(const fs::path &path, DiskPosition *pos) {
+	/* {{{ */
+	/* Opening a fifo or a device can block or have side effects (rewinding
+	 * a tape, say), so only regular files are opened. The file is checked
+	 * again once it is open, in case it was replaced in between */
+	struct stat path_info;
+	if (stat(path.c_str(), &path_info) != 0 || !S_ISREG(path_info.st_mode)) {
+		return -1;
+	}
+	int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) != 0 || !S_ISREG(file_info.st_mode) \
+		|| file_info.st_dev != path_info.st_dev \
+		|| file_info.st_ino != path_info.st_ino) {
+		close(fd);
+		return -1;
+	}
+	pos->dev = (uint64_t) file_info.st_dev;
+	pos->ino = (uint64_t) file_info.st_ino;
+	pos->physical = 0;
+
+	/* Room for the request and the one extent it asks for */
+	alignas(struct fiemap) char req[sizeof(struct fiemap) \
+		+ sizeof(struct fiemap_extent)];
+	struct fiemap *map = (struct fiemap *) req;
+	memset(req, 0, sizeof(req));
+	map->fm_start = 0;
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0) {
+		pos->physical = map->fm_extents[0].fe_physical;
+	}
+	close(fd);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Orders disk positions by device, then by physical offset, then by inode
+ * number.
+ *
+ * \param '&a' the first position.
+ * \param '&b' the second position.
+ * \return true if '&a' comes before '&b'.
+ */
+bool operator<(const DiskPosition &a, const DiskPosition &b) {
+	/* {{{ */
+	if (a.dev != b.dev) return a.dev < b.dev;
+	if (a.physical != b.physical) return a.physical < b.physical;
+	return a.ino < b.ino;
+	/* }}} */
+}
@@ -0,0 +1,29 @@
+#ifndef DISK_ORDER_HPP
+#define DISK_ORDER_HPP
+
+/* C++ includes */
+#include <cstdint>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+
+/* Where a file's data starts on disk. Sorting files by their positions and
+ * reading them in that order lets a rotational disk sweep across its
+ * platters once rather than seeking back and forth */
+typedef struct disk_position {
+	uint64_t dev;
+	/* The physical offset (in bytes) of the file's first extent, or 0 if the
+	 * file has no extents or the file system can't report them */
+	uint64_t physical;
+	/* The inode number, which stands in for the physical offset on file
+	 * systems that can't report extents, since inodes tend to be allocated
+	 * near the data they were created with */
+	uint64_t ino;
+}DiskPosition;
+
+
+int disk_position(const fs::path &path, DiskPosition *pos);
+bool operator<(const DiskPosition &a, const DiskPosition &b);
+
+#endif
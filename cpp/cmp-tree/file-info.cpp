@@ -0,0 +1,231 @@
+/* C++ includes */
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <string>
+
+/* C includes */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "file-info.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* Set once statx() turns out not to be supported (by an old kernel, or a
+ * sandbox that filters it), after which stat() is used instead */
+static std::atomic<bool> statx_unsupported(false);
+
+
+/** Takes the mode of a file (as reported by stat()) and returns the
+ * corresponding fs::file_type.
+ *
+ * \param 'mode' the 'st_mode' of the file.
+ * \return the type of the file.
+ */
+fs::file_type file_type_of(mode_t mode) {
+	/* {{{ */
+	if (S_ISREG(mode)) return fs::file_type::regular;
+	if (S_ISDIR(mode)) return fs::file_type::directory;
+	if (S_ISLNK(mode)) return fs::file_type::symlink;
+	if (S_ISBLK(mode)) return fs::file_type::block;
+	if (S_ISCHR(mode)) return fs::file_type::character;
+	if (S_ISFIFO(mode)) return fs::file_type::fifo;
+	if (S_ISSOCK(mode)) return fs::file_type::socket;
+	return fs::file_type::unknown;
+	/* }}} */
+}
+
+
+/** Takes a file type and returns the code it is stored as in the files
+ * cmp-tree writes.
+ *
+ * \param 'type' the type of the file.
+ * \return one of the FILE_TYPE_CODE_* constants.
+ */
+uint8_t file_type_to_code(fs::file_type type) {
+	/* {{{ */
+	switch (type) {
+		case fs::file_type::regular: return FILE_TYPE_CODE_REGULAR;
+		case fs::file_type::directory: return FILE_TYPE_CODE_DIRECTORY;
+		case fs::file_type::symlink: return FILE_TYPE_CODE_SYMLINK;
+		case fs::file_type::block: return FILE_TYPE_CODE_BLOCK;
+		case fs::file_type::character: return FILE_TYPE_CODE_CHARACTER;
+		case fs::file_type::fifo: return FILE_TYPE_CODE_FIFO;
+		case fs::file_type::socket: return FILE_TYPE_CODE_SOCKET;
+		case fs::file_type::not_found: return FILE_TYPE_CODE_NOT_FOUND;
+		default: return FILE_TYPE_CODE_UNKNOWN;
+	}
+	/* }}} */
+}
+
+
+/** Takes a code read from a file cmp-tree wrote and sets '*type' to the file
+ * type it stands for.
+ *
+ * \param 'code' the stored code.
+ * \param '*type' set to the type of the file.
+ * \return 0 on success, -1 if 'code' is not one of the FILE_TYPE_CODE_*
+ *     constants.
+ */
+int file_type_from_code(uint8_t code, fs::file_type *type) {
+	/* {{{ */
+	switch (code) {
+		case FILE_TYPE_CODE_REGULAR: *type = fs::file_type::regular; break;
+		case FILE_TYPE_CODE_DIRECTORY: *type = fs::file_type::directory; break;
+		case FILE_TYPE_CODE_SYMLINK: *type = fs::file_type::symlink; break;
+		case FILE_TYPE_CODE_BLOCK: *type = fs::file_type::block; break;
+		case FILE_TYPE_CODE_CHARACTER: *type = fs::file_type::character; break;
+		case FILE_TYPE_CODE_FIFO: *type = fs::file_type::fifo; break;
+		case FILE_TYPE_CODE_SOCKET: *type = fs::file_type::socket; break;
+		case FILE_TYPE_CODE_UNKNOWN: *type = fs::file_type::unknown; break;
+		case FILE_TYPE_CODE_NOT_FOUND: *type = fs::file_type::not_found; break;
+		default: return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Fills in '*info' for the file at '&path' with a single statx() call that
+ * asks only for the fields in 'mask', so that file systems which have to do
+ * extra work for some fields (such as network file systems) can skip it. A
+ * file that can't be stat'd is taken not to exist.
+ *
+ * \param '&path' a file path that points to the file.
+ * \param 'mask' the STATX_* fields wanted in addition to the type, which is
+ *     always fetched.
+ * \param 'follow_symlinks' whether a symlink at '&path' is followed, or
+ *     stat'd itself.
+ * \param '*info' the FileInfo to fill in.
+ * \return 0 if the file was stat'd, -1 otherwise.
+ */
+int stat_file_info(const fs::path &path, unsigned int mask, \
+	bool follow_symlinks, FileInfo *info) {
+	/* {{{ */
+	memset(&info->st, 0, sizeof(info->st));
+	info->exists = false;
+	info->type = fs::file_type::not_found;
+	info->stat_done = false;
+
+	if (!statx_unsupported.load(std::memory_order_relaxed)) {
+		struct statx stx;
+
+		int flags = AT_STATX_SYNC_AS_STAT \
+			| (follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+		if (statx(AT_FDCWD, path.c_str(), flags, mask | STATX_TYPE, \
+			&stx) == 0) {
+
+			info->st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+			info->st.st_ino = stx.stx_ino;
+			info->st.st_mode = stx.stx_mode;
+			info->st.st_size = stx.stx_size;
+			info->st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+			info->st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+			info->st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+			info->st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+		} else if (errno == ENOSYS || errno == EPERM) {
+			statx_unsupported.store(true, std::memory_order_relaxed);
+			return stat_file_info(path, mask, follow_symlinks, info);
+		} else {
+			return -1;
+		}
+	} else if (follow_symlinks && stat(path.c_str(), &info->st) != 0) {
+		return -1;
+	} else if (!follow_symlinks && lstat(path.c_str(), &info->st) != 0) {
+		return -1;
+	}
+
+	info->exists = true;
+	info->type = file_type_of(info->st.st_mode);
+	info->stat_done = true;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Fills in '*info' for the file at '&path', using 'hint' (what a directory
+ * walk found out about the file) to avoid a system call where it can. Files
+ * known to be absent, and files whose type alone is all there is to compare
+ * (directories, fifos, sockets and devices) are never stat'd. Regular files
+ * get their type from the hint too, but are left for the caller to stat if
+ * their size is needed. Symlinks that aren't followed are known from the
+ * hint too. Symlinks that are followed, and files the hint says nothing
+ * about, are stat'd straight away.
+ *
+ * \param '&path' a file path that points to the file.
+ * \param 'hint' one of the DT_* constants, FILE_HINT_UNKNOWN or
+ *     FILE_HINT_ABSENT.
+ * \param 'mask' the STATX_* fields wanted if the file has to be stat'd.
+ * \param 'follow_symlinks' whether symlinks are followed.
+ * \param '*info' the FileInfo to fill in.
+ */
+void get_file_info(const fs::path &path, unsigned char hint, \
+	unsigned int mask, bool follow_symlinks, FileInfo *info) {
+	/* {{{ */
+	info->exists = true;
+	info->stat_done = false;
+
+	switch (hint) {
+		case FILE_HINT_ABSENT:
+			info->exists = false;
+			info->type = fs::file_type::not_found;
+			break;
+		case DT_REG: info->type = fs::file_type::regular; break;
+		case DT_DIR: info->type = fs::file_type::directory; break;
+		case DT_FIFO: info->type = fs::file_type::fifo; break;
+		case DT_SOCK: info->type = fs::file_type::socket; break;
+		case DT_CHR: info->type = fs::file_type::character; break;
+		case DT_BLK: info->type = fs::file_type::block; break;
+		case DT_LNK:
+			if (!follow_symlinks) {
+				info->type = fs::file_type::symlink;
+				break;
+			}
+			[[fallthrough]];
+		default:
+			stat_file_info(path, mask, follow_symlinks, info);
+			break;
+	}
+	/* }}} */
+}
+
+
+/** Reads the target of the symlink at '*path' (relative to the directory
+ * 'dir_fd', as with readlinkat()) into '&target'.
+ *
+ * \param 'dir_fd' a file descriptor for the directory '*path' is relative
+ *     to, or AT_FDCWD.
+ * \param '*path' the path of the symlink.
+ * \param '&target' set to the target of the symlink.
+ * \return 0 on success, -1 if the symlink could not be read.
+ */
+int read_link_target(int dir_fd, const char *path, std::string &target) {
+	/* {{{ */
+	target.resize(256);
+
+	while (true) {
+		ssize_t len = readlinkat(dir_fd, path, target.data(), target.size());
+		if (len < 0) {
+			return -1;
+		}
+		/* The target may have been cut short, so try again with more room */
+		if ((size_t) len == target.size()) {
+			target.resize(target.size() * 2);
+			continue;
+		}
+
+		target.resize(len);
+		return 0;
+	}
+	/* }}} */
+}
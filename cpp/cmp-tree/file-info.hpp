@@ -0,0 +1,61 @@
+#ifndef FILE_INFO_HPP
+#define FILE_INFO_HPP
+
+/* C++ includes */
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+/* C includes */
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+
+/* Hints about a file that a directory walk can pass on so that the file
+ * doesn't have to be stat'd. Besides these, any of the DT_* constants from
+ * <dirent.h> can be given as a hint */
+/* Nothing is known about the file */
+#define FILE_HINT_UNKNOWN DT_UNKNOWN
+/* The walk found that the file does not exist */
+#define FILE_HINT_ABSENT 0xff
+
+/* The codes file types are stored as in the files cmp-tree writes (manifests
+ * and Merkle indexes), which must not depend on the values the standard
+ * library gives fs::file_type */
+#define FILE_TYPE_CODE_REGULAR 1
+#define FILE_TYPE_CODE_DIRECTORY 2
+#define FILE_TYPE_CODE_SYMLINK 3
+#define FILE_TYPE_CODE_BLOCK 4
+#define FILE_TYPE_CODE_CHARACTER 5
+#define FILE_TYPE_CODE_FIFO 6
+#define FILE_TYPE_CODE_SOCKET 7
+#define FILE_TYPE_CODE_UNKNOWN 8
+#define FILE_TYPE_CODE_NOT_FOUND 0xff
+
+
+/* What is known about a file (in the broad sense). If symlinks are followed,
+ * 'type' is the type of the file a symlink points to, and a broken symlink
+ * does not exist. Otherwise a symlink is a file of its own, of type
+ * fs::file_type::symlink */
+typedef struct file_info {
+	bool exists;
+	fs::file_type type;
+	/* Whether 'st' has been filled in. The fields of 'st' that were not
+	 * asked for (see stat_file_info()) may be zero */
+	bool stat_done;
+	struct stat st;
+}FileInfo;
+
+
+fs::file_type file_type_of(mode_t mode);
+uint8_t file_type_to_code(fs::file_type type);
+int file_type_from_code(uint8_t code, fs::file_type *type);
+int stat_file_info(const fs::path &path, unsigned int mask, \
+	bool follow_symlinks, FileInfo *info);
+void get_file_info(const fs::path &path, unsigned char hint, \
+	unsigned int mask, bool follow_symlinks, FileInfo *info);
+int read_link_target(int dir_fd, const char *path, std::string &target);
+
+#endif
@@ -0,0 +1,502 @@
+/* C++ includes */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* C includes */
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "content-hash.hpp"
+#include "hash-cache.hpp"
+
+
+/* Identifies a cache file (and the version of its layout) */
+static const char HASH_CACHE_MAGIC[8] = { 'C', 'M', 'P', 'T', 'H', 'C', '0', '1' };
+
+
+/* The first 64 bytes of a cache file. 'num_records' records follow it, the
+ * first 'num_sorted' of which are ordered by key */
+typedef struct hash_cache_header {
+	char magic[8];
+	uint64_t num_sorted;
+	uint64_t num_records;
+	uint8_t reserved[40];
+}HashCacheHeader;
+
+static_assert(sizeof(HashCacheHeader) == 64, "cache header must be 64 bytes");
+static_assert(sizeof(HashCacheRecord) == 64, "cache record must be 64 bytes");
+
+
+/** Orders cache keys by (dev, ino, size, mtime_ns, ctime_ns).
+ *
+ * \param '&a' the first key.
+ * \param '&b' the second key.
+ * \return true if '&a' sorts before '&b', false otherwise.
+ */
+static bool key_less(const HashCacheKey &a, const HashCacheKey &b) {
+	/* {{{ */
+	if (a.dev != b.dev) return a.dev < b.dev;
+	if (a.ino != b.ino) return a.ino < b.ino;
+	if (a.size != b.size) return a.size < b.size;
+	if (a.mtime_ns != b.mtime_ns) return a.mtime_ns < b.mtime_ns;
+	return a.ctime_ns < b.ctime_ns;
+	/* }}} */
+}
+
+
+/** Returns true if two cache keys are identical.
+ *
+ * \param '&a' the first key.
+ * \param '&b' the second key.
+ * \return true if the keys are equal, false otherwise.
+ */
+static bool key_equal(const HashCacheKey &a, const HashCacheKey &b) {
+	/* {{{ */
+	return a.dev == b.dev && a.ino == b.ino && a.size == b.size \
+		&& a.mtime_ns == b.mtime_ns && a.ctime_ns == b.ctime_ns;
+	/* }}} */
+}
+
+
+/** Orders cache records by the inode they are for, (dev, ino).
+ *
+ * \param '&a' the first record.
+ * \param '&b' the second record.
+ * \return true if '&a' is for an inode that sorts before that of '&b', false
+ *     otherwise.
+ */
+static bool inode_less(const HashCacheRecord &a, const HashCacheRecord &b) {
+	/* {{{ */
+	if (a.key.dev != b.key.dev) return a.key.dev < b.key.dev;
+	return a.key.ino < b.key.ino;
+	/* }}} */
+}
+
+
+/** Writes all 'len' bytes of 'buf' to 'fd' at 'offset', retrying short
+ * writes.
+ *
+ * \param 'fd' the file descriptor to write to.
+ * \param '*buf' the bytes to write.
+ * \param 'len' the number of bytes to write.
+ * \param 'offset' the offset in the file to write them at.
+ * \return 0 on success, -1 on failure.
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	/* {{{ */
+	const char *p = (const char *) buf;
+
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= (size_t) n;
+		offset += n;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Reads all 'len' bytes at 'offset' in 'fd' into 'buf', retrying short
+ * reads.
+ *
+ * \param 'fd' the file descriptor to read from.
+ * \param '*buf' the buffer to read into.
+ * \param 'len' the number of bytes to read.
+ * \param 'offset' the offset in the file to read from.
+ * \return 0 on success, -1 on failure (including reaching the end of the
+ *     file early).
+ */
+static int pread_all(int fd, void *buf, size_t len, off_t offset) {
+	/* {{{ */
+	char *p = (char *) buf;
+
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) {
+			return -1;
+		}
+		p += n;
+		len -= (size_t) n;
+		offset += n;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes the stat() data of a file and returns the key its content hash is
+ * cached under.
+ *
+ * \param '&file_info' the stat() data of the file.
+ * \return the cache key for the file's current content.
+ */
+HashCacheKey hash_cache_key(struct stat &file_info) {
+	/* {{{ */
+	HashCacheKey key;
+
+	key.dev = (uint64_t) file_info.st_dev;
+	key.ino = (uint64_t) file_info.st_ino;
+	key.size = (uint64_t) file_info.st_size;
+	key.mtime_ns = (int64_t) file_info.st_mtim.tv_sec * 1000000000 \
+		+ file_info.st_mtim.tv_nsec;
+	key.ctime_ns = (int64_t) file_info.st_ctim.tv_sec * 1000000000 \
+		+ file_info.st_ctim.tv_nsec;
+
+	return key;
+	/* }}} */
+}
+
+
+/** Creates an empty cache that isn't backed by any file.
+ */
+HashCache::HashCache() \
+	: map(NULL), map_len(0), sorted(NULL), num_sorted(0), tail(NULL), \
+	num_tail(0) {
+	/* {{{ */
+	/* }}} */
+}
+
+
+/** Unmaps the cache file. Entries that were never save()d are lost.
+ */
+HashCache::~HashCache() {
+	/* {{{ */
+	unmap();
+	/* }}} */
+}
+
+
+/** Unmaps the cache file (if it is mapped) and forgets its entries.
+ */
+void HashCache::unmap() {
+	/* {{{ */
+	if (map != NULL) {
+		munmap(map, map_len);
+	}
+	map = NULL;
+	map_len = 0;
+	sorted = NULL;
+	num_sorted = 0;
+	tail = NULL;
+	num_tail = 0;
+	tail_order.clear();
+	/* }}} */
+}
+
+
+/** Loads the cache stored at 'path' by memory mapping it read-only. A path
+ * that doesn't exist yet is treated as an empty cache, and will be created
+ * by save().
+ *
+ * \param '*path' the path of the cache file.
+ * \return 0 on success, -1 if the file exists but can't be read or is not a
+ *     cache file.
+ */
+int HashCache::open(const char *path) {
+	/* {{{ */
+	unmap();
+	this->path = path;
+
+	int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) != 0) {
+		close(fd);
+		return -1;
+	}
+	/* An empty file is an empty cache (e.g. one created with touch) */
+	if (file_info.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	if ((size_t) file_info.st_size < sizeof(HashCacheHeader)) {
+		close(fd);
+		return -1;
+	}
+
+	map_len = (size_t) file_info.st_size;
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		map_len = 0;
+		return -1;
+	}
+
+	const HashCacheHeader *header = (const HashCacheHeader *) map;
+	size_t max_records = (map_len - sizeof(HashCacheHeader)) \
+		/ sizeof(HashCacheRecord);
+	if (0 != memcmp(header->magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC)) \
+		|| header->num_sorted > header->num_records \
+		|| header->num_records > max_records) {
+
+		unmap();
+		return -1;
+	}
+
+	sorted = (const HashCacheRecord *) ((const char *) map \
+		+ sizeof(HashCacheHeader));
+	num_sorted = header->num_sorted;
+	tail = sorted + num_sorted;
+	num_tail = header->num_records - header->num_sorted;
+
+	/* The tail is in the order its records were appended, so give it a
+	 * sorted index so that it can be searched like the sorted region */
+	tail_order.resize(num_tail);
+	for (size_t i = 0; i < num_tail; i++) {
+		tail_order[i] = (uint32_t) i;
+	}
+	std::sort(tail_order.begin(), tail_order.end(), \
+		[this](uint32_t a, uint32_t b) {
+			return key_less(tail[a].key, tail[b].key);
+		});
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Looks up the content hash cached for 'key'. Safe to call from any
+ * number of threads at once.
+ *
+ * \param '&key' the key of the file whose hash we want.
+ * \param '*hash' set to the cached hash, if there is one.
+ * \return true if the hash was found, false otherwise.
+ */
+bool HashCache::lookup(const HashCacheKey &key, ContentHash *hash) const {
+	/* {{{ */
+	const HashCacheRecord *end = sorted + num_sorted;
+	const HashCacheRecord *r = std::lower_bound(sorted, end, key, \
+		[](const HashCacheRecord &rec, const HashCacheKey &k) {
+			return key_less(rec.key, k);
+		});
+	if (r != end && key_equal(r->key, key)) {
+		*hash = r->hash;
+		return true;
+	}
+
+	auto t = std::lower_bound(tail_order.begin(), tail_order.end(), key, \
+		[this](uint32_t i, const HashCacheKey &k) {
+			return key_less(tail[i].key, k);
+		});
+	if (t != tail_order.end() && key_equal(tail[*t].key, key)) {
+		*hash = tail[*t].hash;
+		return true;
+	}
+
+	return false;
+	/* }}} */
+}
+
+
+/** Records the content hash of the file identified by 'key'. The entry is
+ * only written to the cache file by save(). Safe to call from any number of
+ * threads at once.
+ *
+ * \param '&key' the key of the file that was hashed.
+ * \param '&hash' the hash of the file's content.
+ */
+void HashCache::insert(const HashCacheKey &key, const ContentHash &hash) {
+	/* {{{ */
+	HashCacheRecord rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.key = key;
+	rec.hash = hash;
+
+	std::lock_guard<std::mutex> guard(pending_lock);
+	pending.push_back(rec);
+	/* }}} */
+}
+
+
+/** Writes the entries insert()ed since the cache was opened to the cache
+ * file. The file is locked while it is updated so that concurrent runs
+ * sharing a cache don't lose each other's entries. While the unsorted tail
+ * stays small, the new entries are simply appended to it. Once it grows too
+ * large, the tail and the new entries are sorted and merged into the sorted
+ * records in one linear pass (keeping only the newest entry for each inode),
+ * and the result is written to a new file which replaces the old one
+ * atomically. Either way, bytes that a concurrent
+ * reader may have mapped are never changed, apart from the header.
+ *
+ * \return 0 on success, -1 on failure.
+ */
+int HashCache::save() {
+	/* {{{ */
+	std::lock_guard<std::mutex> guard(pending_lock);
+
+	if (pending.empty() || path.empty()) {
+		return 0;
+	}
+
+	/* Lock the cache file. If another run compacted it (replacing it with a
+	 * new file) while we waited for the lock, we locked the old file and must
+	 * try again with the new one */
+	int fd;
+	while (true) {
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			return -1;
+		}
+		if (flock(fd, LOCK_EX) != 0) {
+			close(fd);
+			return -1;
+		}
+
+		struct stat locked_info;
+		struct stat path_info;
+		if (fstat(fd, &locked_info) == 0 && stat(path.c_str(), &path_info) == 0 \
+			&& locked_info.st_dev == path_info.st_dev \
+			&& locked_info.st_ino == path_info.st_ino) {
+			break;
+		}
+		close(fd);
+	}
+
+	/* Re-read the header, since other runs may have changed the file since
+	 * we mapped it */
+	HashCacheHeader header;
+	struct stat file_info;
+	if (fstat(fd, &file_info) != 0) {
+		close(fd);
+		return -1;
+	}
+	if (file_info.st_size == 0) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC));
+	} else if (pread_all(fd, &header, sizeof(header), 0) != 0 \
+		|| 0 != memcmp(header.magic, HASH_CACHE_MAGIC, sizeof(HASH_CACHE_MAGIC)) \
+		|| header.num_sorted > header.num_records) {
+
+		close(fd);
+		return -1;
+	}
+
+	size_t disk_tail = header.num_records - header.num_sorted;
+	size_t max_tail = std::max((size_t) HASH_CACHE_MIN_TAIL, \
+		(size_t) header.num_sorted / HASH_CACHE_TAIL_DIVISOR);
+
+	if (disk_tail + pending.size() <= max_tail) {
+		/* Append the new records, make sure they're on disk, and only then
+		 * publish them by updating the header */
+		off_t end = sizeof(HashCacheHeader) \
+			+ header.num_records * sizeof(HashCacheRecord);
+		int ret = -1;
+		if (pwrite_all(fd, pending.data(), \
+			pending.size() * sizeof(HashCacheRecord), end) == 0 \
+			&& fdatasync(fd) == 0) {
+
+			header.num_records += pending.size();
+			ret = pwrite_all(fd, &header, sizeof(header), 0);
+		}
+		close(fd);
+		if (ret == 0) {
+			pending.clear();
+		}
+		return ret;
+	}
+
+	/* Compact: sort only the tail and the new records, keep the newest one
+	 * for each inode, and merge them into the sorted records in a single
+	 * pass. The sorted records hold one record per inode, so ordering them by
+	 * key also orders them by inode */
+	std::vector<HashCacheRecord> run(header.num_sorted);
+	std::vector<HashCacheRecord> newer(disk_tail);
+	if (pread_all(fd, run.data(), run.size() * sizeof(HashCacheRecord), \
+		sizeof(HashCacheHeader)) != 0 \
+		|| pread_all(fd, newer.data(), newer.size() * sizeof(HashCacheRecord), \
+		sizeof(HashCacheHeader) + run.size() * sizeof(HashCacheRecord)) != 0) {
+
+		close(fd);
+		return -1;
+	}
+	newer.insert(newer.end(), pending.begin(), pending.end());
+	std::stable_sort(newer.begin(), newer.end(), inode_less);
+	size_t num_newer = 0;
+	for (size_t i = 0; i < newer.size(); i++) {
+		/* Records for the same inode are in the order they were written, so
+		 * the last of them is the newest */
+		if (i + 1 < newer.size() && !inode_less(newer[i], newer[i + 1])) {
+			continue;
+		}
+		newer[num_newer++] = newer[i];
+	}
+	newer.resize(num_newer);
+
+	std::vector<HashCacheRecord> all;
+	all.reserve(run.size() + newer.size());
+	size_t r = 0;
+	size_t n = 0;
+	while (r < run.size() && n < newer.size()) {
+		if (inode_less(run[r], newer[n])) {
+			all.push_back(run[r++]);
+		} else if (inode_less(newer[n], run[r])) {
+			all.push_back(newer[n++]);
+		} else {
+			/* The tail and the new records are newer than the sorted
+			 * records */
+			all.push_back(newer[n++]);
+			r++;
+		}
+	}
+	all.insert(all.end(), run.begin() + r, run.end());
+	all.insert(all.end(), newer.begin() + n, newer.end());
+
+	header.num_sorted = all.size();
+	header.num_records = all.size();
+
+	std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+	int tmp_fd = ::open(tmp_path.c_str(), \
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (tmp_fd == -1) {
+		close(fd);
+		return -1;
+	}
+
+	int ret = -1;
+	if (pwrite_all(tmp_fd, &header, sizeof(header), 0) == 0 \
+		&& pwrite_all(tmp_fd, all.data(), all.size() * sizeof(HashCacheRecord), \
+			sizeof(HashCacheHeader)) == 0 \
+		&& fsync(tmp_fd) == 0 \
+		&& rename(tmp_path.c_str(), path.c_str()) == 0) {
+
+		ret = 0;
+	}
+	close(tmp_fd);
+	if (ret != 0) {
+		unlink(tmp_path.c_str());
+	}
+	/* Closing the old file releases the lock, waking any run waiting for it,
+	 * which will then notice the rename and lock the new file instead */
+	close(fd);
+
+	if (ret == 0) {
+		pending.clear();
+	}
+	return ret;
+	/* }}} */
+}
@@ -0,0 +1,83 @@
+#ifndef HASH_CACHE_HPP
+#define HASH_CACHE_HPP
+
+/* C++ includes */
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* C includes */
+#include <sys/stat.h>
+
+/* Local includes */
+#include "content-hash.hpp"
+
+
+/* New records are appended to the unsorted tail of the cache file until the
+ * tail would hold more than this many records or 1/HASH_CACHE_TAIL_DIVISOR
+ * of the sorted records (whichever is larger), at which point the file is
+ * compacted: only the tail is sorted, then it is merged into the sorted
+ * records, so compaction is linear in the size of the cache */
+#define HASH_CACHE_MIN_TAIL 4096
+#define HASH_CACHE_TAIL_DIVISOR 8
+
+
+/* The stat() data that identifies one version of a file's content. If any
+ * of these change, the cached hash no longer applies */
+typedef struct hash_cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+}HashCacheKey;
+
+/* The on-disk (and in-memory) form of a cache entry. 64 bytes, so a record
+ * never straddles a cache line */
+typedef struct hash_cache_record {
+	HashCacheKey key;
+	ContentHash hash;
+	uint64_t reserved;
+}HashCacheRecord;
+
+
+/* A persistent map from HashCacheKeys to content hashes, stored in a single
+ * file. The file holds a header, a run of records sorted by key and an
+ * unsorted tail of records appended by later runs. The file is memory mapped
+ * read-only, so any number of threads (and processes) can look entries up
+ * at once. New entries are gathered in memory and only written by save(),
+ * which never modifies the part of the file other readers may have mapped:
+ * it either appends to the tail or writes a compacted copy of the file and
+ * renames it into place. */
+class HashCache {
+public:
+	HashCache();
+	~HashCache();
+
+	int open(const char *path);
+	bool lookup(const HashCacheKey &key, ContentHash *hash) const;
+	void insert(const HashCacheKey &key, const ContentHash &hash);
+	int save();
+
+private:
+	void unmap();
+
+	std::string path;
+	void *map;
+	size_t map_len;
+	const HashCacheRecord *sorted;
+	size_t num_sorted;
+	const HashCacheRecord *tail;
+	size_t num_tail;
+	/* Indices into 'tail', ordered by key */
+	std::vector<uint32_t> tail_order;
+	/* Entries added during this run, not yet saved */
+	std::mutex pending_lock;
+	std::vector<HashCacheRecord> pending;
+};
+
+
+HashCacheKey hash_cache_key(struct stat &file_info);
+
+#endif
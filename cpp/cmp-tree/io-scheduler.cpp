@@ -0,0 +1,189 @@
+/* C++ includes */
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+/* C includes */
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+/* Local includes */
+#include "io-scheduler.hpp"
+
+
+/** Looks up whether the block device 'dev' is rotational in sysfs. Whole
+ * disks have a queue of their own, while partitions share the queue of the
+ * disk they are on, which is their parent in sysfs.
+ *
+ * \param 'dev' the device number of the block device.
+ * \return true if sysfs says the device is rotational, false if it says it
+ *     isn't or doesn't know the device.
+ */
+static bool device_is_rotational(dev_t dev) {
+	/* {{{ */
+	const char *formats[] = {
+		"/sys/dev/block/%u:%u/queue/rotational",
+		"/sys/dev/block/%u:%u/../queue/rotational",
+	};
+
+	for (const char *format: formats) {
+		char path[128];
+		snprintf(path, sizeof(path), format, major(dev), minor(dev));
+
+		std::ifstream in(path);
+		int rotational;
+		if (in >> rotational) {
+			return rotational != 0;
+		}
+	}
+
+	return false;
+	/* }}} */
+}
+
+
+/** Creates a scheduler that decides the policy of each device according to
+ * 'mode'.
+ *
+ * \param 'mode' how the policies of devices are decided.
+ */
+IoScheduler::IoScheduler(enum IoPolicy mode) : mode(mode) {}
+
+
+/** Returns the queue of the device 'dev', creating it (and deciding the
+ * device's policy) if this is the first time the device has been seen. The
+ * scheduler's lock must be held.
+ *
+ * \param 'dev' the device number.
+ * \return the queue of the device.
+ */
+IoScheduler::DeviceQueue &IoScheduler::queue(dev_t dev) {
+	/* {{{ */
+	std::unique_ptr<DeviceQueue> &q = devices[dev];
+	if (q != nullptr) {
+		return *q;
+	}
+
+	q = std::make_unique<DeviceQueue>();
+	q->active = 0;
+	switch (mode) {
+		case IO_POLICY_ROTATIONAL: q->policy.rotational = true; break;
+		case IO_POLICY_SOLID: q->policy.rotational = false; break;
+		case IO_POLICY_AUTO:
+		default:
+			q->policy.rotational = device_is_rotational(dev);
+			break;
+	}
+
+	/* Solid state devices do best with many reads queued, so they are left
+	 * alone */
+	if (q->policy.rotational) {
+		q->policy.queue_depth = IO_ROTATIONAL_QUEUE_DEPTH;
+		q->policy.read_size = IO_ROTATIONAL_READ_SIZE;
+	} else {
+		q->policy.queue_depth = 0;
+		q->policy.read_size = 0;
+	}
+
+	return *q;
+	/* }}} */
+}
+
+
+/** Returns whether another comparison may start reading from a device.
+ *
+ * \param '&q' the queue of the device.
+ * \return true if the device has a free slot, false otherwise.
+ */
+bool IoScheduler::has_free_slot(DeviceQueue &q) {
+	/* {{{ */
+	return q.policy.queue_depth == 0 || q.active < q.policy.queue_depth;
+	/* }}} */
+}
+
+
+/** Returns the policy of the device 'dev'.
+ *
+ * \param 'dev' the device number.
+ * \return the policy the device's reads are scheduled with.
+ */
+DevicePolicy IoScheduler::policy(dev_t dev) {
+	/* {{{ */
+	std::lock_guard<std::mutex> guard(lock);
+	return queue(dev).policy;
+	/* }}} */
+}
+
+
+/** Waits until both devices have a free slot and takes one on each (or just
+ * one, if both files are on the same device). Both slots are taken at once,
+ * so that two comparisons each holding one of the slots the other needs
+ * can't wait on each other forever.
+ *
+ * \param 'first_dev' the device the first file is on.
+ * \param 'second_dev' the device the second file is on.
+ */
+void IoScheduler::acquire(dev_t first_dev, dev_t second_dev) {
+	/* {{{ */
+	std::unique_lock<std::mutex> guard(lock);
+	DeviceQueue &first_q = queue(first_dev);
+	DeviceQueue &second_q = queue(second_dev);
+
+	slot_freed.wait(guard, [&] {
+		return has_free_slot(first_q) && has_free_slot(second_q);
+	});
+	first_q.active++;
+	if (first_dev != second_dev) {
+		second_q.active++;
+	}
+	/* }}} */
+}
+
+
+/** Takes a slot on both devices (or just one, if both files are on the same
+ * device) if both have a free slot, without waiting for one. This is for
+ * readers that the holder of another slot waits on, which could otherwise
+ * wait on each other forever.
+ *
+ * \param 'first_dev' the device the first file is on.
+ * \param 'second_dev' the device the second file is on.
+ * \return true if the slots were taken, false otherwise.
+ */
+bool IoScheduler::try_acquire(dev_t first_dev, dev_t second_dev) {
+	/* {{{ */
+	std::lock_guard<std::mutex> guard(lock);
+	DeviceQueue &first_q = queue(first_dev);
+	DeviceQueue &second_q = queue(second_dev);
+
+	if (!has_free_slot(first_q) || !has_free_slot(second_q)) {
+		return false;
+	}
+	first_q.active++;
+	if (first_dev != second_dev) {
+		second_q.active++;
+	}
+	return true;
+	/* }}} */
+}
+
+
+/** Gives back the slots taken by acquire() or try_acquire().
+ *
+ * \param 'first_dev' the device the first file is on.
+ * \param 'second_dev' the device the second file is on.
+ */
+void IoScheduler::release(dev_t first_dev, dev_t second_dev) {
+	/* {{{ */
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue(first_dev).active--;
+		if (first_dev != second_dev) {
+			queue(second_dev).active--;
+		}
+	}
+	slot_freed.notify_all();
+	/* }}} */
+}
@@ -0,0 +1,77 @@
+#ifndef IO_SCHEDULER_HPP
+#define IO_SCHEDULER_HPP
+
+/* C++ includes */
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+
+/* C includes */
+#include <sys/types.h>
+
+
+/* The number of comparisons that may read from a rotational device at once.
+ * Any more and the disk spends its time seeking between them */
+#define IO_ROTATIONAL_QUEUE_DEPTH 1
+/* The size of each read from a rotational device, so that a seek between
+ * the two files of a pair is paid for with this many bytes of reading */
+#define IO_ROTATIONAL_READ_SIZE (8 * 1024 * 1024)
+
+
+enum IoPolicy {
+	/* Look up whether each device is rotational in sysfs. Devices sysfs
+	 * knows nothing about (tmpfs, network and FUSE file systems, btrfs,
+	 * ...) are treated as solid state. */
+	IO_POLICY_AUTO,
+	/* Treat every device as a rotational disk. */
+	IO_POLICY_ROTATIONAL,
+	/* Treat every device as solid state. */
+	IO_POLICY_SOLID,
+};
+
+
+/* How the reads of one device are scheduled */
+typedef struct device_policy {
+	bool rotational;
+	/* The most comparisons that may read from the device at once, or 0 for
+	 * no limit */
+	unsigned queue_depth;
+	/* The size of each read from the device, or 0 to leave it to whichever
+	 * backend reads the files */
+	size_t read_size;
+}DevicePolicy;
+
+
+/* Groups the reads of a comparison by the devices (st_dev) the files are on,
+ * and gives each device its own policy. A comparison takes a slot on the
+ * device of each of its files before reading them, so no device has more
+ * comparisons reading from it than its queue depth allows, whatever the
+ * number of workers. Any number of threads may share an IoScheduler. */
+class IoScheduler {
+public:
+	IoScheduler(enum IoPolicy mode);
+
+	DevicePolicy policy(dev_t dev);
+	void acquire(dev_t first_dev, dev_t second_dev);
+	bool try_acquire(dev_t first_dev, dev_t second_dev);
+	void release(dev_t first_dev, dev_t second_dev);
+
+private:
+	struct DeviceQueue {
+		DevicePolicy policy;
+		/* The number of comparisons holding a slot on the device */
+		unsigned active;
+	};
+
+	DeviceQueue &queue(dev_t dev);
+	static bool has_free_slot(DeviceQueue &q);
+
+	enum IoPolicy mode;
+	std::mutex lock;
+	std::condition_variable slot_freed;
+	std::map<dev_t, std::unique_ptr<DeviceQueue>> devices;
+};
+
+#endif
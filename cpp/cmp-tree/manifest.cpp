@@ -0,0 +1,186 @@
+/* C++ includes */
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+/* Local includes */
+#include "content-hash.hpp"
+#include "file-info.hpp"
+#include "manifest.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* Identifies a manifest file (and the version of its layout) */
+static const char MANIFEST_MAGIC[8] = { 'C', 'M', 'P', 'T', 'M', 'F', '0', '1' };
+
+/* Values for the 'flags' of a ManifestEntry */
+#define MANIFEST_ENTRY_HASHED 0x1
+
+
+/* The start of a manifest file. It is followed by the 'root_len' bytes of
+ * the path of the tree's root, then 'num_entries' ManifestEntries (sorted by
+ * path), then the 'paths_len' bytes the entries' paths are stored in */
+typedef struct manifest_header {
+	char magic[8];
+	uint64_t num_entries;
+	uint64_t paths_len;
+	uint64_t root_len;
+}ManifestHeader;
+
+/* The on-disk form of a ManifestRecord */
+typedef struct manifest_entry {
+	uint64_t size;
+	/* Where the entry's relative path is in the paths that follow the
+	 * entries */
+	uint32_t path_offset;
+	uint32_t path_len;
+	/* One of the FILE_TYPE_CODE_* constants */
+	uint8_t type;
+	uint8_t flags;
+	uint8_t reserved[6];
+	ContentHash hash;
+}ManifestEntry;
+
+static_assert(sizeof(ManifestHeader) == 32, "manifest header must be 32 bytes");
+static_assert(sizeof(ManifestEntry) == 40, "manifest entry must be 40 bytes");
+
+
+/** Writes a manifest of the directory tree rooted at '&root' to the file at
+ * 'out_path'.
+ *
+ * \param '*out_path' the path of the manifest file to create.
+ * \param '&root' the file path to the root of the tree the manifest
+ *     describes. It is stored so that output can name the original files.
+ * \param '&records' one record for each file (in the broad sense) in the
+ *     tree, sorted by path.
+ * \return 0 on success, -1 on failure.
+ */
+int write_manifest_file(const char *out_path, fs::path &root, \
+	std::vector<ManifestRecord> &records) {
+	/* {{{ */
+	std::string paths;
+	std::vector<ManifestEntry> entries(records.size());
+
+	for (size_t i = 0; i < records.size(); i++) {
+		const std::string &p = records[i].path.native();
+		ManifestEntry &e = entries[i];
+
+		memset(&e, 0, sizeof(e));
+		e.size = records[i].type == fs::file_type::regular \
+			? (uint64_t) records[i].size : 0;
+		e.path_offset = (uint32_t) paths.size();
+		e.path_len = (uint32_t) p.size();
+		e.type = file_type_to_code(records[i].type);
+		if (records[i].hashed) {
+			e.flags |= MANIFEST_ENTRY_HASHED;
+			e.hash = records[i].hash;
+		}
+		paths += p;
+		if (paths.size() > UINT32_MAX) {
+			return -1;
+		}
+	}
+
+	ManifestHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+	header.num_entries = entries.size();
+	header.paths_len = paths.size();
+	header.root_len = root.native().size();
+
+	std::ofstream out(out_path, std::ofstream::binary | std::ofstream::trunc);
+	out.write((const char *) &header, sizeof(header));
+	out.write(root.native().data(), root.native().size());
+	out.write((const char *) entries.data(), \
+		entries.size() * sizeof(ManifestEntry));
+	out.write(paths.data(), paths.size());
+	out.close();
+
+	return out.fail() ? -1 : 0;
+	/* }}} */
+}
+
+
+/** Reads the manifest file at 'in_path'.
+ *
+ * \param '*in_path' the path of the manifest file to read.
+ * \param '&root' set to the file path to the root of the tree the manifest
+ *     was written from.
+ * \param '&records' set to the records of the manifest, sorted by path.
+ * \return 0 on success, -1 if the file can't be read or is not a
+ *     manifest, or its header doesn't match its size, or an entry is
+ *     corrupt.
+ */
+int read_manifest_file(const char *in_path, fs::path &root, \
+	std::vector<ManifestRecord> &records) {
+	/* {{{ */
+	std::ifstream in(in_path, std::ifstream::binary);
+	ManifestHeader header;
+
+	in.read((char *) &header, sizeof(header));
+	if (in.fail() || 0 != memcmp(header.magic, MANIFEST_MAGIC, \
+		sizeof(MANIFEST_MAGIC))) {
+
+		return -1;
+	}
+
+	/* Check every count in the header against what is left of the file
+	 * before anything is allocated from it, so that a truncated or corrupt
+	 * manifest is rejected rather than exhausting memory */
+	std::error_code ec;
+	uint64_t remaining = fs::file_size(in_path, ec);
+	if (ec || remaining < sizeof(header)) {
+		return -1;
+	}
+	remaining -= sizeof(header);
+	if (header.root_len > remaining) {
+		return -1;
+	}
+	remaining -= header.root_len;
+	if (header.num_entries > remaining / sizeof(ManifestEntry)) {
+		return -1;
+	}
+	remaining -= header.num_entries * sizeof(ManifestEntry);
+	if (header.paths_len != remaining) {
+		return -1;
+	}
+
+	std::string root_str(header.root_len, '\0');
+	std::vector<ManifestEntry> entries(header.num_entries);
+	std::string paths(header.paths_len, '\0');
+	in.read(root_str.data(), root_str.size());
+	in.read((char *) entries.data(), entries.size() * sizeof(ManifestEntry));
+	in.read(paths.data(), paths.size());
+	if (in.fail()) {
+		return -1;
+	}
+
+	root = root_str;
+	records.clear();
+	records.resize(entries.size());
+	for (size_t i = 0; i < entries.size(); i++) {
+		ManifestEntry &e = entries[i];
+		ManifestRecord &r = records[i];
+
+		if ((uint64_t) e.path_offset + e.path_len > paths.size()) {
+			records.clear();
+			return -1;
+		}
+		if (file_type_from_code(e.type, &r.type) != 0) {
+			records.clear();
+			return -1;
+		}
+		r.path = paths.substr(e.path_offset, e.path_len);
+		r.size = (off_t) e.size;
+		r.hashed = (e.flags & MANIFEST_ENTRY_HASHED) != 0;
+		r.hash = e.hash;
+	}
+
+	return 0;
+	/* }}} */
+}
@@ -0,0 +1,39 @@
+#ifndef MANIFEST_HPP
+#define MANIFEST_HPP
+
+/* C++ includes */
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+/* C includes */
+#include <sys/types.h>
+
+/* Local includes */
+#include "content-hash.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* One file (in the broad sense) of the directory tree a manifest was written
+ * from */
+typedef struct manifest_record {
+	/* The path of the file, relative to the root of the tree */
+	fs::path path;
+	fs::file_type type;
+	/* For regular files, the size of the file in bytes, and whether 'hash'
+	 * holds the hash of its content (it doesn't if the file couldn't be
+	 * read). For symlinks that weren't followed, 'hash' is the hash of the
+	 * symlink's target instead. Unused for other types of file */
+	off_t size;
+	bool hashed;
+	ContentHash hash;
+}ManifestRecord;
+
+
+int write_manifest_file(const char *out_path, fs::path &root, \
+	std::vector<ManifestRecord> &records);
+int read_manifest_file(const char *in_path, fs::path &root, \
+	std::vector<ManifestRecord> &records);
+
+#endif
@@ -0,0 +1,626 @@
+/* C++ includes */
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+/* C includes */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "compare-backends.hpp"
+#include "content-hash.hpp"
+#include "dir-entries.hpp"
+#include "file-info.hpp"
+#include "hash-cache.hpp"
+#include "merkle-index.hpp"
+#include "thread-pool.hpp"
+#include "tree-walk.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* Identifies an index file (and the version of its layout) */
+static const char MERKLE_INDEX_MAGIC[8] = { 'C', 'M', 'P', 'T', 'M', 'I', '0', '1' };
+
+/* The number of files each hashing task handed to the thread pool hashes */
+#define HASHES_PER_TASK 16
+
+
+/** Takes the path to the root of a directory tree and works out the path of
+ * the sidecar file the tree's index is kept in, which sits next to the root
+ * in the root's parent directory. The root is made canonical first, so
+ * that roots like "." and ".." (and "tree/" and "tree") get the same index
+ * as their canonical forms, and the index never lands inside the tree.
+ *
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&index_path' set to the path of the index file.
+ * \return 0 on success, -1 if the root has no parent directory to keep the
+ *     index in (i.e. it is "/") or can't be made canonical.
+ */
+int merkle_index_path(fs::path &root, std::string &index_path) {
+	/* {{{ */
+	std::error_code ec;
+	fs::path canonical = fs::weakly_canonical(root, ec);
+	if (ec) {
+		return -1;
+	}
+
+	/* "tree/" canonicalises to "tree/", whose filename is empty */
+	if (!canonical.has_filename()) {
+		canonical = canonical.parent_path();
+	}
+	if (!canonical.has_filename() || canonical == canonical.root_path()) {
+		return -1;
+	}
+
+	index_path = (canonical.parent_path() \
+		/ (canonical.filename().native() + MERKLE_INDEX_SUFFIX)).native();
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Returns whether '&name' is the name of an index sidecar file (see
+ * merkle_index_path()). Indexes never record these, so that a sidecar left
+ * inside a tree (by an older version, or for a tree nested in this one)
+ * isn't reported as a difference.
+ *
+ * \param '&name' the name of a directory entry.
+ * \return true if the name ends with MERKLE_INDEX_SUFFIX, false otherwise.
+ */
+static bool is_index_sidecar_name(const std::string &name) {
+	/* {{{ */
+	size_t suffix_len = strlen(MERKLE_INDEX_SUFFIX);
+
+	return name.size() > suffix_len && 0 == name.compare( \
+		name.size() - suffix_len, suffix_len, MERKLE_INDEX_SUFFIX);
+	/* }}} */
+}
+
+
+/** Copies the stat() data of a file into an index entry.
+ *
+ * \param '&e' the entry to fill in.
+ * \param '&info' the stat() data of the file.
+ */
+static void set_entry_info(IndexEntry &e, struct stat &info) {
+	/* {{{ */
+	e.type = file_type_of(info.st_mode);
+	e.dev = (uint64_t) info.st_dev;
+	e.ino = (uint64_t) info.st_ino;
+	e.size = (uint64_t) info.st_size;
+	e.mtime_ns = (int64_t) info.st_mtim.tv_sec * 1000000000 \
+		+ info.st_mtim.tv_nsec;
+	e.ctime_ns = (int64_t) info.st_ctim.tv_sec * 1000000000 \
+		+ info.st_ctim.tv_nsec;
+	/* }}} */
+}
+
+
+/** Looks up the entry called '&name' in the index of a directory.
+ *
+ * \param '*dir' the index of the directory, or NULL.
+ * \param '&name' the name of the entry.
+ * \return the entry, or NULL if there is no such entry.
+ */
+static const IndexEntry *find_entry(const IndexDir *dir, \
+	const std::string &name) {
+	/* {{{ */
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	auto it = std::lower_bound(dir->entries.begin(), dir->entries.end(), \
+		name, [](const IndexEntry &e, const std::string &n) {
+			return e.name < n;
+		});
+	if (it == dir->entries.end() || it->name != name) {
+		return NULL;
+	}
+
+	return &*it;
+	/* }}} */
+}
+
+
+/** Indexes the directory '&root' / '&extension' into '*dir', reusing what
+ * it can from '*old', the directory's previous index. If the directory's
+ * times haven't changed, neither has its list of names, so the directory is
+ * not read again. Every entry is still stat'd, since changing a file doesn't
+ * change the directory it is in, but regular files whose stat() data is
+ * unchanged keep their old hash instead of being read. Files that do have
+ * to be hashed, and every subdirectory, are handed to '&pool' as tasks of
+ * their own.
+ *
+ * \param '&pool' the thread pool the tree is being indexed on.
+ * \param '&root' the file path to the root of the directory tree. It must
+ *     outlive the refresh.
+ * \param '&walk' the walk of the tree, which decides which subdirectories
+ *     are indexed. It must outlive the refresh.
+ * \param '&extension' the path of the directory, relative to '&root'.
+ * \param '*old' the previous index of the directory, or NULL if there is
+ *     none. It must outlive the refresh.
+ * \param '*dir' the index to fill in. It must outlive the refresh.
+ * \param '*cache' the hash cache to use when hashing files, or NULL.
+ */
+static void refresh_index_directory(ThreadPool &pool, fs::path &root, \
+	TreeWalk &walk, fs::path &extension, const IndexDir *old, IndexDir *dir, \
+	HashCache *cache) {
+	/* {{{ */
+	fs::path dir_path = root / extension;
+
+	dir->mtime_ns = -1;
+	dir->ctime_ns = -1;
+	dir->unreadable = false;
+
+	struct stat dir_info;
+	int dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd == -1 || fstat(dir_fd, &dir_info) != 0) {
+		if (dir_fd != -1) {
+			close(dir_fd);
+		}
+		std::cerr << "Was not able to open the directory " << dir_path \
+			<< "\n";
+		dir->unreadable = true;
+		return;
+	}
+	dir->mtime_ns = (int64_t) dir_info.st_mtim.tv_sec * 1000000000 \
+		+ dir_info.st_mtim.tv_nsec;
+	dir->ctime_ns = (int64_t) dir_info.st_ctim.tv_sec * 1000000000 \
+		+ dir_info.st_ctim.tv_nsec;
+
+	bool same_names = (old != NULL && old->mtime_ns == dir->mtime_ns \
+		&& old->ctime_ns == dir->ctime_ns);
+	std::vector<std::string> names;
+	if (same_names) {
+		for (auto &e: old->entries) {
+			names.push_back(e.name);
+		}
+	} else {
+		std::vector<DirEntry> entries;
+		/* A directory that can't be read in full is kept out of the index
+		 * (its times are not recorded, so that the partial list of names
+		 * is never reused) and of every subtree skip */
+		if (read_dir_entries(dir_fd, entries) != 0) {
+			std::cerr << "Was not able to open the directory " << dir_path \
+				<< "\n";
+			dir->mtime_ns = -1;
+			dir->ctime_ns = -1;
+			dir->unreadable = true;
+		}
+		for (auto &e: entries) {
+			if (!is_index_sidecar_name(e.name)) {
+				names.push_back(std::move(e.name));
+			}
+		}
+		std::sort(names.begin(), names.end());
+	}
+
+	/* The entries are never resized after this, so the tasks below can hold
+	 * on to them */
+	dir->entries.resize(names.size());
+	std::vector<size_t> to_hash;
+	for (size_t i = 0; i < names.size(); i++) {
+		IndexEntry &e = dir->entries[i];
+		e.name = std::move(names[i]);
+		e.hashed = false;
+		e.link_pending = false;
+		memset(&e.hash, 0, sizeof(e.hash));
+
+		const IndexEntry *old_e = same_names ? &old->entries[i] \
+			: find_entry(old, e.name);
+
+		/* Symlinks are only followed if the walk follows them, as in
+		 * compare_path() */
+		struct stat info;
+		bool found = (fstatat(dir_fd, e.name.c_str(), &info, \
+			AT_SYMLINK_NOFOLLOW) == 0);
+		unsigned char entry_type = found ? IFTODT(info.st_mode) : DT_UNKNOWN;
+		if (found && S_ISLNK(info.st_mode) && walk.follows_symlinks()) {
+			found = (fstatat(dir_fd, e.name.c_str(), &info, 0) == 0);
+		}
+		if (!found) {
+			e.type = fs::file_type::not_found;
+			e.dev = e.ino = e.size = 0;
+			e.mtime_ns = e.ctime_ns = 0;
+			continue;
+		}
+		set_entry_info(e, info);
+
+		if (e.type == fs::file_type::regular) {
+			if (old_e != NULL && old_e->type == e.type && old_e->hashed \
+				&& old_e->dev == e.dev && old_e->ino == e.ino \
+				&& old_e->size == e.size && old_e->mtime_ns == e.mtime_ns \
+				&& old_e->ctime_ns == e.ctime_ns) {
+
+				e.hash = old_e->hash;
+				e.hashed = true;
+			} else {
+				to_hash.push_back(i);
+			}
+		} else if (e.type == fs::file_type::symlink) {
+			fs::path link_path = dir_path / e.name;
+			e.hashed = (hash_link_target(link_path, &e.hash) == 0);
+		} else if (e.type == fs::file_type::directory) {
+			e.dir = std::make_unique<IndexDir>();
+			IndexDir *sub = e.dir.get();
+
+			/* A directory that isn't walked is indexed as if it were empty
+			 * (and could not be read, so that the index of it is never
+			 * reused). Symlinks the walk may follow stay that way until
+			 * index_linked_directories() claims them */
+			bool may_descend = walk.descend_into(dir_path, dir_fd, e.name, \
+				entry_type);
+			if (!may_descend || entry_type == DT_LNK) {
+				sub->mtime_ns = -1;
+				sub->ctime_ns = -1;
+				e.link_pending = may_descend;
+				continue;
+			}
+
+			const IndexDir *old_sub = (old_e != NULL && old_e->dir != nullptr) \
+				? old_e->dir.get() : NULL;
+			fs::path sub_extension = extension / e.name;
+			pool.submit([&pool, &root, &walk, sub_extension, old_sub, sub, \
+				cache]() mutable {
+				refresh_index_directory(pool, root, walk, sub_extension, \
+					old_sub, sub, cache);
+			});
+		}
+	}
+	close(dir_fd);
+
+	/* Hash the new and changed files in small batches, so that a directory
+	 * full of changed files is hashed by every worker rather than just this
+	 * one. Each file is stat'd again right before it is read so that the
+	 * recorded stat() data is never newer than the hash */
+	for (size_t start = 0; start < to_hash.size(); start += HASHES_PER_TASK) {
+		size_t end = std::min(start + HASHES_PER_TASK, to_hash.size());
+		std::vector<size_t> batch(to_hash.begin() + start, \
+			to_hash.begin() + end);
+		pool.submit([dir_path, dir, batch, cache] {
+			for (size_t i: batch) {
+				IndexEntry &e = dir->entries[i];
+				fs::path file_path = dir_path / e.name;
+				struct stat info;
+
+				if (stat(file_path.c_str(), &info) != 0 \
+					|| !S_ISREG(info.st_mode)) {
+					continue;
+				}
+				set_entry_info(e, info);
+				e.hashed = (hash_file_cached(file_path, info, cache, \
+					&e.hash) == 0);
+			}
+		});
+	}
+	/* }}} */
+}
+
+
+/** Indexes the directories behind the symlinks that refresh_index_directory()
+ * put off, once the rest of the tree has been indexed. The links are
+ * claimed (see TreeWalk::claim_link()) in sorted path order, depth first,
+ * so that of several links to the same directory it is always the first in
+ * that order that gets indexed. It must be called from a thread that isn't
+ * one of the pool's workers, once the pool is idle.
+ *
+ * \param '&pool' the thread pool the tree is being indexed on.
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '&walk' the walk of the tree.
+ * \param '&extension' the path of the directory, relative to '&root'.
+ * \param '*old' the previous index of the directory, or NULL if there is
+ *     none.
+ * \param '&dir' the index of the directory.
+ * \param '*cache' the hash cache to use when hashing files, or NULL.
+ */
+static void index_linked_directories(ThreadPool &pool, fs::path &root, \
+	TreeWalk &walk, fs::path &extension, const IndexDir *old, IndexDir &dir, \
+	HashCache *cache) {
+	/* {{{ */
+	for (auto &e: dir.entries) {
+		if (e.dir == nullptr) {
+			continue;
+		}
+
+		const IndexEntry *old_e = find_entry(old, e.name);
+		const IndexDir *old_sub = (old_e != NULL && old_e->dir != nullptr) \
+			? old_e->dir.get() : NULL;
+		fs::path sub_extension = extension / e.name;
+		if (e.link_pending) {
+			e.link_pending = false;
+			if (!walk.claim_link(root / sub_extension)) {
+				continue;
+			}
+			IndexDir *sub = e.dir.get();
+			pool.submit([&pool, &root, &walk, sub_extension, old_sub, sub, \
+				cache]() mutable {
+				refresh_index_directory(pool, root, walk, sub_extension, \
+					old_sub, sub, cache);
+			});
+			pool.wait_idle();
+		}
+		index_linked_directories(pool, root, walk, sub_extension, old_sub, \
+			*e.dir, cache);
+	}
+	/* }}} */
+}
+
+
+/** Computes the Merkle hash, completeness and file counts of a directory's
+ * index, after doing the same for every subdirectory.
+ *
+ * \param '&dir' the index of the directory.
+ */
+static void finish_index_directory(IndexDir &dir) {
+	/* {{{ */
+	Blake3Hasher hasher;
+
+	dir.complete = !dir.unreadable;
+	dir.num_files = 0;
+	dir.num_dirs = 0;
+
+	for (auto &e: dir.entries) {
+		if (e.type == fs::file_type::directory && e.dir != nullptr) {
+			finish_index_directory(*e.dir);
+			e.hash = e.dir->hash;
+			e.hashed = true;
+			dir.complete = dir.complete && e.dir->complete;
+			dir.num_dirs += 1 + e.dir->num_dirs;
+			dir.num_files += e.dir->num_files;
+		} else if (e.type == fs::file_type::regular) {
+			dir.complete = dir.complete && e.hashed;
+			dir.num_files++;
+		} else if (e.type == fs::file_type::not_found) {
+			dir.complete = false;
+		}
+
+		uint32_t name_len = (uint32_t) e.name.size();
+		uint8_t type = file_type_to_code(e.type);
+		ContentHash hash;
+		memset(&hash, 0, sizeof(hash));
+		if (e.hashed) {
+			hash = e.hash;
+		}
+		hasher.update(&name_len, sizeof(name_len));
+		hasher.update(e.name.data(), e.name.size());
+		hasher.update(&type, sizeof(type));
+		hasher.update(&hash, sizeof(hash));
+	}
+
+	hasher.finalize(&dir.hash);
+	/* }}} */
+}
+
+
+/** Indexes the directory tree rooted at '&root' on '&pool', reusing what it
+ * can from the tree's previous index, and computes the Merkle hash of every
+ * directory in it.
+ *
+ * \param '&pool' the thread pool the tree will be indexed on.
+ * \param '&root' the file path to the root of the directory tree.
+ * \param '*old_root' the previous index of the tree, or NULL if there is
+ *     none.
+ * \param '&root_dir' the index to fill in.
+ * \param '*cache' the hash cache to use when hashing files, or NULL.
+ * \param 'follow_symlinks' whether symlinks are followed (see TreeWalk).
+ */
+void refresh_merkle_index(ThreadPool &pool, fs::path &root, \
+	IndexDir *old_root, IndexDir &root_dir, HashCache *cache, \
+	bool follow_symlinks) {
+	/* {{{ */
+	IndexDir *dir = &root_dir;
+	TreeWalk walk(root, follow_symlinks);
+
+	pool.submit([&pool, &root, &walk, old_root, dir, cache] {
+		fs::path extension = "";
+		refresh_index_directory(pool, root, walk, extension, old_root, dir, \
+			cache);
+	});
+	pool.wait_idle();
+	if (follow_symlinks) {
+		fs::path extension = "";
+		index_linked_directories(pool, root, walk, extension, old_root, \
+			root_dir, cache);
+	}
+
+	finish_index_directory(root_dir);
+	/* }}} */
+}
+
+
+/** Appends the index of a directory, followed by the indexes of its
+ * subdirectories (in order), to '&out'.
+ *
+ * \param '&out' the bytes of the index file being built.
+ * \param '&dir' the index of the directory.
+ */
+static void serialise_index_directory(std::string &out, IndexDir &dir) {
+	/* {{{ */
+	uint64_t num_entries = dir.entries.size();
+
+	out.append((const char *) &dir.mtime_ns, sizeof(dir.mtime_ns));
+	out.append((const char *) &dir.ctime_ns, sizeof(dir.ctime_ns));
+	out.append((const char *) &num_entries, sizeof(num_entries));
+
+	for (auto &e: dir.entries) {
+		uint32_t name_len = (uint32_t) e.name.size();
+		uint8_t type = file_type_to_code(e.type);
+		uint8_t hashed = e.hashed ? 1 : 0;
+
+		out.append((const char *) &name_len, sizeof(name_len));
+		out.append(e.name);
+		out.append((const char *) &type, sizeof(type));
+		out.append((const char *) &hashed, sizeof(hashed));
+		out.append((const char *) &e.dev, sizeof(e.dev));
+		out.append((const char *) &e.ino, sizeof(e.ino));
+		out.append((const char *) &e.size, sizeof(e.size));
+		out.append((const char *) &e.mtime_ns, sizeof(e.mtime_ns));
+		out.append((const char *) &e.ctime_ns, sizeof(e.ctime_ns));
+		out.append((const char *) &e.hash, sizeof(e.hash));
+	}
+
+	for (auto &e: dir.entries) {
+		if (e.dir != nullptr) {
+			serialise_index_directory(out, *e.dir);
+		}
+	}
+	/* }}} */
+}
+
+
+/** Copies 'len' bytes from '*pos' to 'dest' and advances '*pos', unless
+ * that would go past 'end'.
+ *
+ * \param '**pos' the position in the bytes being parsed.
+ * \param '*end' the end of the bytes being parsed.
+ * \param '*dest' where to copy the bytes to.
+ * \param 'len' the number of bytes to copy.
+ * \return true if the bytes were copied, false if there weren't enough.
+ */
+static bool take(const char **pos, const char *end, void *dest, size_t len) {
+	/* {{{ */
+	if ((size_t) (end - *pos) < len) {
+		return false;
+	}
+	memcpy(dest, *pos, len);
+	*pos += len;
+
+	return true;
+	/* }}} */
+}
+
+
+/** Parses the index of a directory (and those of its subdirectories) that
+ * serialise_index_directory() produced.
+ *
+ * \param '**pos' the position in the bytes being parsed, which is advanced
+ *     past the directory's index.
+ * \param '*end' the end of the bytes being parsed.
+ * \param '&dir' the index to fill in.
+ * \return 0 on success, -1 if the bytes are not a valid index.
+ */
+static int parse_index_directory(const char **pos, const char *end, \
+	IndexDir &dir) {
+	/* {{{ */
+	uint64_t num_entries;
+
+	if (!take(pos, end, &dir.mtime_ns, sizeof(dir.mtime_ns)) \
+		|| !take(pos, end, &dir.ctime_ns, sizeof(dir.ctime_ns)) \
+		|| !take(pos, end, &num_entries, sizeof(num_entries)) \
+		|| num_entries > (uint64_t) (end - *pos)) {
+		return -1;
+	}
+
+	dir.entries.resize(num_entries);
+	for (auto &e: dir.entries) {
+		uint32_t name_len;
+		uint8_t type;
+		uint8_t hashed;
+
+		if (!take(pos, end, &name_len, sizeof(name_len)) \
+			|| name_len > (size_t) (end - *pos)) {
+			return -1;
+		}
+		e.name.assign(*pos, name_len);
+		*pos += name_len;
+		if (!take(pos, end, &type, sizeof(type)) \
+			|| !take(pos, end, &hashed, sizeof(hashed)) \
+			|| !take(pos, end, &e.dev, sizeof(e.dev)) \
+			|| !take(pos, end, &e.ino, sizeof(e.ino)) \
+			|| !take(pos, end, &e.size, sizeof(e.size)) \
+			|| !take(pos, end, &e.mtime_ns, sizeof(e.mtime_ns)) \
+			|| !take(pos, end, &e.ctime_ns, sizeof(e.ctime_ns)) \
+			|| !take(pos, end, &e.hash, sizeof(e.hash))) {
+			return -1;
+		}
+		if (file_type_from_code(type, &e.type) != 0) {
+			return -1;
+		}
+		e.hashed = (hashed != 0);
+		e.link_pending = false;
+	}
+
+	for (auto &e: dir.entries) {
+		if (e.type == fs::file_type::directory) {
+			e.dir = std::make_unique<IndexDir>();
+			if (parse_index_directory(pos, end, *e.dir) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Reads the index file at 'in_path'.
+ *
+ * \param '*in_path' the path of the index file.
+ * \param '&root_dir' set to the index of the root of the tree.
+ * \return 0 on success, -1 if the file can't be read or is not an index.
+ */
+int read_merkle_index(const char *in_path, IndexDir &root_dir) {
+	/* {{{ */
+	std::ifstream in(in_path, std::ifstream::binary);
+	std::string bytes((std::istreambuf_iterator<char>(in)), \
+		std::istreambuf_iterator<char>());
+
+	if (in.bad() || bytes.size() < sizeof(MERKLE_INDEX_MAGIC) \
+		|| 0 != memcmp(bytes.data(), MERKLE_INDEX_MAGIC, \
+			sizeof(MERKLE_INDEX_MAGIC))) {
+		return -1;
+	}
+
+	const char *pos = bytes.data() + sizeof(MERKLE_INDEX_MAGIC);
+	const char *end = bytes.data() + bytes.size();
+	if (parse_index_directory(&pos, end, root_dir) != 0 || pos != end) {
+		root_dir.entries.clear();
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Writes the index of a tree to 'out_path'. The index is written to a
+ * temporary file which then replaces 'out_path', so a run that is
+ * interrupted never leaves a truncated index behind.
+ *
+ * \param '*out_path' the path of the index file.
+ * \param '&root_dir' the index of the root of the tree.
+ * \return 0 on success, -1 on failure.
+ */
+int write_merkle_index(const char *out_path, IndexDir &root_dir) {
+	/* {{{ */
+	std::string bytes(MERKLE_INDEX_MAGIC, sizeof(MERKLE_INDEX_MAGIC));
+	serialise_index_directory(bytes, root_dir);
+
+	std::string tmp_path = std::string(out_path) + ".tmp." \
+		+ std::to_string(getpid());
+	std::ofstream out(tmp_path, std::ofstream::binary | std::ofstream::trunc);
+	out.write(bytes.data(), bytes.size());
+	out.close();
+
+	if (out.fail() || rename(tmp_path.c_str(), out_path) != 0) {
+		unlink(tmp_path.c_str());
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
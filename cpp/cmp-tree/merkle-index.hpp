@@ -0,0 +1,86 @@
+#ifndef MERKLE_INDEX_HPP
+#define MERKLE_INDEX_HPP
+
+/* C++ includes */
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Local includes */
+#include "content-hash.hpp"
+#include "hash-cache.hpp"
+#include "thread-pool.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* The suffix added to the name of a tree's root to get the name of the
+ * sidecar file its index is kept in, next to the root */
+#define MERKLE_INDEX_SUFFIX ".cmp-tree-index"
+
+
+typedef struct index_dir IndexDir;
+
+/* One file (in the broad sense) in an indexed directory. Like compare_path(),
+ * the index only follows symlinks if asked to, in which case 'type' is the
+ * type of the file a symlink points to, and is fs::file_type::not_found for
+ * broken symlinks */
+typedef struct index_entry {
+	std::string name;
+	fs::file_type type;
+	/* The stat() data the entry was indexed with */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	/* For regular files, whether 'hash' holds the hash of the file's content
+	 * (it doesn't if the file couldn't be read). For symlinks, whether 'hash'
+	 * holds the hash of the symlink's target. For directories, whether
+	 * 'hash' holds the Merkle hash of the directory (see IndexDir) */
+	bool hashed;
+	ContentHash hash;
+	/* For directories, the index of the directory's own entries */
+	std::unique_ptr<IndexDir> dir;
+	/* For symlinks to directories, whether the walk has yet to decide
+	 * whether to index the directory (see index_linked_directories()). It
+	 * is not saved */
+	bool link_pending;
+}IndexEntry;
+
+/* The index of one directory. Its Merkle hash covers the name, type and hash
+ * of every entry, so two directories with the same hash have identical
+ * subtrees */
+struct index_dir {
+	/* The times of the directory itself. While these are unchanged, so is
+	 * the list of names in the directory */
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	/* Sorted by name */
+	std::vector<IndexEntry> entries;
+	ContentHash hash;
+	/* Whether the directory could not be read, in which case it has no
+	 * entries. It is not saved */
+	bool unreadable;
+	/* Whether every directory in the subtree was read and every file in it
+	 * was hashed and exists. Only complete subtrees can be skipped, since
+	 * comparing anything else produces mismatches that have to be
+	 * reported */
+	bool complete;
+	/* The number of regular files and directories in the subtree, not
+	 * counting the directory itself */
+	uint64_t num_files;
+	uint64_t num_dirs;
+};
+
+
+int merkle_index_path(fs::path &root, std::string &index_path);
+int read_merkle_index(const char *in_path, IndexDir &root_dir);
+int write_merkle_index(const char *out_path, IndexDir &root_dir);
+void refresh_merkle_index(ThreadPool &pool, fs::path &root, \
+	IndexDir *old_root, IndexDir &root_dir, HashCache *cache, \
+	bool follow_symlinks);
+
+#endif
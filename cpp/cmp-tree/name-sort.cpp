@@ -0,0 +1,134 @@
+/* C++ includes */
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/* Local includes */
+#include "dir-entries.hpp"
+#include "name-sort.hpp"
+
+
+/** Returns the bucket the name of an entry falls into at byte 'depth': 0 if
+ * the name is only 'depth' bytes long (so that a name sorts before every
+ * longer name it is a prefix of), and otherwise 1 more than the byte.
+ *
+ * \param '&e' the entry.
+ * \param 'depth' the index of the byte that decides the bucket.
+ * \return a bucket number in the range [0, NAME_SORT_NUM_BUCKETS).
+ */
+static inline size_t bucket_of(const DirEntry &e, size_t depth) {
+	/* {{{ */
+	if (depth >= e.name.size()) {
+		return 0;
+	}
+	return (size_t) (unsigned char) e.name[depth] + 1;
+	/* }}} */
+}
+
+
+/** Sorts a short range of entry indices by name, using insertion sort. The
+ * names are known to share their first 'depth' bytes, so only the bytes
+ * after those are compared.
+ *
+ * \param '&entries' the entries the indices refer to.
+ * \param '*order' the indices to sort.
+ * \param 'n' the number of indices.
+ * \param 'depth' the length of the prefix every name in the range shares.
+ */
+static void insertion_sort_entries(const std::vector<DirEntry> &entries, \
+	size_t *order, size_t n, size_t depth) {
+	/* {{{ */
+	for (size_t i = 1; i < n; i++) {
+		size_t cur = order[i];
+		const std::string &cur_name = entries[cur].name;
+		size_t j = i;
+
+		while (j > 0) {
+			const std::string &prev_name = entries[order[j - 1]].name;
+			if (prev_name.compare(depth, std::string::npos, cur_name, depth, \
+				std::string::npos) <= 0) {
+				break;
+			}
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = cur;
+	}
+	/* }}} */
+}
+
+
+/** Splits a range of entry indices into buckets by the byte of each name at
+ * 'depth', keeping the order of the indices within each bucket. This is one
+ * pass of an MSD radix sort.
+ *
+ * \param '&entries' the entries the indices refer to.
+ * \param '*order' the indices to split up.
+ * \param 'n' the number of indices.
+ * \param 'depth' the index of the byte to split on.
+ * \param '*scratch' space for 'n' indices.
+ * \param 'bucket_starts' set so that bucket 'b' is the range
+ *     [bucket_starts[b], bucket_starts[b + 1]) of '*order'.
+ */
+void radix_partition_entries(const std::vector<DirEntry> &entries, \
+	size_t *order, size_t n, size_t depth, size_t *scratch, \
+	size_t bucket_starts[NAME_SORT_NUM_BUCKETS + 1]) {
+	/* {{{ */
+	size_t counts[NAME_SORT_NUM_BUCKETS];
+	memset(counts, 0, sizeof(counts));
+
+	for (size_t i = 0; i < n; i++) {
+		counts[bucket_of(entries[order[i]], depth)]++;
+	}
+
+	size_t pos[NAME_SORT_NUM_BUCKETS];
+	size_t sum = 0;
+	for (size_t b = 0; b < NAME_SORT_NUM_BUCKETS; b++) {
+		bucket_starts[b] = sum;
+		pos[b] = sum;
+		sum += counts[b];
+	}
+	bucket_starts[NAME_SORT_NUM_BUCKETS] = sum;
+
+	for (size_t i = 0; i < n; i++) {
+		scratch[pos[bucket_of(entries[order[i]], depth)]++] = order[i];
+	}
+	memcpy(order, scratch, n * sizeof(size_t));
+	/* }}} */
+}
+
+
+/** Sorts a range of entry indices by the names of the entries they refer
+ * to, comparing raw bytes, with an MSD radix sort. The names are known to
+ * share their first 'depth' bytes. The result is the same order that
+ * comparing the names as std::strings gives.
+ *
+ * \param '&entries' the entries the indices refer to.
+ * \param '*order' the indices to sort.
+ * \param 'n' the number of indices.
+ * \param 'depth' the length of the prefix every name in the range shares.
+ * \param '*scratch' space for 'n' indices.
+ */
+void radix_sort_entries(const std::vector<DirEntry> &entries, size_t *order, \
+	size_t n, size_t depth, size_t *scratch) {
+	/* {{{ */
+	if (n <= NAME_SORT_INSERTION_THRESHOLD) {
+		insertion_sort_entries(entries, order, n, depth);
+		return;
+	}
+
+	size_t bucket_starts[NAME_SORT_NUM_BUCKETS + 1];
+	radix_partition_entries(entries, order, n, depth, scratch, bucket_starts);
+
+	/* Names in bucket 0 end at 'depth' and so are all equal. Every other
+	 * bucket is sorted on the next byte */
+	for (size_t b = 1; b < NAME_SORT_NUM_BUCKETS; b++) {
+		size_t start = bucket_starts[b];
+		size_t len = bucket_starts[b + 1] - start;
+		if (len > 1) {
+			radix_sort_entries(entries, order + start, len, depth + 1, \
+				scratch + start);
+		}
+	}
+	/* }}} */
+}
@@ -0,0 +1,29 @@
+#ifndef NAME_SORT_HPP
+#define NAME_SORT_HPP
+
+/* C++ includes */
+#include <cstddef>
+#include <vector>
+
+/* Local includes */
+#include "dir-entries.hpp"
+
+
+/* Ranges of at most this many entries are insertion sorted instead of being
+ * split up any further */
+#define NAME_SORT_INSERTION_THRESHOLD 32
+/* Directories with at least this many entries have their buckets sorted by
+ * separate tasks */
+#define NAME_SORT_PARALLEL_THRESHOLD (64 * 1024)
+/* One bucket for names that end at the current byte, plus one for each
+ * possible value of the byte */
+#define NAME_SORT_NUM_BUCKETS 257
+
+
+void radix_partition_entries(const std::vector<DirEntry> &entries, \
+	size_t *order, size_t n, size_t depth, size_t *scratch, \
+	size_t bucket_starts[NAME_SORT_NUM_BUCKETS + 1]);
+void radix_sort_entries(const std::vector<DirEntry> &entries, size_t *order, \
+	size_t n, size_t depth, size_t *scratch);
+
+#endif
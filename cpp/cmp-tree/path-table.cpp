@@ -0,0 +1,135 @@
+/* C++ includes */
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* C includes */
+#include <dirent.h>
+
+/* Local includes */
+#include "path-table.hpp"
+
+namespace fs = std::filesystem;
+
+
+/** Creates a table that holds only the empty relative path, which has the
+ * id PATH_ID_ROOT.
+ */
+PathTable::PathTable() \
+	: chunks(std::make_unique<std::unique_ptr<PathNode[]>[]>( \
+		PATH_NUM_CHUNKS)), num_nodes(0), block_used(0) {
+	/* {{{ */
+	add(PATH_ID_ROOT, "", 0, DT_DIR, DT_DIR);
+	/* }}} */
+}
+
+
+/** Adds the path '&parent' / 'name' to the table. Paths are not
+ * deduplicated, so the caller must not add the same path twice.
+ *
+ * \param 'parent' the id of the path of the directory the file is in.
+ * \param '*name' the name of the file. It must not be empty or contain '/'.
+ * \param 'name_len' the length of 'name' in bytes.
+ * \param 'first_hint' what the walk of the first tree found out about the
+ *     file.
+ * \param 'second_hint' what the walk of the second tree found out about the
+ *     file.
+ * \return the id of the new path.
+ */
+PathId PathTable::add(PathId parent, const char *name, size_t name_len, \
+	unsigned char first_hint, unsigned char second_hint) {
+	/* {{{ */
+	if (blocks.empty() || block_used + name_len > PATH_ARENA_BLOCK_SIZE) {
+		blocks.push_back(std::make_unique<char[]>(PATH_ARENA_BLOCK_SIZE));
+		block_used = 0;
+	}
+
+	std::unique_ptr<PathNode[]> &chunk = \
+		chunks[num_nodes / PATH_NODES_PER_CHUNK];
+	if (chunk == nullptr) {
+		chunk = std::make_unique<PathNode[]>(PATH_NODES_PER_CHUNK);
+	}
+
+	PathNode &n = chunk[num_nodes % PATH_NODES_PER_CHUNK];
+	n.name = blocks.back().get() + block_used;
+	n.parent = parent;
+	n.name_len = (uint16_t) name_len;
+	n.first_hint = first_hint;
+	n.second_hint = second_hint;
+
+	memcpy(blocks.back().get() + block_used, name, name_len);
+	block_used += name_len;
+
+	return (PathId) num_nodes++;
+	/* }}} */
+}
+
+
+/** Returns the number of paths in the table, including the empty path.
+ *
+ * \return the number of paths in the table.
+ */
+size_t PathTable::size() const {
+	/* {{{ */
+	return num_nodes;
+	/* }}} */
+}
+
+
+/** Returns the node of the path with the id 'id'.
+ *
+ * \param 'id' the id of the path.
+ * \return the node of the path.
+ */
+const PathNode &PathTable::node(PathId id) const {
+	/* {{{ */
+	return chunks[id / PATH_NODES_PER_CHUNK][id % PATH_NODES_PER_CHUNK];
+	/* }}} */
+}
+
+
+/** Returns the last component of the path with the id 'id'.
+ *
+ * \param 'id' the id of the path.
+ * \return a view of the name, which stays valid as long as the table does.
+ */
+std::string_view PathTable::name(PathId id) const {
+	/* {{{ */
+	const PathNode &n = node(id);
+
+	return std::string_view(n.name, n.name_len);
+	/* }}} */
+}
+
+
+/** Builds the full relative path with the id 'id' from its components.
+ *
+ * \param 'id' the id of the path.
+ * \return the relative path.
+ */
+fs::path PathTable::path(PathId id) const {
+	/* {{{ */
+	std::vector<PathId> chain;
+	size_t len = 0;
+
+	for (PathId p = id; p != PATH_ID_ROOT; p = node(p).parent) {
+		chain.push_back(p);
+		len += node(p).name_len + 1;
+	}
+
+	std::string ret;
+	ret.reserve(len);
+	for (size_t i = chain.size(); i > 0; i--) {
+		if (i != chain.size()) {
+			ret += '/';
+		}
+		ret += name(chain[i - 1]);
+	}
+
+	return fs::path(std::move(ret));
+	/* }}} */
+}
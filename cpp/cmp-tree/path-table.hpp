@@ -0,0 +1,75 @@
+#ifndef PATH_TABLE_HPP
+#define PATH_TABLE_HPP
+
+/* C++ includes */
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+
+/* The size of each block of the arena the names of paths are stored in.
+ * A name never spans two blocks, so this must be more than NAME_MAX */
+#define PATH_ARENA_BLOCK_SIZE (1024 * 1024)
+/* The number of nodes in each chunk of a PathTable */
+#define PATH_NODES_PER_CHUNK (64 * 1024)
+
+
+typedef uint32_t PathId;
+
+/* The id of the empty relative path, i.e. the roots of the trees */
+#define PATH_ID_ROOT 0
+/* The number of chunks it takes to hold a node for every PathId */
+#define PATH_NUM_CHUNKS (((uint64_t) UINT32_MAX + 1) / PATH_NODES_PER_CHUNK)
+
+
+/* One relative path in a PathTable: the path of its parent, plus a name */
+typedef struct path_node {
+	/* The last component of the path, in the table's arena */
+	const char *name;
+	PathId parent;
+	uint16_t name_len;
+	/* What the walk of each tree found out about the file (see
+	 * get_file_info()) */
+	unsigned char first_hint;
+	unsigned char second_hint;
+}PathNode;
+
+
+/* A table of interned relative paths. Rather than storing every path in
+ * full, each path is a 16-byte node naming its parent and the last
+ * component of the path, and the names themselves are packed one after
+ * another into large blocks of memory. Paths are referred to by their
+ * 32-bit ids. The table is filled by one thread. Nodes and names never move
+ * once they are added, so while the table is being filled any number of
+ * other threads can read the paths already in it, as long as each learns of
+ * an id through something that orders it after the add (a lock, or the task
+ * queue of a ThreadPool). Only the filling thread may call size() until the
+ * table is full. */
+class PathTable {
+public:
+	PathTable();
+
+	PathId add(PathId parent, const char *name, size_t name_len, \
+		unsigned char first_hint, unsigned char second_hint);
+	size_t size() const;
+	const PathNode &node(PathId id) const;
+	std::string_view name(PathId id) const;
+	fs::path path(PathId id) const;
+
+private:
+	/* PATH_NUM_CHUNKS pointers to chunks of PATH_NODES_PER_CHUNK nodes, of
+	 * which only those in use are allocated. The array never grows, so
+	 * readers can index it while nodes are added */
+	std::unique_ptr<std::unique_ptr<PathNode[]>[]> chunks;
+	size_t num_nodes;
+	std::vector<std::unique_ptr<char[]>> blocks;
+	/* The number of bytes of the last block in use */
+	size_t block_used;
+};
+
+#endif
@@ -0,0 +1,213 @@
+/* C++ includes */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/* C includes */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "prefetcher.hpp"
+
+namespace fs = std::filesystem;
+
+
+/* Marks a comparison that has finished in Prefetcher::job_bytes */
+#define PREFETCH_JOB_DONE SIZE_MAX
+/* How long the prefetch thread sleeps for at most when it is as far ahead
+ * as it may go, in case it missed being woken up */
+#define PREFETCH_WAIT_MS 10
+
+
+/** Asks the kernel to start reading up to 'max_bytes' bytes from the start
+ * of the regular file at '&path' into the page cache. Looking the file up
+ * also brings its inode into memory, so even an empty file is worth a
+ * look.
+ *
+ * \param '&path' a file path that points to the file.
+ * \param 'max_bytes' the most bytes to prefetch.
+ * \return the number of bytes prefetched.
+ */
+static size_t prefetch_file(const fs::path &path, size_t max_bytes) {
+	/* {{{ */
+	/* Opening a fifo or a device can block or have side effects (rewinding
+	 * a tape, say), so only regular files are opened. The file is checked
+	 * again once it is open, in case it was replaced in between */
+	struct stat path_info;
+	if (stat(path.c_str(), &path_info) != 0 || !S_ISREG(path_info.st_mode)) {
+		return 0;
+	}
+	int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1) {
+		return 0;
+	}
+
+	struct stat file_info;
+	size_t len = 0;
+	if (fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode) \
+		&& file_info.st_dev == path_info.st_dev \
+		&& file_info.st_ino == path_info.st_ino) {
+		len = std::min((size_t) file_info.st_size, max_bytes);
+		/* The hint isn't charged to the read throttle. The comparison
+		 * charges the same bytes when it reads them, and the budget keeps
+		 * prefetching at most 'byte_budget' bytes ahead of it, so the rates
+		 * still hold over any stretch longer than that */
+		if (len > 0) {
+			posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+		}
+	}
+	close(fd);
+
+	return len;
+	/* }}} */
+}
+
+
+/** Creates a prefetcher that stays at most 'files_ahead' comparisons ahead
+ * and 'byte_budget' bytes ahead of the comparisons. It does nothing until
+ * it is started.
+ *
+ * \param 'files_ahead' the number of comparisons past the last one started
+ *     that may be prefetched.
+ * \param 'byte_budget' the most bytes that may be prefetched for
+ *     comparisons that haven't finished.
+ */
+Prefetcher::Prefetcher(size_t files_ahead, size_t byte_budget) \
+	: files_ahead(files_ahead), byte_budget(byte_budget), in_flight(0), \
+	stopping(false) {}
+
+
+/** Stops the prefetch thread, if it is running.
+ */
+Prefetcher::~Prefetcher() {
+	/* {{{ */
+	stop();
+	/* }}} */
+}
+
+
+/** Starts prefetching for 'num_jobs' comparisons on a thread of its own.
+ *
+ * \param 'num_jobs' the number of comparisons.
+ * \param 'source' the function that gives the paths of each comparison.
+ * \param '*cursor' the number of comparisons that have started. It must
+ *     only ever grow, and must outlive the prefetcher.
+ */
+void Prefetcher::start(size_t num_jobs, PrefetchSource source, \
+	const std::atomic<size_t> *cursor) {
+	/* {{{ */
+	job_bytes = std::make_unique<std::atomic<size_t>[]>(num_jobs);
+	for (size_t i = 0; i < num_jobs; i++) {
+		job_bytes[i].store(0, std::memory_order_relaxed);
+	}
+
+	worker = std::thread(&Prefetcher::run, this, num_jobs, source, cursor);
+	/* }}} */
+}
+
+
+/** Records that comparison 'index' has finished, so the bytes prefetched
+ * for it no longer count against the budget.
+ *
+ * \param 'index' the number of the comparison.
+ */
+void Prefetcher::job_finished(size_t index) {
+	/* {{{ */
+	size_t bytes = job_bytes[index].exchange(PREFETCH_JOB_DONE);
+	if (bytes != 0) {
+		in_flight.fetch_sub(bytes);
+	}
+
+	/* Taking the lock makes sure the prefetch thread is either waiting (and
+	 * is woken up) or hasn't yet checked whether it may go on */
+	{
+		std::lock_guard<std::mutex> guard(lock);
+	}
+	progress.notify_one();
+	/* }}} */
+}
+
+
+/** Stops the prefetch thread and waits for it to exit.
+ */
+void Prefetcher::stop() {
+	/* {{{ */
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	progress.notify_one();
+
+	if (worker.joinable()) {
+		worker.join();
+	}
+	/* }}} */
+}
+
+
+/** The body of the prefetch thread. Comparisons that have started by the
+ * time the thread gets to them are skipped, since it's too late to help
+ * them.
+ *
+ * \param 'num_jobs' the number of comparisons.
+ * \param 'source' the function that gives the paths of each comparison.
+ * \param '*cursor' the number of comparisons that have started.
+ */
+void Prefetcher::run(size_t num_jobs, PrefetchSource source, \
+	const std::atomic<size_t> *cursor) {
+	/* {{{ */
+	size_t pos = 0;
+	fs::path first_path;
+	fs::path second_path;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			progress.wait_for(guard, \
+				std::chrono::milliseconds(PREFETCH_WAIT_MS), [&] {
+				return stopping || pos < cursor->load() \
+					|| (pos < cursor->load() + files_ahead \
+						&& in_flight.load() < byte_budget);
+			});
+			if (stopping) {
+				return;
+			}
+		}
+
+		pos = std::max(pos, cursor->load());
+		if (pos >= num_jobs) {
+			return;
+		}
+		if (pos >= cursor->load() + files_ahead \
+			|| in_flight.load() >= byte_budget) {
+			continue;
+		}
+
+		size_t bytes = 0;
+		if (source(pos, first_path, second_path)) {
+			size_t room = byte_budget - in_flight.load();
+			bytes = prefetch_file(first_path, room);
+			bytes += prefetch_file(second_path, room - bytes);
+		}
+
+		/* The comparison may have finished while its files were being
+		 * prefetched, in which case it has nothing left to give back */
+		if (bytes != 0) {
+			in_flight.fetch_add(bytes);
+			if (job_bytes[pos].exchange(bytes) == PREFETCH_JOB_DONE) {
+				in_flight.fetch_sub(bytes);
+			}
+		}
+		pos++;
+	}
+	/* }}} */
+}
@@ -0,0 +1,63 @@
+#ifndef PREFETCHER_HPP
+#define PREFETCHER_HPP
+
+/* C++ includes */
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+
+/* The default number of bytes of prefetched files that may be waiting in
+ * the page cache for their comparisons to finish */
+#define PREFETCH_BUDGET_DEFAULT (64 * 1024 * 1024)
+
+
+/* A function that fills in the paths of the two files of comparison 'i',
+ * returning false if there's nothing in comparison 'i' worth prefetching
+ * (e.g. because neither file is a regular file) */
+typedef std::function<bool(size_t, fs::path &, fs::path &)> PrefetchSource;
+
+
+/* A pipeline stage that warms the page cache for comparisons that are about
+ * to run. Comparisons are numbered in the order they start, and a thread of
+ * the prefetcher's own opens the files of the comparisons up to
+ * 'files_ahead' past the last one started and asks the kernel to start
+ * reading them (POSIX_FADV_WILLNEED), so that by the time a comparison
+ * starts its files are already in memory. The bytes prefetched for
+ * comparisons that haven't finished never exceed the byte budget, so
+ * prefetching can't push out the data of the comparisons that are running. */
+class Prefetcher {
+public:
+	Prefetcher(size_t files_ahead, size_t byte_budget);
+	~Prefetcher();
+
+	void start(size_t num_jobs, PrefetchSource source, \
+		const std::atomic<size_t> *cursor);
+	void job_finished(size_t index);
+	void stop();
+
+private:
+	void run(size_t num_jobs, PrefetchSource source, \
+		const std::atomic<size_t> *cursor);
+
+	size_t files_ahead;
+	size_t byte_budget;
+	/* The number of bytes prefetched for comparisons that haven't finished */
+	std::atomic<size_t> in_flight;
+	/* For each comparison, the number of bytes prefetched for it, or
+	 * PREFETCH_JOB_DONE once it has finished */
+	std::unique_ptr<std::atomic<size_t>[]> job_bytes;
+	bool stopping;
+	std::mutex lock;
+	std::condition_variable progress;
+	std::thread worker;
+};
+
+#endif
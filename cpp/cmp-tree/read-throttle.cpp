@@ -0,0 +1,202 @@
+/* C++ includes */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/* C includes */
+#include <linux/ioprio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "read-throttle.hpp"
+
+
+/* The throttle every read goes through, or NULL if reading is unlimited */
+static ReadThrottle *installed_throttle = NULL;
+
+
+/** Creates a throttle with the given limits. A limit of 0 means no limit.
+ *
+ * \param 'max_bytes_per_sec' the most bytes that may be read per second.
+ * \param 'max_ops_per_sec' the most read operations per second.
+ * \param 'latency_target' the average read latency, in seconds, above
+ *     which the rates are lowered.
+ */
+ReadThrottle::ReadThrottle(double max_bytes_per_sec, double max_ops_per_sec, \
+	double latency_target) : max_bytes_per_sec(max_bytes_per_sec), \
+	max_ops_per_sec(max_ops_per_sec), latency_target(latency_target), \
+	last_refill(Clock::now()), \
+	byte_tokens(max_bytes_per_sec * THROTTLE_BURST_SECONDS), \
+	op_tokens(max_ops_per_sec * THROTTLE_BURST_SECONDS), scale(1.0), \
+	interval_start(Clock::now()), interval_latency(0), interval_reads(0) {}
+
+
+/** Makes '*throttle' the throttle every read goes through. It must be
+ * installed before any thread starts reading, and outlive every read.
+ *
+ * \param '*throttle' the throttle to install, or NULL for none.
+ */
+void ReadThrottle::install(ReadThrottle *throttle) {
+	/* {{{ */
+	installed_throttle = throttle;
+	/* }}} */
+}
+
+
+/** Returns the throttle every read goes through.
+ *
+ * \return the installed throttle, or NULL if there is none.
+ */
+ReadThrottle *ReadThrottle::installed() {
+	/* {{{ */
+	return installed_throttle;
+	/* }}} */
+}
+
+
+/** Takes 'bytes' bytes and 'ops' operations from the buckets, sleeping for
+ * as long as it takes the buckets to pay back any debt that leaves.
+ *
+ * \param 'bytes' the number of bytes about to be read.
+ * \param 'ops' the number of read operations about to be issued.
+ */
+void ReadThrottle::acquire(size_t bytes, unsigned ops) {
+	/* {{{ */
+	double wait = 0;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		Clock::time_point now = Clock::now();
+		double elapsed = \
+			std::chrono::duration<double>(now - last_refill).count();
+		last_refill = now;
+
+		auto take = [&](double &tokens, double rate, double amount) {
+			if (rate <= 0) {
+				return;
+			}
+			rate *= scale;
+			tokens = std::min(tokens + elapsed * rate, \
+				rate * THROTTLE_BURST_SECONDS);
+			tokens -= amount;
+			if (tokens < 0) {
+				wait = std::max(wait, -tokens / rate);
+			}
+		};
+		take(byte_tokens, max_bytes_per_sec, (double) bytes);
+		take(op_tokens, max_ops_per_sec, (double) ops);
+	}
+
+	if (wait > 0) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+	}
+	/* }}} */
+}
+
+
+/** Records how long a read took, and adjusts the rates once an interval's
+ * worth of reads has been recorded.
+ *
+ * \param 'seconds' how long the read took.
+ */
+void ReadThrottle::report_latency(double seconds) {
+	/* {{{ */
+	if (latency_target <= 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	interval_latency += seconds;
+	interval_reads++;
+
+	Clock::time_point now = Clock::now();
+	if (now - interval_start \
+		< std::chrono::milliseconds(THROTTLE_ADJUST_INTERVAL_MS)) {
+		return;
+	}
+
+	/* Back off quickly when the disks are struggling, and speed up again
+	 * slowly */
+	if (interval_latency / interval_reads > latency_target) {
+		scale = std::max(scale / 2, THROTTLE_MIN_SCALE);
+	} else {
+		scale = std::min(scale + THROTTLE_SCALE_STEP, 1.0);
+	}
+	interval_start = now;
+	interval_latency = 0;
+	interval_reads = 0;
+	/* }}} */
+}
+
+
+/** Passes a read of 'bytes' bytes in 'ops' operations through the installed
+ * throttle (if any), which may sleep. Every read of regular file content
+ * calls this first.
+ *
+ * \param 'bytes' the number of bytes about to be read.
+ * \param 'ops' the number of read operations about to be issued.
+ * \return the time (in nanoseconds) the read started, to be handed to
+ *     read_throttle_end() once it is done, or 0 if there is no throttle.
+ */
+int64_t read_throttle_begin(size_t bytes, unsigned ops) {
+	/* {{{ */
+	if (installed_throttle == NULL) {
+		return 0;
+	}
+	installed_throttle->acquire(bytes, ops);
+
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( \
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	/* }}} */
+}
+
+
+/** Reports the latency of a read started with read_throttle_begin() to the
+ * installed throttle.
+ *
+ * \param 'start' what read_throttle_begin() returned.
+ */
+void read_throttle_end(int64_t start) {
+	/* {{{ */
+	if (installed_throttle == NULL || start == 0) {
+		return;
+	}
+
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>( \
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	installed_throttle->report_latency((double) (now - start) / 1e9);
+	/* }}} */
+}
+
+
+/** Sets the I/O priority class of the calling thread, which the threads it
+ * starts afterwards inherit. Only I/O schedulers that support priorities
+ * (BFQ, and CFQ on older kernels) take any notice of it.
+ *
+ * \param 'io_class' the class to set.
+ * \return 0 on success, -1 if the kernel refused.
+ */
+int set_io_class(enum IoClass io_class) {
+	/* {{{ */
+	int value;
+	switch (io_class) {
+		case IO_CLASS_IDLE:
+			value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+			break;
+		case IO_CLASS_BEST_EFFORT:
+			value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7);
+			break;
+		case IO_CLASS_DEFAULT:
+		default:
+			return 0;
+	}
+
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) != 0) {
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
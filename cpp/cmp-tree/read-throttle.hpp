@@ -0,0 +1,84 @@
+#ifndef READ_THROTTLE_HPP
+#define READ_THROTTLE_HPP
+
+/* C++ includes */
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+
+/* How much reading the token buckets save up while reading is idle, in
+ * seconds' worth of their rates */
+#define THROTTLE_BURST_SECONDS 0.1
+/* How often the latency target adjusts the rates, in milliseconds */
+#define THROTTLE_ADJUST_INTERVAL_MS 100
+/* The slowest the latency target can make reading, as a fraction of the
+ * configured rates */
+#define THROTTLE_MIN_SCALE (1.0 / 64)
+/* How much of the configured rates the latency target gives back after an
+ * interval whose reads were fast enough */
+#define THROTTLE_SCALE_STEP (1.0 / 16)
+/* The size counted as one operation for reads the kernel issues on its own
+ * (page faults on a mapping, read-ahead) */
+#define THROTTLE_OP_SIZE (128 * 1024)
+
+
+enum IoClass {
+	/* Leave the I/O priority of the process alone. */
+	IO_CLASS_DEFAULT,
+	/* Only read when no other process wants the disk. */
+	IO_CLASS_IDLE,
+	/* Share the disk fairly with other processes, at the lowest priority
+	 * within the class. */
+	IO_CLASS_BEST_EFFORT,
+};
+
+
+/* A pair of token buckets, one for bytes and one for read operations, that
+ * every read of regular file content in the program passes through. A read
+ * takes its bytes and operations from the buckets, and if that leaves a
+ * bucket in debt, the reading thread sleeps until the debt would have been
+ * refilled, so the reads of all threads together never run faster than the
+ * rates for long. If a latency target is set, the rates are halved whenever
+ * the reads of an interval took longer than the target on average, and
+ * slowly given back while they don't, so that reading backs off when the
+ * disks get busy. Any number of threads may share a ReadThrottle. */
+class ReadThrottle {
+public:
+	ReadThrottle(double max_bytes_per_sec, double max_ops_per_sec, \
+		double latency_target);
+
+	static void install(ReadThrottle *throttle);
+	static ReadThrottle *installed();
+
+	void acquire(size_t bytes, unsigned ops);
+	void report_latency(double seconds);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	/* The configured rates, 0 for no limit */
+	double max_bytes_per_sec;
+	double max_ops_per_sec;
+	/* The average read latency (in seconds) above which reading slows
+	 * down, 0 for none */
+	double latency_target;
+
+	std::mutex lock;
+	Clock::time_point last_refill;
+	double byte_tokens;
+	double op_tokens;
+	/* The fraction of the configured rates currently allowed */
+	double scale;
+	Clock::time_point interval_start;
+	double interval_latency;
+	size_t interval_reads;
+};
+
+
+int64_t read_throttle_begin(size_t bytes, unsigned ops);
+void read_throttle_end(int64_t start);
+int set_io_class(enum IoClass io_class);
+
+#endif
@@ -0,0 +1,99 @@
+/* C++ includes */
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/* Local includes */
+#include "cmp-tree.hpp"
+#include "reorder-buffer.hpp"
+
+
+/** Creates a reorder buffer that can hold up to 'capacity' comparisons that
+ * have been reserved but not yet handed to '&sink'.
+ *
+ * \param 'capacity' the number of slots in the buffer (at least 1).
+ * \param 'sink' the function every comparison will be handed to, in the
+ *     order the comparisons were reserved. It is never called by more than
+ *     one thread at a time.
+ */
+ReorderBuffer::ReorderBuffer(size_t capacity, ComparisonSink sink) \
+	: slots(capacity > 0 ? capacity : 1), ready(slots.size(), false), \
+	sink(sink), next_seq(0), next_emit(0), emitting(false) {
+}
+
+
+/** Reserves the next slot in the buffer, blocking until one is free. Must
+ * only ever be called from a single producer thread.
+ *
+ * \param '&seq' set to the sequence number of the reserved slot, which must
+ *     later be passed to complete().
+ * \return the slot the comparison should be written to. It belongs to the
+ *     caller (and whichever thread it hands the work to) until complete() is
+ *     called.
+ */
+FullFileComparison *ReorderBuffer::reserve(size_t &seq) {
+	/* {{{ */
+	std::unique_lock<std::mutex> guard(lock);
+	space_available.wait(guard, [this] {
+		return next_seq - next_emit < slots.size();
+	});
+
+	seq = next_seq++;
+	return &slots[seq % slots.size()];
+	/* }}} */
+}
+
+
+/** Marks the slot with the sequence number 'seq' as finished. If it (and
+ * possibly some of the slots after it) are now the oldest outstanding slots,
+ * they are handed to the sink in order and freed for reuse.
+ *
+ * \param 'seq' the sequence number reserve() gave the slot.
+ */
+void ReorderBuffer::complete(size_t seq) {
+	/* {{{ */
+	std::unique_lock<std::mutex> guard(lock);
+	ready[seq % slots.size()] = true;
+
+	/* If another thread is already emitting, it will pick this slot up when it
+	 * gets to it */
+	if (emitting) {
+		return;
+	}
+
+	emitting = true;
+	while (next_emit < next_seq && ready[next_emit % slots.size()]) {
+		size_t index = next_emit % slots.size();
+
+		/* The slot can't be reused until 'next_emit' moves past it, so it is
+		 * safe to hand it to the sink without holding the lock */
+		guard.unlock();
+		sink(slots[index]);
+		slots[index] = FullFileComparison();
+		guard.lock();
+
+		ready[index] = false;
+		next_emit++;
+		space_available.notify_one();
+	}
+	emitting = false;
+
+	if (next_emit == next_seq) {
+		drained.notify_all();
+	}
+	/* }}} */
+}
+
+
+/** Blocks until every reserved slot has been completed and handed to the
+ * sink.
+ */
+void ReorderBuffer::wait_drained() {
+	/* {{{ */
+	std::unique_lock<std::mutex> guard(lock);
+	drained.wait(guard, [this] {
+		return next_emit == next_seq && !emitting;
+	});
+	/* }}} */
+}
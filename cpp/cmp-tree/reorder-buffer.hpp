@@ -0,0 +1,45 @@
+#ifndef REORDER_BUFFER_HPP
+#define REORDER_BUFFER_HPP
+
+/* C++ includes */
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/* Local includes */
+#include "cmp-tree.hpp"
+
+
+typedef std::function<void(FullFileComparison &)> ComparisonSink;
+
+
+/* A fixed-size ring of FullFileComparisons that lets comparisons finish in
+ * any order while handing them to a sink in the order they were reserved.
+ * One producer thread reserves slots (blocking while the ring is full), any
+ * number of threads complete them, and whichever thread completes the oldest
+ * outstanding slot passes every consecutive finished slot to the sink. */
+class ReorderBuffer {
+public:
+	ReorderBuffer(size_t capacity, ComparisonSink sink);
+
+	FullFileComparison *reserve(size_t &seq);
+	void complete(size_t seq);
+	void wait_drained();
+
+private:
+	std::vector<FullFileComparison> slots;
+	std::vector<bool> ready;
+	ComparisonSink sink;
+	/* The sequence number the next reserved slot will get */
+	size_t next_seq;
+	/* The sequence number of the next slot to be handed to the sink */
+	size_t next_emit;
+	/* Whether some thread is currently handing slots to the sink */
+	bool emitting;
+	std::mutex lock;
+	std::condition_variable space_available;
+	std::condition_variable drained;
+};
+
+#endif
@@ -0,0 +1,234 @@
+/* C++ includes */
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* C includes */
+#include <unistd.h>
+
+/* Local includes */
+#include "thread-pool.hpp"
+
+
+/* The pool (if any) that owns the calling thread, and the index of the
+ * calling thread within that pool */
+static thread_local ThreadPool *current_pool = NULL;
+static thread_local size_t current_index = 0;
+
+
+/** Returns the number of jobs to use when the user has not asked for a
+ * specific number: the number of online cores, or 1 if that can't be
+ * determined.
+ *
+ * \return the default number of worker threads.
+ */
+size_t default_num_jobs() {
+	/* {{{ */
+	long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (num_cores < 1) {
+		return 1;
+	}
+
+	return (size_t) num_cores;
+	/* }}} */
+}
+
+
+/** Creates a pool of 'num_workers' worker threads (or 1 if 'num_workers'
+ * is 0), each with its own (initially empty) task deque.
+ *
+ * \param 'num_workers' the number of worker threads to start.
+ */
+ThreadPool::ThreadPool(size_t num_workers) \
+	: num_queued(0), num_pending(0), next_queue(0), stopping(false) {
+	/* {{{ */
+
+	if (num_workers == 0) {
+		num_workers = 1;
+	}
+
+	for (size_t i = 0; i < num_workers; i++) {
+		queues.push_back(std::make_unique<WorkerQueue>());
+	}
+	for (size_t i = 0; i < num_workers; i++) {
+		workers.emplace_back(&ThreadPool::worker_loop, this, i);
+	}
+	/* }}} */
+}
+
+
+/** Waits for every submitted task to finish and then joins all the worker
+ * threads.
+ */
+ThreadPool::~ThreadPool() {
+	/* {{{ */
+	wait_idle();
+
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		stopping = true;
+	}
+	work_available.notify_all();
+
+	for (auto &w: workers) {
+		w.join();
+	}
+	/* }}} */
+}
+
+
+/** Queues a task to be run by one of the workers. Tasks submitted from a
+ * worker of this pool are pushed onto that worker's own deque, while tasks
+ * submitted from any other thread are distributed across the deques
+ * round-robin.
+ *
+ * \param 'task' the task to be run.
+ */
+void ThreadPool::submit(Task task) {
+	/* {{{ */
+	size_t index;
+
+	if (current_pool == this) {
+		index = current_index;
+	} else {
+		index = next_queue.fetch_add(1, std::memory_order_relaxed) \
+			% queues.size();
+	}
+
+	/* Count the task before it becomes visible so that a worker which takes
+	 * it straight away can never decrement either counter below zero */
+	num_pending.fetch_add(1);
+	num_queued.fetch_add(1);
+	{
+		std::lock_guard<std::mutex> guard(queues[index]->lock);
+		queues[index]->tasks.push_back(std::move(task));
+	}
+
+	/* Take the sleep lock so that a worker can't check 'num_queued' and go to
+	 * sleep between our increment and our notification */
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+	}
+	work_available.notify_one();
+	/* }}} */
+}
+
+
+/** Blocks until every task submitted to the pool (including tasks submitted
+ * by other tasks) has finished running. Must not be called from one of the
+ * pool's own workers.
+ */
+void ThreadPool::wait_idle() {
+	/* {{{ */
+	std::unique_lock<std::mutex> guard(sleep_lock);
+	idle.wait(guard, [this] { return num_pending.load() == 0; });
+	/* }}} */
+}
+
+
+/** Returns the number of worker threads in the pool.
+ *
+ * \return the number of worker threads in the pool.
+ */
+size_t ThreadPool::size() const {
+	/* {{{ */
+	return workers.size();
+	/* }}} */
+}
+
+
+/** Returns the index of the calling thread within the pool, which is useful
+ * for indexing per-worker data. Threads that are not workers of this pool
+ * (such as the main thread) all share the index 'size()'.
+ *
+ * \return a number in the range [0, size()].
+ */
+size_t ThreadPool::worker_index() const {
+	/* {{{ */
+	if (current_pool == this) {
+		return current_index;
+	}
+
+	return workers.size();
+	/* }}} */
+}
+
+
+/** Takes a task for the worker at index '&index' to run. The worker's own
+ * deque is tried first (newest task first), then the other workers' deques
+ * (oldest task first).
+ *
+ * \param 'index' the index of the worker looking for a task.
+ * \param '&task' set to the task that was found, if one was found.
+ * \return true if a task was found, false otherwise.
+ */
+bool ThreadPool::pop_task(size_t index, Task &task) {
+	/* {{{ */
+	{
+		WorkerQueue &own = *queues[index];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < queues.size(); i++) {
+		WorkerQueue &victim = *queues[(index + i) % queues.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+	/* }}} */
+}
+
+
+/** The body of every worker thread: run tasks until the pool is destroyed,
+ * sleeping whenever there is nothing to run or steal.
+ *
+ * \param 'index' the index of this worker within the pool.
+ */
+void ThreadPool::worker_loop(size_t index) {
+	/* {{{ */
+	current_pool = this;
+	current_index = index;
+
+	while (true) {
+		Task task;
+
+		if (pop_task(index, task)) {
+			num_queued.fetch_sub(1);
+			task();
+			/* Destroy the task (and anything it captured) before announcing
+			 * that it has finished */
+			task = nullptr;
+
+			if (num_pending.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> guard(sleep_lock);
+				idle.notify_all();
+			}
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(sleep_lock);
+		work_available.wait(guard, [this] {
+			return stopping || num_queued.load() > 0;
+		});
+		if (stopping && num_queued.load() == 0) {
+			return;
+		}
+	}
+	/* }}} */
+}
@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+/* C++ includes */
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+typedef std::function<void()> Task;
+
+
+/* A fixed-size pool of worker threads where each worker owns a deque of
+ * tasks. A worker pops tasks from the back of its own deque (so that tasks it
+ * submitted itself run while their data is still hot in cache) and, when its
+ * own deque is empty, steals tasks from the front of the other workers'
+ * deques. */
+class ThreadPool {
+public:
+	ThreadPool(size_t num_workers);
+	~ThreadPool();
+
+	void submit(Task task);
+	void wait_idle();
+	size_t size() const;
+	size_t worker_index() const;
+
+private:
+	struct WorkerQueue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	bool pop_task(size_t index, Task &task);
+	void worker_loop(size_t index);
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::vector<std::thread> workers;
+	/* The number of tasks sitting in a deque, waiting to be run */
+	std::atomic<size_t> num_queued;
+	/* The number of tasks that have been submitted but have not finished
+	 * running */
+	std::atomic<size_t> num_pending;
+	/* Used to pick a deque for tasks submitted by non-worker threads */
+	std::atomic<size_t> next_queue;
+	bool stopping;
+	std::mutex sleep_lock;
+	std::condition_variable work_available;
+	std::condition_variable idle;
+};
+
+
+size_t default_num_jobs();
+
+#endif
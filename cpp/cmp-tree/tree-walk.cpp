@@ -0,0 +1,168 @@
+/* C++ includes */
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+/* C includes */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Local includes */
+#include "tree-walk.hpp"
+
+namespace fs = std::filesystem;
+
+
+/** Creates the state of a walk of the directory tree rooted at '&root'. When
+ * symlinks are followed, the root itself counts as claimed.
+ *
+ * \param '&root' the file path to the root of the directory tree.
+ * \param 'follow_symlinks' whether symlinks to directories are walked into.
+ */
+TreeWalk::TreeWalk(const fs::path &root, bool follow_symlinks) \
+	: follow_symlinks(follow_symlinks), unreadable(false) {
+	/* {{{ */
+	if (!follow_symlinks) {
+		return;
+	}
+
+	char *resolved = realpath(root.c_str(), NULL);
+	if (resolved != NULL) {
+		real_root = resolved;
+		free(resolved);
+	}
+
+	struct stat root_info;
+	if (stat(root.c_str(), &root_info) == 0) {
+		claim(root_info.st_dev, root_info.st_ino);
+	}
+	/* }}} */
+}
+
+
+/** Returns whether symlinks are followed by this walk.
+ *
+ * \return true if symlinks to directories are walked into, false otherwise.
+ */
+bool TreeWalk::follows_symlinks() const {
+	/* {{{ */
+	return follow_symlinks;
+	/* }}} */
+}
+
+
+/** Records that the directory with the given device and inode numbers is
+ * being walked.
+ *
+ * \param 'dev' the device number of the directory.
+ * \param 'ino' the inode number of the directory.
+ * \return true if the directory had not been claimed before (and so should
+ *     be walked now), false if it had.
+ */
+bool TreeWalk::claim(uint64_t dev, uint64_t ino) {
+	/* {{{ */
+	std::lock_guard<std::mutex> guard(visited_lock);
+	return visited.insert({ dev, ino }).second;
+	/* }}} */
+}
+
+
+/** Decides whether an entry of a directory the walk is reading may be
+ * descended into. Directories always may be. Symlinks only may be when they
+ * are followed, and then only if they point to a directory that lies
+ * outside the tree; such a link is only actually walked into if
+ * claim_link() says so, which the walk must ask once it reaches the link in
+ * sorted path order.
+ *
+ * \param '&dir_path' the file path to the directory being read.
+ * \param 'dir_fd' a file descriptor for the directory being read.
+ * \param '&name' the name of the entry.
+ * \param 'type' the DT_* type of the entry itself (not of the file it
+ *     points to, if it is a symlink).
+ * \return true if the entry may be walked into, false otherwise.
+ */
+bool TreeWalk::descend_into(const fs::path &dir_path, int dir_fd, \
+	const std::string &name, unsigned char type) {
+	/* {{{ */
+	if (type == DT_DIR) {
+		return true;
+	}
+
+	struct stat info;
+	if (!follow_symlinks || type != DT_LNK \
+		|| fstatat(dir_fd, name.c_str(), &info, 0) != 0 \
+		|| !S_ISDIR(info.st_mode)) {
+		return false;
+	}
+
+	/* A symlink to a directory in the tree (including any of the link's own
+	 * ancestors) leads to a directory the walk reaches without it. Deciding
+	 * this by path rather than by which of the two the walk happens to reach
+	 * first keeps the output the same from run to run */
+	char *resolved = realpath((dir_path / name).c_str(), NULL);
+	if (resolved == NULL) {
+		return false;
+	}
+	std::string target = resolved;
+	free(resolved);
+	if (!real_root.empty() && target.compare(0, real_root.size(), \
+		real_root) == 0 && (target.size() == real_root.size() \
+		|| target[real_root.size()] == '/' || real_root == "/")) {
+		return false;
+	}
+
+	return true;
+	/* }}} */
+}
+
+
+/** Claims the directory a symlink that descend_into() allowed leads to. The
+ * first link to claim a directory is the one that gets walked into, so
+ * walks must call this in sorted path order, depth first, and only from
+ * one thread at a time.
+ *
+ * \param '&link_path' the file path to the symlink.
+ * \return true if the link should be walked into, false if another link to
+ *     the same directory was claimed first (or the link no longer leads to
+ *     a directory).
+ */
+bool TreeWalk::claim_link(const fs::path &link_path) {
+	/* {{{ */
+	struct stat info;
+	if (stat(link_path.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+		return false;
+	}
+
+	return claim(info.st_dev, info.st_ino);
+	/* }}} */
+}
+
+
+/** Reports that a directory of the tree couldn't be read in full, so that
+ * the walk can't know every file in it.
+ *
+ * \param '&dir_path' the file path to the directory.
+ */
+void TreeWalk::report_unreadable(const fs::path &dir_path) {
+	/* {{{ */
+	std::cerr << "Was not able to open the directory " << dir_path << "\n";
+	unreadable.store(true);
+	/* }}} */
+}
+
+
+/** Returns whether any directory of the tree couldn't be read in full.
+ *
+ * \return true if report_unreadable() has been called, false otherwise.
+ */
+bool TreeWalk::found_unreadable() const {
+	/* {{{ */
+	return unreadable.load();
+	/* }}} */
+}
@@ -0,0 +1,54 @@
+#ifndef TREE_WALK_HPP
+#define TREE_WALK_HPP
+
+/* C++ includes */
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace fs = std::filesystem;
+
+
+/* Decides which entries a walk of one directory tree descends into. By
+ * default only real directories are walked, and symlinks are left as
+ * symlinks. When symlinks are followed, symlinks to directories outside the
+ * tree are walked too, but only once the walk has claimed the directory
+ * they lead to (see claim_link()), so that no directory is walked through
+ * two links and a link to one of its own ancestors can't send the walk
+ * round in circles. Walks claim links in sorted path order, depth first, so
+ * of several links to the same directory it is always the first in that
+ * order that gets walked, and identical trees make identical choices. Real
+ * directories are never claimed. The walk also keeps track of whether any
+ * directory of the tree couldn't be read (see report_unreadable()). Any
+ * number of threads may share a TreeWalk. */
+class TreeWalk {
+public:
+	TreeWalk(const fs::path &root, bool follow_symlinks);
+
+	bool follows_symlinks() const;
+	bool descend_into(const fs::path &dir_path, int dir_fd, \
+		const std::string &name, unsigned char type);
+	bool claim_link(const fs::path &link_path);
+	void report_unreadable(const fs::path &dir_path);
+	bool found_unreadable() const;
+
+private:
+	bool claim(uint64_t dev, uint64_t ino);
+
+	bool follow_symlinks;
+	/* The root of the tree with every symlink in it resolved. Symlinks to
+	 * directories under it are never followed, since those directories are
+	 * walked under their own names anyway */
+	std::string real_root;
+	std::mutex visited_lock;
+	/* The device and inode numbers of the directories claimed so far */
+	std::set<std::pair<uint64_t, uint64_t>> visited;
+	/* Whether a directory of the tree couldn't be read in full */
+	std::atomic<bool> unreadable;
+};
+
+#endif
@@ -0,0 +1,399 @@
+/* C++ includes */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+/* C includes */
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Local includes */
+#include "compare-kernel.hpp"
+#include "read-throttle.hpp"
+#include "uring-engine.hpp"
+
+
+/* The number of registered buffers. Every chunk in flight needs one buffer
+ * for each of the two files */
+#define URING_NUM_BUFFERS (2 * URING_CHUNKS_IN_FLIGHT)
+
+
+/* glibc has no wrappers for the io_uring system calls {{{ */
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, \
+	unsigned flags) {
+
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, \
+		flags, NULL, 0);
+}
+
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, \
+	unsigned nr_args) {
+
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+/* }}} */
+
+
+/** Sets up an io_uring instance with room for 2 * URING_CHUNKS_IN_FLIGHT
+ * reads and registers the engine's read buffers with it. If the kernel does
+ * not support io_uring (or it has been disabled), the engine is left
+ * unusable; check with usable() before use.
+ */
+UringEngine::UringEngine() \
+	: ring_fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sq_ring_len(0), \
+	cq_ring_len(0), sqes((struct io_uring_sqe *) MAP_FAILED), sqes_len(0), \
+	num_unsubmitted(0), buffers(NULL), fixed_buffers(false), failed(false) {
+	/* {{{ */
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring_fd = io_uring_setup(URING_NUM_BUFFERS, &params);
+	if (ring_fd < 0) {
+		ring_fd = -1;
+		return;
+	}
+
+	/* Map the submission and completion queue rings (which newer kernels
+	 * let us do with a single mapping) and the array of SQEs */
+	sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_len = params.cq_off.cqes \
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_ring_len = std::max(sq_ring_len, cq_ring_len);
+		cq_ring_len = sq_ring_len;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, \
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED) {
+		close(ring_fd);
+		ring_fd = -1;
+		return;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, \
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED) {
+			munmap(sq_ring, sq_ring_len);
+			sq_ring = MAP_FAILED;
+			close(ring_fd);
+			ring_fd = -1;
+			return;
+		}
+	}
+
+	sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *) mmap(NULL, sqes_len, \
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, \
+		IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_len);
+		munmap(sq_ring, sq_ring_len);
+		sq_ring = MAP_FAILED;
+		cq_ring = MAP_FAILED;
+		close(ring_fd);
+		ring_fd = -1;
+		return;
+	}
+
+	char *sq = (char *) sq_ring;
+	char *cq = (char *) cq_ring;
+	sq_head = (unsigned *) (sq + params.sq_off.head);
+	sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	sq_array = (unsigned *) (sq + params.sq_off.array);
+	cq_head = (unsigned *) (cq + params.cq_off.head);
+	cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	/* Allocate the read buffers and try to register them, which saves the
+	 * kernel from mapping the user pages on every read. If registration
+	 * fails (e.g. RLIMIT_MEMLOCK is too low) plain reads are used instead */
+	void *mem;
+	if (posix_memalign(&mem, 4096, \
+		(size_t) URING_NUM_BUFFERS * URING_CHUNK_SIZE) != 0) {
+
+		buffers = NULL;
+		return;
+	}
+	buffers = (char *) mem;
+
+	struct iovec iovecs[URING_NUM_BUFFERS];
+	for (unsigned i = 0; i < URING_NUM_BUFFERS; i++) {
+		iovecs[i].iov_base = buffers + (size_t) i * URING_CHUNK_SIZE;
+		iovecs[i].iov_len = URING_CHUNK_SIZE;
+	}
+	fixed_buffers = (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, \
+		iovecs, URING_NUM_BUFFERS) == 0);
+	/* }}} */
+}
+
+
+/** Tears down the io_uring instance and frees the read buffers.
+ */
+UringEngine::~UringEngine() {
+	/* {{{ */
+	if (sqes != MAP_FAILED) munmap(sqes, sqes_len);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+		munmap(cq_ring, cq_ring_len);
+	}
+	if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_len);
+	if (ring_fd != -1) close(ring_fd);
+	free(buffers);
+	/* }}} */
+}
+
+
+/** Returns the calling thread's engine, creating it on first use. Once
+ * setting up an engine has failed, no thread tries again.
+ *
+ * \return the calling thread's engine, or NULL if io_uring is unavailable.
+ */
+UringEngine *UringEngine::for_this_thread() {
+	/* {{{ */
+	static std::atomic<bool> unavailable(false);
+	static thread_local std::unique_ptr<UringEngine> engine;
+
+	if (unavailable.load(std::memory_order_relaxed)) {
+		return NULL;
+	}
+
+	if (!engine || !engine->usable()) {
+		engine = std::make_unique<UringEngine>();
+		if (!engine->usable()) {
+			engine.reset();
+			unavailable.store(true, std::memory_order_relaxed);
+			return NULL;
+		}
+	}
+
+	return engine.get();
+	/* }}} */
+}
+
+
+/** Returns whether the engine was set up successfully.
+ *
+ * \return true if the engine can be used, false otherwise.
+ */
+bool UringEngine::usable() const {
+	/* {{{ */
+	return ring_fd != -1 && sqes != MAP_FAILED && buffers != NULL && !failed;
+	/* }}} */
+}
+
+
+/** Adds a read of 'len' bytes at 'offset' in the file 'fd' into buffer
+ * 'buf_index' (starting 'buf_offset' bytes into the buffer) to the submission
+ * queue. The read is not submitted until the next call to submit_and_wait().
+ *
+ * \param 'fd' the file descriptor to read from.
+ * \param 'buf_index' the index of the buffer to read into.
+ * \param 'buf_offset' the offset into the buffer to read into.
+ * \param 'offset' the offset into the file to start reading at.
+ * \param 'len' the number of bytes to read.
+ * \param 'user_data' the value the read's completion will carry.
+ */
+void UringEngine::queue_read(int fd, unsigned buf_index, unsigned buf_offset, \
+	off_t offset, unsigned len, uint64_t user_data) {
+	/* {{{ */
+
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = (uint64_t) offset;
+	sqe->addr = (uint64_t) (uintptr_t) \
+		(buffers + (size_t) buf_index * URING_CHUNK_SIZE + buf_offset);
+	sqe->len = len;
+	sqe->buf_index = fixed_buffers ? buf_index : 0;
+	sqe->user_data = user_data;
+
+	sq_array[index] = index;
+	/* Make the SQE visible to the kernel before the new tail */
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	num_unsubmitted++;
+	/* }}} */
+}
+
+
+/** Submits every queued read and waits for at least one completion.
+ *
+ * \return 0 on success, -1 if io_uring_enter() failed.
+ */
+int UringEngine::submit_and_wait() {
+	/* {{{ */
+	while (true) {
+		int ret = io_uring_enter(ring_fd, num_unsubmitted, 1, \
+			IORING_ENTER_GETEVENTS);
+		if (ret >= 0) {
+			num_unsubmitted -= std::min((unsigned) ret, num_unsubmitted);
+			return 0;
+		}
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	/* }}} */
+}
+
+
+/** Takes file descriptors for two regular files that are both 'size' bytes
+ * long and returns 0 if the files are byte-for-byte identical, and -1 if
+ * they are not. Reads of up to URING_CHUNKS_IN_FLIGHT chunks of both files
+ * are kept in flight at once. Whenever both halves of a chunk have arrived
+ * (in whatever order the device finished them) the chunk is compared and its
+ * buffers are reused for the next chunk. Once a difference is found no new
+ * reads are issued, and only the chunks in flight before the difference are
+ * still compared, so that the first differing byte can be reported.
+ *
+ * \param 'first_fd' a file descriptor for the first file, open for reading.
+ * \param 'second_fd' a file descriptor for the second file, open for reading.
+ * \param 'size' the size in bytes of both files.
+ * \param '*cancel' if not NULL, the comparison gives up (and fails) once
+ *     this becomes true.
+ * \param '*mismatch_offset' set to the offset of the first byte at which the
+ *     files differ, if a difference is found.
+ * \return 0 if the files are byte-for-byte identical, -1 otherwise.
+ */
+int UringEngine::compare_files(int first_fd, int second_fd, off_t size, \
+	const std::atomic<bool> *cancel, off_t *mismatch_offset) {
+	/* {{{ */
+
+	struct chunk_state {
+		off_t offset;
+		unsigned len;
+		/* The number of bytes read so far into each file's buffer */
+		unsigned done[2];
+		/* When the chunk's reads were issued (see read_throttle_begin()) */
+		int64_t start;
+	};
+	struct chunk_state chunks[URING_CHUNKS_IN_FLIGHT];
+	int fds[2] = { first_fd, second_fd };
+
+	off_t next_offset = 0;
+	unsigned num_in_flight = 0;
+	/* The offset of the first difference found so far, or 'size' if none
+	 * has been found. Chunks complete out of order, so this can still move
+	 * backwards until every read in flight has completed */
+	off_t diff_offset = size;
+	bool read_failed = false;
+
+	/* Buffer '2 * slot + side' holds the data for file 'side' of the chunk in
+	 * slot 'slot', and reads carry that index as their user data */
+	auto start_chunk = [&](unsigned slot) {
+		chunks[slot].offset = next_offset;
+		chunks[slot].len = (unsigned) std::min((off_t) URING_CHUNK_SIZE, \
+			size - next_offset);
+		chunks[slot].done[0] = 0;
+		chunks[slot].done[1] = 0;
+		chunks[slot].start = read_throttle_begin(2 * chunks[slot].len, 2);
+		next_offset += chunks[slot].len;
+
+		for (unsigned side = 0; side < 2; side++) {
+			queue_read(fds[side], 2 * slot + side, 0, chunks[slot].offset, \
+				chunks[slot].len, 2 * slot + side);
+			num_in_flight++;
+		}
+	};
+
+	for (unsigned slot = 0; slot < URING_CHUNKS_IN_FLIGHT \
+		&& next_offset < size; slot++) {
+
+		start_chunk(slot);
+	}
+
+	while (num_in_flight > 0) {
+		if (submit_and_wait() != 0) {
+			/* Without io_uring_enter() we can't wait for the reads still in
+			 * flight, and their buffers may still be written to. Retire the
+			 * engine rather than ever reuse them */
+			failed = true;
+			return -1;
+		}
+
+		unsigned head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+			unsigned buf_index = (unsigned) cqe->user_data;
+			int res = cqe->res;
+			head++;
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+			num_in_flight--;
+
+			unsigned slot = buf_index / 2;
+			unsigned side = buf_index % 2;
+			struct chunk_state &c = chunks[slot];
+
+			/* A failed read, or a file that ended early, means the files
+			 * can't be shown to be identical */
+			if (res <= 0) {
+				read_failed = true;
+				continue;
+			}
+			/* Nothing at or after a known difference matters any more */
+			if (read_failed || c.offset >= diff_offset) {
+				continue;
+			}
+
+			c.done[side] += (unsigned) res;
+			/* A short read: ask for the rest of the chunk */
+			if (c.done[side] < c.len) {
+				queue_read(fds[side], buf_index, c.done[side], \
+					c.offset + c.done[side], c.len - c.done[side], buf_index);
+				num_in_flight++;
+				continue;
+			}
+
+			/* Both halves of the chunk are in: compare them and, if they
+			 * match, reuse the slot for the next chunk */
+			if (c.done[0] == c.len && c.done[1] == c.len) {
+				read_throttle_end(c.start);
+				char *first_buf = buffers + (size_t) (2 * slot) * URING_CHUNK_SIZE;
+				char *second_buf = first_buf + URING_CHUNK_SIZE;
+				size_t diff = first_mismatch(first_buf, second_buf, c.len);
+
+				if (diff != c.len) {
+					diff_offset = std::min(diff_offset, c.offset + (off_t) diff);
+				} else if (cancel != NULL \
+					&& cancel->load(std::memory_order_relaxed)) {
+					read_failed = true;
+				} else if (diff_offset == size && next_offset < size) {
+					start_chunk(slot);
+				}
+			}
+		}
+	}
+
+	if (read_failed) {
+		return -1;
+	}
+	if (diff_offset != size) {
+		*mismatch_offset = diff_offset;
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
@@ -0,0 +1,65 @@
+#ifndef URING_ENGINE_HPP
+#define URING_ENGINE_HPP
+
+/* C++ includes */
+#include <atomic>
+#include <cstdint>
+
+/* C includes */
+#include <linux/io_uring.h>
+#include <sys/types.h>
+
+
+/* The size of each read the io_uring engine issues */
+#define URING_CHUNK_SIZE (128 * 1024)
+/* The number of chunks of a file pair the io_uring engine keeps reads in
+ * flight for. Two reads (one per file) are in flight for each chunk */
+#define URING_CHUNKS_IN_FLIGHT 8
+
+
+/* An io_uring instance together with a set of registered buffers, used to
+ * compare pairs of files with many reads in flight at once. Every worker
+ * thread gets its own engine (see for_this_thread()), so with N workers up to
+ * N * 2 * URING_CHUNKS_IN_FLIGHT reads spread over N file pairs are
+ * outstanding at any moment. */
+class UringEngine {
+public:
+	UringEngine();
+	~UringEngine();
+
+	static UringEngine *for_this_thread();
+	bool usable() const;
+	int compare_files(int first_fd, int second_fd, off_t size, \
+		const std::atomic<bool> *cancel, off_t *mismatch_offset);
+
+private:
+	void queue_read(int fd, unsigned buf_index, unsigned buf_offset, \
+		off_t offset, unsigned len, uint64_t user_data);
+	int submit_and_wait();
+
+	int ring_fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_len;
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* The number of SQEs queued since the last io_uring_enter() */
+	unsigned num_unsubmitted;
+	/* 2 * URING_CHUNKS_IN_FLIGHT buffers of URING_CHUNK_SIZE bytes each */
+	char *buffers;
+	/* Whether 'buffers' could be registered with the kernel */
+	bool fixed_buffers;
+	/* Whether io_uring_enter() failed with reads still in flight */
+	bool failed;
+};
+
+#endif